@@ -0,0 +1,485 @@
+// rcv.h: header file for Ranked Choice Voting
+
+#ifndef RCV_H
+#define RCV_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_CANDIDATES 32767        // maximum number of candidates in an election
+#define MAX_NAME       128          // maximum length of candidate names
+#define NO_CANDIDATE   -1           // indicates no candidate preference
+
+// candidate_status[] values
+#define CAND_ACTIVE    'A'          // candidate still in the election
+#define CAND_MINVOTES  'M'          // candidate has the minimum votes this round
+#define CAND_DROPPED   'D'          // candidate eliminated from the election
+#define CAND_ELECTED   'E'          // candidate has won a seat in an STV count
+
+// return values for tally_condition()
+#define TALLY_ERROR    1
+#define TALLY_WINNER   2
+#define TALLY_TIE      3
+#define TALLY_CONTINUE 4
+
+// LOG_LEVEL thresholds for various messages
+#define LOG_DROP_MINVOTES  1
+#define LOG_MINVOTE        1
+#define LOG_VOTE_TRANSFERS 2
+#define LOG_SHOWVOTES      3
+#define LOG_FILEIO         4
+
+// Messages above LOG_MAX_LEVEL are left out of the program entirely;
+// build with -DLOG_MAX_LEVEL=0 for no logging code at all
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL      LOG_FILEIO
+#endif
+
+// Non-zero if messages at `level` should be printed; a constant 0 for
+// levels above LOG_MAX_LEVEL so the compiler removes their code
+#define LOG_ENABLED(level) (LOG_MAX_LEVEL >= (level) && LOG_LEVEL >= (level))
+
+#define LOG_RING_SIZE      (1 << 23)  // bytes in a log ring, a power of 2
+#define LOG_RING_CHUNK     (1 << 16)  // bytes printed before they are copied into the ring
+#define LOG_RING_WAIT_USEC 50         // pause while a log ring is full
+#define LOG_RING_IDLE_USEC 500        // pause of the writer thread while a log ring is empty
+
+// Output written to a file by a background thread, see rcv_log.c
+typedef struct log_ring log_ring_t;
+
+typedef uint16_t cand_t;              // candidate index as stored in a wide ranking
+
+// A single ballot: the preference order of candidates for one voter.
+// Only the `len` preferences before the first NO_CANDIDATE are kept so
+// a vote is sized for its ranking, see VOTE_SIZE(). Elections of up to
+// 256 candidates store each preference in one byte, larger ones as a
+// cand_t; read them with VOTE_RANK().
+typedef struct vote {
+  int id;                               // unique id for the vote, 1-based in file order
+  int pos;                              // index in candidate_order[] of the current choice
+  int weight;                           // number of identical ballots this vote stands for
+  uint16_t len;                         // number of preferences in candidate_order[]
+  uint16_t rank_size;                   // bytes per preference, 1 or sizeof(cand_t)
+  struct vote *next;                    // next vote in the candidate's list
+  uint8_t candidate_order[];            // candidate indices in preference order
+} vote_t;
+
+// bytes per preference of the votes of an election of `count` candidates
+#define VOTE_RANK_SIZE(count) ((count) <= 256 ? 1 : sizeof(cand_t))
+
+// bytes taken by a vote with `len` preferences of `rank_size` bytes, a multiple of 8
+#define VOTE_SIZE(len, rank_size) ((sizeof(vote_t) + (size_t) (len) * (rank_size) + 7) & ~(size_t) 7)
+
+// preference `i` of `vote`, whichever size its preferences are
+#define VOTE_RANK(vote, i) ((vote)->rank_size == 1 ? (vote)->candidate_order[i] : \
+                            ((cand_t *) (vote)->candidate_order)[i])
+
+#define VOTE_SLAB_MIN (1 << 16)     // bytes in the first arena slab of a tally
+#define VOTE_SLAB_MAX (1 << 26)     // slabs double in size up to this many bytes
+
+// A slab of votes owned by a tally; votes are handed out from it by
+// bumping `used` so loading a tally does not malloc() each vote.
+// Votes differ in size so they are reached with vote_slab_next().
+typedef struct vote_slab {
+  struct vote_slab *next;               // next slab in allocation order
+  size_t used;                          // bytes handed out so far
+  size_t capacity;                      // bytes in data[]
+  size_t vote_count;                    // number of votes handed out so far
+  uint64_t data[];                      // storage for the votes, 8-byte aligned
+} vote_slab_t;
+
+typedef int16_t rank_t;               // candidate index in a vote matrix row
+
+// The votes of one candidate in a vote matrix: row numbers used as a
+// stack whose last entry is the front of the pile.
+typedef struct {
+  int *rows;                            // row numbers of the votes
+  int len;                              // number of rows on the pile
+  int capacity;                         // allocated entries in rows[]
+} vote_pile_t;
+
+// Rows of a live tally's ballots in vote matrix layout, shared with
+// the snapshots taken of it, see rcv_live.c
+typedef struct {
+  int refs;                             // the live tally and snapshots using the block
+  int capacity;                         // rows allocated in each array
+  int width;                            // preferences per row
+  rank_t *ranks;                        // capacity x width preferences
+  int *ids;                             // vote id of each row
+  int *weights;                         // ballots per row, NULL if all are 1
+} live_block_t;
+
+// Struct-of-arrays storage for the votes of a tally, see rcv_matrix.c
+typedef struct {
+  int vote_count;                       // number of rows (votes)
+  int capacity;                         // rows allocated in each array
+  int width;                            // preferences per row, the longest ranking
+  rank_t *ranks;                        // vote_count x width preferences
+  int *pos;                             // current position in each row
+  int *ids;                             // vote id of each row
+  int *weights;                         // ballots per row, NULL if all are 1
+  int pile_count;                       // entries in piles[], the candidate count
+  vote_pile_t *piles;                   // rows currently assigned to each candidate
+  vote_pile_t invalid;                  // rows with no first preference
+  vote_pile_t exhausted;                // rows with no active preference left
+  vote_t *view;                         // scratch vote of width preferences for logging
+  live_block_t *block;                  // holder of ranks, ids and weights if shared, else NULL
+} vote_matrix_t;
+
+// Sets of candidates as bits of 64-bit words, bit c % 64 of word c / 64
+#define CAND_SET_WORDS(count) (((count) + 63) / 64)
+#define CAND_SET_HAS(set, c)  (((set)[(c) >> 6] >> ((c) & 63)) & 1)
+
+// Bookkeeping kept up to date during tally_election() so rounds don't
+// rescan every candidate, see rcv_rounds.c
+typedef struct {
+  int total_votes;                      // sum of all candidate counts, the continuing ballots
+  int active_count;                     // candidates with status CAND_ACTIVE
+  uint64_t *active;                     // set of the candidates with status CAND_ACTIVE
+  int *minvote;                         // CAND_MINVOTES candidates in index order
+  int minvote_len;                      // entries in minvote[]
+  int *heap;                            // candidates not DROPPED as a min-heap by count
+  int *heap_pos;                        // position of each candidate in heap[], -1 if absent
+  int *heap_key;                        // count of each candidate as of its last heap update
+  int heap_len;                         // entries in heap[]
+  char *touched;                        // 1 if the count changed since the last repair
+  int *touched_list;                    // the candidates with touched[] set
+  int touched_len;                      // entries in touched_list[]
+  int error;                            // 1 if some candidate had an unknown status
+} round_index_t;
+
+#define SPILL_MEMORY     (1 << 26)    // bytes of write buffers shared by the runs of a spill
+#define SPILL_BUFFER_MIN (1 << 12)    // fewest bytes buffered per run
+#define SPILL_BUFFER_MAX (1 << 20)    // most bytes buffered per run
+#define SPILL_BLOCK      (1 << 20)    // bytes read at a time when walking a run
+
+// One candidate's pile in a spill: a run file of vote records and the
+// records appended since it was last written, see rcv_spill.c
+typedef struct {
+  char *buf;                            // records not yet written to the file
+  size_t len;                           // bytes used in buf
+  size_t file_len;                      // bytes in the run file
+  long count;                           // records in the file and buf
+} spill_run_t;
+
+// External-memory storage for the votes of a tally, see rcv_spill.c
+typedef struct {
+  char *dir;                            // directory holding the run files
+  int run_count;                        // candidates + invalid votes + exhausted votes
+  spill_run_t *runs;                    // run of each candidate, then the invalid and exhausted runs
+  size_t buffer_size;                   // bytes in each run's buf
+  char *block;                          // SPILL_BLOCK bytes for reading runs
+  vote_t *view;                         // scratch vote of candidate_count preferences
+  int error;                            // 1 once a run file couldn't be read or written
+} vote_spill_t;
+
+// Phases of an election timed by tally stats
+#define STAT_LOAD      0            // reading the votes file
+#define STAT_DROP      1            // dropping candidates and transferring their votes
+#define STAT_MINVOTE   2            // finding the MINVOTES candidates and the condition
+#define STAT_PRINT     3            // reporting rounds and listing votes
+#define STAT_PHASES    4
+
+// Timings and counters kept for a tally when COLLECT_STATS is set,
+// see rcv_stats.c
+typedef struct {
+  double phase_sec[STAT_PHASES];        // wall time spent in each phase
+  double *round_drop_sec;               // STAT_DROP time of each round
+  int rounds;                           // rounds run
+  int round_capacity;                   // entries allocated in round_drop_sec[]
+  long ballots_loaded;                  // ballots in the tally after loading
+  long ballots_transferred;             // ballots moved on to another candidate
+  long ballots_exhausted;               // ballots found with no active preference left
+  long nodes_visited;                   // votes visited by transfers and vote listings
+} tally_stats_t;
+
+// Head-to-head counts of a tally's ballots kept when PAIRWISE is set,
+// see rcv_pairwise.c
+typedef struct {
+  int candidate_count;                  // rows and columns of above[]
+  int *above;                           // [a * candidate_count + b]: ballots ranking a then b
+  int *ranked;                          // ballots ranking each candidate at all
+  unsigned *seen;                       // stamp of the last ballot ranking each candidate
+  unsigned stamp;                       // stamp of the ballot being added
+  int *order;                           // the ballot being added without repeats
+} pairwise_t;
+
+// A tally of votes for an election: candidate info and the list of
+// votes currently assigned to each candidate. The per-candidate arrays
+// have candidate_count entries, see tally_set_candidate_count().
+typedef struct {
+  int candidate_count;                            // number of candidates in the election
+  char (*candidate_names)[MAX_NAME];              // names of candidates
+  vote_t **candidate_votes;                       // linked lists of votes per candidate
+  int *candidate_vote_counts;                     // length of each candidate's list
+  char *candidate_status;                         // CAND_ACTIVE / CAND_MINVOTES / CAND_DROPPED
+  int *candidate_scratch;                         // candidate_count ints for loaders and round steps
+  vote_t *invalid_votes;                          // MAKEUP: list of invalid votes
+  int invalid_vote_count;                         // MAKEUP: count of invalid votes
+  vote_t *exhausted_votes;                        // votes with no active preference left
+  int exhausted_vote_count;                       // count of exhausted votes
+  int round_exhausted_count;                      // votes exhausted by the latest drops
+  vote_slab_t *vote_slabs;                        // arena owning all votes, NULL if votes are malloc()'d
+  vote_slab_t *vote_slab_last;                    // slab currently being filled
+  vote_matrix_t *matrix;                          // struct-of-arrays votes, NULL when votes are in lists
+  round_index_t *rounds;                          // round bookkeeping during tally_election(), else NULL
+  vote_spill_t *spill;                            // run files holding the votes, NULL when they are in memory
+  tally_stats_t *stats;                           // timings and counters, NULL unless COLLECT_STATS
+  pairwise_t *pairwise;                           // head-to-head counts, NULL unless PAIRWISE
+  int rounds_done;                                // rounds completed by tally_election(), as saved in a checkpoint
+} tally_t;
+
+// RESULT_FORMAT values, see rcv_sink.c
+#define RESULT_TABLE   0            // text headlines and tables
+#define RESULT_JSON    1            // one JSON object per line
+#define RESULT_CSV     2            // comma separated rows
+
+#define RESULT_BUFFER  (1 << 20)    // bytes buffered before output is written
+#define VOTE_PRINT_CHUNK 4096       // vote_print() writes long rankings in pieces this large
+
+// Receives the results of tally_election() as they are determined
+// and writes them in some format to tally_out(), see rcv_sink.c
+typedef struct {
+  void (*contest)(char *fname);                           // a batch contest is starting
+  void (*round_begin)(tally_t *tally, int round);         // before the round's drops
+  void (*round_end)(tally_t *tally, int round);           // the tally after the round's drops
+  void (*result)(tally_t *tally, int round, int condition);  // how the election ended
+  void (*stats)(tally_t *tally);                          // the tally's stats after the election
+  void (*stv_round)(tally_t *tally, int round, long *totals, long quota, long exhausted);  // an STV round's values
+  void (*stv_result)(tally_t *tally, int round, int *elected, int count);   // the seats of an STV count
+  void (*pairwise)(tally_t *tally);                       // the tally's head-to-head counts after the election
+  void (*error)(char *message);                           // an error, such as a rejected vote line
+} result_sink_t;
+
+#define STV_SCALE      100000       // fixed-point units in the value of one ballot in STV counts
+
+#define VOTE_READER_CHUNK (1 << 16)  // initial buffer size when a votes file is streamed
+
+// Line reader for votes files: the file is either memory-mapped in
+// full or streamed through a growable buffer.
+typedef struct {
+  int fd;                               // open file descriptor
+  char *data;                           // mapped file or read buffer
+  size_t len;                           // number of valid bytes in data
+  size_t pos;                           // offset of the next unread byte
+  size_t capacity;                      // size of the read buffer when streaming
+  int mapped;                           // 1 if data is an mmap() of the whole file
+  int eof;                              // 1 once all of the file is in data
+  int error;                            // 1 if reading failed
+  long line;                            // line number of the last line returned
+} vote_reader_t;
+
+#define RCVB_MAGIC        "RCVB"      // first 4 bytes of a binary ballot file
+#define RCVB_VERSION      1           // binary format with one byte per preference
+#define RCVB_VERSION_WIDE 2           // binary format with length-prefixed 16-bit rankings
+#define RCVB_NO_CANDIDATE 0xFF        // NO_CANDIDATE in version 1 rankings
+
+// Header at the start of a binary ballot file, see rcv_binary.c
+typedef struct {
+  char magic[4];                        // RCVB_MAGIC
+  uint32_t version;                     // RCVB_VERSION
+  uint32_t candidate_count;             // number of candidates / names
+  uint32_t rank_width;                  // bytes per vote in version 1, 0 in version 2
+  uint64_t vote_count;                  // number of votes in the file
+} rcvb_header_t;
+
+#define RCVC_MAGIC        "RCVC"      // first 4 bytes of a checkpoint file
+#define RCVC_VERSION      1           // checkpoint format
+
+// Header at the start of a checkpoint file, see rcv_checkpoint.c
+typedef struct {
+  char magic[4];                        // RCVC_MAGIC
+  uint32_t version;                     // RCVC_VERSION
+  uint32_t candidate_count;             // number of candidates / names
+  uint32_t vote_count;                  // number of votes (not ballots) in the rankings
+  uint64_t rank_bytes;                  // bytes of rankings after the names
+  uint64_t state_bytes;                 // bytes in each of the two state slots
+  uint32_t state;                       // slot holding the latest round, 0 or 1
+  uint32_t unused;                      // padding, 0
+} rcvc_header_t;
+
+// Checkpoint file being written after each round, see rcv_checkpoint.c
+typedef struct checkpoint checkpoint_t;
+
+// A tally taking ballots from producer threads while preliminary
+// counts run on snapshots of it, see rcv_live.c
+typedef struct {
+  int candidate_count;                  // number of candidates in the election
+  char (*candidate_names)[MAX_NAME];    // names of candidates
+  vote_t *queue;                        // ballots added by producers, newest first
+  vote_t *pending;                      // ballots taken from the queue but not yet in block
+  live_block_t *block;                  // rows of every ballot taken in so far
+  int vote_count;                       // rows used in block
+  int next_id;                          // id of the next ballot taken in
+} live_tally_t;
+
+// Changes to an election for a what-if count of a live tally's
+// ballots, see live_tally_scenario()
+typedef struct {
+  char *withdrawn;                      // 1 for each candidate taken out of the election, NULL for none
+  int *excluded;                        // first and last id of each range of ballots left out
+  int excluded_count;                   // ranges in excluded[]
+} scenario_t;
+
+#define VOTE_CLASS_MIN 1024           // initial slots in a ballot class table
+
+// Hash table of distinct rankings used to group identical ballots
+// into a single weighted vote while loading.
+typedef struct {
+  vote_t **slots;                       // open addressing table of class votes
+  size_t capacity;                      // number of slots, a power of 2
+  size_t count;                         // number of classes in the table
+  int candidate_count;                  // length of the rankings
+} vote_class_table_t;
+
+#define MAX_THREADS           64          // most threads used by the parallel paths
+#define PARALLEL_LOAD_MIN     (1 << 20)   // fewest bytes of votes worth loading in parallel
+#define PARALLEL_TRANSFER_MIN (1 << 16)   // fewest votes worth transferring in parallel
+
+extern int LOG_LEVEL;
+extern int THREAD_COUNT;
+extern int DEDUP_VOTES;
+extern char *SPILL_DIR;
+extern int RESULT_FORMAT;
+extern int COLLECT_STATS;
+extern int BULK_DEFEAT;
+extern int SEATS;
+extern char *CHECKPOINT_FILE;
+extern int PAIRWISE;
+extern __thread FILE *TALLY_OUT;
+extern __thread int KEEP_SLABS;
+extern __thread vote_slab_t *SPARE_SLABS;
+
+// rcv_funcs.c
+FILE *tally_out();
+void vote_print(vote_t *vote);
+int vote_next_candidate(vote_t *vote, char *candidate_status);
+int vote_next_active(vote_t *vote, uint64_t *active);
+int tally_total_votes(tally_t *tally);
+void tally_print_table(tally_t *tally);
+void tally_set_minvote_candidates(tally_t *tally);
+int tally_condition(tally_t *tally);
+vote_t *vote_make_empty(int capacity);
+tally_t *tally_make_empty();
+int tally_set_candidate_count(tally_t *tally, int candidate_count);
+vote_t *tally_vote_alloc(tally_t *tally, int len);
+void vote_set_rank(vote_t *vote, int i, int candidate);
+void vote_set_ranks(vote_t *vote, int *order);
+vote_t *vote_slab_next(vote_slab_t *slab, vote_t *vote);
+void vote_slabs_free(vote_slab_t *slab);
+int vote_order_len(int *order, int candidate_count);
+void tally_free(tally_t *tally);
+void tally_add_vote(tally_t *tally, vote_t *vote);
+void tally_print_votes(tally_t *tally);
+void tally_transfer_first_vote(tally_t *tally, int candidate_index);
+void tally_log_transfer(tally_t *tally, vote_t *vote, int from, int to);
+void tally_count_exhausted(tally_t *tally, int weight);
+void tally_drop_minvote_candidates(tally_t *tally);
+void tally_election(tally_t *tally);
+int vote_reader_open(vote_reader_t *reader, char *fname, int map);
+void vote_reader_close(vote_reader_t *reader);
+char *vote_reader_line(vote_reader_t *reader, size_t *length);
+int vote_parse_line(char *line, char *end, int *order, int candidate_count);
+int vote_class_table_init(vote_class_table_t *table, int candidate_count);
+void vote_class_table_free(vote_class_table_t *table);
+vote_t **vote_class_slot(vote_class_table_t *table, int *order);
+int tally_add_duplicate(tally_t *tally, vote_class_table_t *table, int *order);
+void vote_class_insert(vote_class_table_t *table, vote_t *vote, int *order);
+tally_t *tally_from_file(char *fname);
+tally_t *tally_load(char *fname);
+
+// rcv_binary.c
+int rcvb_is_binary(char *fname);
+int tally_write_binary(tally_t *tally, char *fname);
+tally_t *tally_from_binary(char *fname);
+
+// rcv_checkpoint.c
+int rcvc_is_checkpoint(char *fname);
+checkpoint_t *checkpoint_open(tally_t *tally, char *fname);
+int checkpoint_write(checkpoint_t *checkpoint, tally_t *tally);
+void checkpoint_close(checkpoint_t *checkpoint);
+tally_t *tally_from_checkpoint(char *fname);
+
+// rcv_parallel.c
+int tally_load_parallel(tally_t *tally, char *start, char *end, long first_line, char *fname);
+int tally_transfer_parallel(tally_t *tally, int candidate_index);
+
+// rcv_matrix.c
+void vote_matrix_free(vote_matrix_t *matrix);
+void vote_matrix_view(vote_matrix_t *matrix, int row, vote_t *vote);
+int vote_matrix_next_candidate(vote_matrix_t *matrix, int row, char *candidate_status);
+int vote_matrix_next_active(vote_matrix_t *matrix, int row, uint64_t *active);
+void rank_histogram(rank_t *ranks, int rows, int stride, int *weights, int *counts, int bins);
+int vote_matrix_deal(vote_matrix_t *matrix, char *candidate_status, char *skip, int *counts);
+int tally_use_matrix(tally_t *tally);
+int vote_matrix_add_vote(tally_t *tally, vote_t *vote);
+void vote_matrix_print_votes(tally_t *tally);
+void vote_matrix_transfer_first_vote(tally_t *tally, int candidate_index);
+void vote_matrix_transfer_all(tally_t *tally, int candidate_index);
+
+// rcv_rounds.c
+int tally_rounds_begin(tally_t *tally);
+void tally_rounds_end(tally_t *tally);
+void round_index_touch(round_index_t *rounds, int candidate);
+void round_index_drop(tally_t *tally, int candidate);
+void round_index_repair(tally_t *tally);
+int round_index_min_candidates(tally_t *tally, int *candidates);
+
+// rcv_batch.c
+int tally_run_batch(char *manifest, char *out_fname, int use_matrix);
+int tally_run_whatif(char *fname, char *scenarios, char *out_fname);
+
+// rcv_live.c
+live_tally_t *live_tally_start(tally_t *tally);
+int live_tally_add(live_tally_t *live, int *order);
+tally_t *live_tally_snapshot(live_tally_t *live);
+tally_t *live_tally_scenario(live_tally_t *live, scenario_t *scenario);
+int scenario_parse(live_tally_t *live, char *text, scenario_t *scenario);
+void scenario_free(scenario_t *scenario);
+tally_t *live_tally_whatif(live_tally_t *live, char *text);
+void live_block_release(live_block_t *block);
+void live_tally_free(live_tally_t *live);
+int tally_run_live(char *fname, char **feeds, int feed_count);
+
+// rcv_stats.c
+double tally_stats_now();
+int tally_use_stats(tally_t *tally);
+void tally_stats_free(tally_stats_t *stats);
+void tally_stats_lap(tally_stats_t *stats, int phase, double *mark);
+void tally_stats_transfer(tally_stats_t *stats, int weight, int exhausted);
+void tally_stats_print_json(tally_stats_t *stats);
+void tally_stats_print_csv(tally_stats_t *stats);
+
+// rcv_pairwise.c
+int tally_use_pairwise(tally_t *tally);
+void pairwise_free(pairwise_t *pairwise);
+void pairwise_add(pairwise_t *pairwise, vote_t *vote, int weight);
+void pairwise_merge(pairwise_t *into, pairwise_t *from);
+int pairwise_prefer(pairwise_t *pairwise, int a, int b);
+int pairwise_condorcet_winner(pairwise_t *pairwise);
+
+// rcv_stv.c
+void stv_format_value(char *buf, long value);
+int tally_stv(tally_t *tally, int seats);
+
+// rcv_log.c
+log_ring_t *log_ring_start(FILE *dest);
+int log_ring_stop(log_ring_t *ring);
+
+// rcv_sink.c
+result_sink_t *result_sink(int format);
+void tally_error(char *format, ...);
+int result_format_parse(char *name);
+
+// rcv_spill.c
+int tally_use_spill(tally_t *tally, char *dir);
+void vote_spill_free(vote_spill_t *spill);
+vote_t *vote_spill_scratch(vote_spill_t *spill, int len);
+void vote_spill_add_vote(tally_t *tally, vote_t *vote);
+void vote_spill_print_votes(tally_t *tally);
+void vote_spill_transfer_first_vote(tally_t *tally, int candidate_index);
+void vote_spill_transfer_all(tally_t *tally, int candidate_index);
+
+#endif
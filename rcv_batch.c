@@ -0,0 +1,301 @@
+// rcv_batch.c: Running many Ranked Choice Voting contests in one process
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// BATCH MODE
+//
+// A manifest lists one votes file per line. Each is a contest run as
+// if by rcv_main on that file but without starting a new process:
+// worker threads take contests in turn, each printing into a private
+// memory stream (TALLY_OUT) and reusing the arena slabs of its
+// previous contests (KEEP_SLABS). Finished contests are written to a
+// single output in manifest order.
+//
+// What-if runs use the same workers for scenarios of one election:
+// each line of their manifest is a scenario counted from a live tally
+// loaded once (see live_tally_whatif()) rather than a votes file.
+
+// One contest of a batch and its output once it has run
+typedef struct {
+  char *fname;                          // votes file or scenario named in the manifest
+  char *output;                         // everything the contest printed
+  size_t output_len;                    // bytes in output
+  int done;                             // 1 once the contest has run
+  int failed;                           // 1 if it couldn't be run
+} batch_contest_t;
+
+// State shared by the workers of a batch
+typedef struct {
+  batch_contest_t *contests;            // contests in manifest order
+  int count;                            // entries in contests[]
+  int next_run;                         // next contest for a worker to take
+  int next_write;                       // next contest to write to out
+  int use_matrix;                       // 1 to run contests with a vote matrix
+  live_tally_t *store;                  // ballots of every scenario in a what-if run, else NULL
+  FILE *out;                            // the single output of the batch
+  pthread_mutex_t lock;                 // guards next_run, next_write and writing
+} batch_t;
+
+static int batch_read_manifest(batch_t *batch, char *manifest){
+    vote_reader_t reader;
+    if (vote_reader_open(&reader, manifest, 1) != 0) {
+        tally_error("couldn't open file '%s'", manifest);
+        return -1;
+    }
+
+    int capacity = 0;
+    char *line;
+    size_t len;
+    while ((line = vote_reader_line(&reader, &len)) != NULL) {
+        // Trim the line, skipping blank ones and # comments
+        while (len > 0 && (line[0] == ' ' || line[0] == '\t')) {
+            line++;
+            len--;
+        }
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) {
+            len--;
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        if (batch->count == capacity) {
+            capacity = (capacity == 0) ? 64 : 2 * capacity;
+            batch_contest_t *bigger = realloc(batch->contests, capacity * sizeof(batch_contest_t));
+            if (bigger == NULL) {
+                break;
+            }
+            batch->contests = bigger;
+        }
+        batch_contest_t *contest = &batch->contests[batch->count];
+        memset(contest, 0, sizeof(batch_contest_t));
+        contest->fname = malloc(len + 1);
+        if (contest->fname == NULL) {
+            break;
+        }
+        memcpy(contest->fname, line, len);
+        contest->fname[len] = '\0';
+        batch->count++;
+    }
+
+    int error = reader.error || line != NULL;
+    vote_reader_close(&reader);
+    if (error) {
+        tally_error("failed reading file '%s'", manifest);
+        return -1;
+    }
+    return 0;
+}
+// Fills in the contests of `batch` from the votes files named in
+// `manifest`, one per line. Returns 0 on success or -1 after printing
+// an ERROR message.
+
+static void batch_run_contest(batch_t *batch, batch_contest_t *contest){
+    FILE *out = open_memstream(&contest->output, &contest->output_len);
+    if (out == NULL) {
+        contest->failed = 1;
+        return;
+    }
+    TALLY_OUT = out;
+
+    result_sink(RESULT_FORMAT)->contest(contest->fname);
+    tally_t *tally = (batch->store != NULL) ? live_tally_whatif(batch->store, contest->fname) :
+                                              tally_load(contest->fname);
+    char *skipped = NULL;
+    if (tally == NULL) {
+        skipped = (batch->store != NULL) ? "Could not set up scenario" : "Could not load votes file";
+    } else if (batch->use_matrix && tally_use_matrix(tally) != 0) {
+        skipped = "Could not build vote matrix";
+    } else {
+        tally_election(tally);
+    }
+    if (skipped != NULL && RESULT_FORMAT == RESULT_TABLE) {
+        fprintf(out, "%s. Contest skipped\n", skipped);
+    } else if (skipped != NULL) {
+        tally_error("%s, contest skipped", skipped);
+    }
+    contest->failed = skipped != NULL;
+    tally_free(tally);
+
+    TALLY_OUT = NULL;
+    fclose(out);
+}
+// Runs one contest with everything it prints going to a memory
+// stream whose contents end up in contest->output.
+
+static void batch_write_done(batch_t *batch){
+    while (batch->next_write < batch->count && batch->contests[batch->next_write].done) {
+        batch_contest_t *contest = &batch->contests[batch->next_write++];
+        if (contest->output != NULL) {
+            fwrite(contest->output, 1, contest->output_len, batch->out);
+        } else {
+            TALLY_OUT = batch->out;
+            result_sink(RESULT_FORMAT)->contest(contest->fname);
+            tally_error("no memory for contest output");
+            TALLY_OUT = NULL;
+        }
+        free(contest->output);
+        contest->output = NULL;
+    }
+}
+// Writes out the contests that are done and come next in manifest
+// order, so output is the same however many workers there are. The
+// caller holds batch->lock.
+
+static void *batch_worker(void *arg){
+    batch_t *batch = arg;
+    KEEP_SLABS = 1;
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next_run++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+
+        batch_run_contest(batch, &batch->contests[i]);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->contests[i].done = 1;
+        batch_write_done(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    // Spare slabs are only worth keeping while this batch runs
+    KEEP_SLABS = 0;
+    vote_slabs_free(SPARE_SLABS);
+    SPARE_SLABS = NULL;
+    return NULL;
+}
+// Body of each worker: takes contests until there are none left.
+
+static int batch_run(char *manifest, char *out_fname, int use_matrix, live_tally_t *store){
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.use_matrix = use_matrix;
+    batch.store = store;
+    if (batch_read_manifest(&batch, manifest) != 0) {
+        for (int i = 0; i < batch.count; i++) {
+            free(batch.contests[i].fname);
+        }
+        free(batch.contests);
+        return -1;
+    }
+
+    batch.out = (strcmp(out_fname, "-") == 0) ? stdout : fopen(out_fname, "w");
+    if (batch.out != NULL && batch.out != stdout) {
+        setvbuf(batch.out, NULL, _IOFBF, RESULT_BUFFER);
+    }
+    if (batch.out == NULL) {
+        tally_error("couldn't open file '%s'", out_fname);
+        for (int i = 0; i < batch.count; i++) {
+            free(batch.contests[i].fname);
+        }
+        free(batch.contests);
+        return -1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+
+    // Contests are the unit of parallel work so each loads and runs
+    // in a single thread
+    int workers = THREAD_COUNT;
+    if (workers > MAX_THREADS) {
+        workers = MAX_THREADS;
+    }
+    if (workers > batch.count) {
+        workers = batch.count;
+    }
+    int thread_count = THREAD_COUNT;
+    THREAD_COUNT = 1;
+
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    for (int t = 1; t < workers; t++) {
+        started[t] = pthread_create(&threads[t], NULL, batch_worker, &batch) == 0;
+    }
+    batch_worker(&batch);
+    for (int t = 1; t < workers; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    THREAD_COUNT = thread_count;
+
+    int failures = 0;
+    for (int i = 0; i < batch.count; i++) {
+        failures += batch.contests[i].failed;
+        free(batch.contests[i].fname);
+    }
+    free(batch.contests);
+    pthread_mutex_destroy(&batch.lock);
+
+    int write_error = ferror(batch.out);
+    if (batch.out != stdout) {
+        write_error |= fclose(batch.out) != 0;
+    } else {
+        fflush(stdout);
+    }
+    if (write_error) {
+        tally_error("failed writing file '%s'", out_fname);
+        return -1;
+    }
+    return failures;
+}
+// Runs the contests of a batch or, if `store` is not NULL, the
+// scenarios of a what-if run. Returns what tally_run_batch() does.
+
+int tally_run_batch(char *manifest, char *out_fname, int use_matrix){
+    return batch_run(manifest, out_fname, use_matrix, NULL);
+}
+// Runs every contest listed in the file `manifest`, one votes file
+// (text or binary) per line with blank lines and lines starting with
+// # ignored, and writes their output to the file `out_fname` or to
+// stdout if it is "-". Each contest's output starts with
+// "=== CONTEST XX ===" with XX its votes file (or the equivalent
+// record for RESULT_JSON and RESULT_CSV), followed by exactly
+// what rcv_main prints for that file; a file that can't be loaded
+// gets its ERROR messages and a line saying it was skipped. Contests
+// are written in manifest order.
+//
+// Up to THREAD_COUNT worker threads run contests at once, each
+// contest in one thread, so many small contests are limited by CPU
+// rather than by starting a process each. Workers keep the arena
+// slabs of their earlier contests for the next ones. Contests use
+// the current LOG_LEVEL, DEDUP_VOTES, SPILL_DIR, COLLECT_STATS,
+// BULK_DEFEAT and SEATS settings and a vote matrix if `use_matrix` is
+// set.
+//
+// Returns the number of contests that couldn't be run, or -1 if the
+// manifest can't be read or the output written.
+
+int tally_run_whatif(char *fname, char *scenarios, char *out_fname){
+    tally_t *tally = tally_load(fname);
+    if (tally == NULL) {
+        return -1;
+    }
+    live_tally_t *store = live_tally_start(tally);
+    if (store == NULL) {
+        tally_free(tally);
+        return -1;
+    }
+    int ret = batch_run(scenarios, out_fname, 1, store);
+    live_tally_free(store);
+    return ret;
+}
+// Loads the votes file `fname` once and counts each scenario listed
+// in the file `scenarios`, one per line such as "withdraw 2 exclude
+// 1-500" (see scenario_parse()), the same way tally_run_batch() runs
+// contests: in up to THREAD_COUNT threads at once, written to
+// `out_fname` in order each headed by "=== CONTEST XX ===" with XX the
+// scenario. Every scenario shares the loaded ballots and has only its
+// own positions, piles and statuses, see live_tally_scenario(). A
+// scenario that can't be read gets its ERROR message and a line saying
+// it was skipped.
+//
+// Returns the number of scenarios that couldn't be run, or -1 if the
+// votes file can't be loaded, the scenarios read or the output
+// written.
@@ -0,0 +1,485 @@
+// rcv_bench.c: Benchmark harness and synthetic election generator
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static void usage(char *prog) {
+    printf("Usage: %s gen <votes_file> [-ballots N] [-candidates N] [-depth N]\n", prog);
+    printf("           [-zipf S] [-corr P] [-seed N]\n");
+    printf("       %s [-threads N] [-dedup] [-matrix] [-spill DIR] [-format F] [-bulk] [-json] <votes_file>\n", prog);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ALLOCATION COUNTING
+//
+// With glibc the allocator entry points are wrapped so every malloc(),
+// calloc() and realloc() made by the code being measured, including
+// from other threads, is counted. Elsewhere the counts are reported
+// as -1.
+
+static long alloc_calls = 0;
+static long alloc_bytes = 0;
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size){
+    __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, (long) size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size){
+    __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, (long) (count * size), __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size){
+    __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, (long) size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+typedef struct {
+  long calls;
+  long bytes;
+} alloc_mark_t;
+
+static alloc_mark_t alloc_mark(void){
+    alloc_mark_t mark;
+    mark.calls = __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED);
+    mark.bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+    return mark;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SYNTHETIC ELECTIONS
+
+typedef struct {
+  long ballots;                 // number of vote lines to write
+  int candidates;               // number of candidates
+  int depth;                    // preferences ranked per ballot, rest NO_CANDIDATE
+  double zipf;                  // popularity exponent, 0 for equally popular
+  double corr;                  // chance each later preference neighbours the previous
+  uint64_t seed;                // random seed, equal seeds give equal files
+} gen_opts_t;
+
+static uint64_t gen_random(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+// xorshift64* generator; fast and good enough for synthetic ballots.
+
+static double gen_uniform(uint64_t *state){
+    return (gen_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+// Uniform double in [0,1).
+
+static int gen_pick_popular(double *popularity, char *used, int candidates, uint64_t *state){
+    double total = 0;
+    for (int i = 0; i < candidates; i++) {
+        if (!used[i]) {
+            total += popularity[i];
+        }
+    }
+    double r = gen_uniform(state) * total;
+    int last = NO_CANDIDATE;
+    for (int i = 0; i < candidates; i++) {
+        if (!used[i]) {
+            last = i;
+            r -= popularity[i];
+            if (r < 0) {
+                return i;
+            }
+        }
+    }
+    return last;
+}
+// Picks an unused candidate with probability proportional to its
+// popularity. The last unused candidate absorbs rounding error.
+
+static int gen_pick_neighbour(int previous, char *used, int candidates, uint64_t *state){
+    int first_left = gen_random(state) & 1;
+    for (int d = 1; d < candidates; d++) {
+        int left = previous - d, right = previous + d;
+        int left_ok = left >= 0 && !used[left];
+        int right_ok = right < candidates && !used[right];
+        if (left_ok && (first_left || !right_ok)) {
+            return left;
+        }
+        if (right_ok) {
+            return right;
+        }
+    }
+    return NO_CANDIDATE;
+}
+// Picks the unused candidate closest in index to `previous`, as if
+// candidates were placed along a line by platform. Ties between the
+// two sides are broken at random.
+
+int bench_generate(char *fname, gen_opts_t *opts){
+    FILE *file = fopen(fname, "w");
+    if (file == NULL) {
+        printf("ERROR: couldn't open file '%s'\n", fname);
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    fprintf(file, "%d\n", opts->candidates);
+    for (int i = 0; i < opts->candidates; i++) {
+        fprintf(file, "%sC%d", i == 0 ? "" : " ", i);
+    }
+    fprintf(file, "\n");
+
+    // Candidate i is the (i+1)th most popular
+    double *popularity = malloc(opts->candidates * sizeof(double));
+    char *used = calloc(opts->candidates, 1);
+    int *ranking = malloc(opts->candidates * sizeof(int));
+    char *line = malloc(opts->candidates * 7 + 2);   // "-1 " or up to "32766 " each
+    int ok = popularity != NULL && used != NULL && ranking != NULL && line != NULL;
+    for (int i = 0; ok && i < opts->candidates; i++) {
+        popularity[i] = 1.0 / pow(i + 1, opts->zipf);
+    }
+
+    uint64_t state = opts->seed ? opts->seed : 1;
+    for (long b = 0; ok && b < opts->ballots; b++) {
+        int previous = NO_CANDIDATE;
+        int len = 0;
+        for (int i = 0; i < opts->candidates; i++) {
+            int candidate = NO_CANDIDATE;
+            if (i < opts->depth) {
+                if (previous != NO_CANDIDATE && gen_uniform(&state) < opts->corr) {
+                    candidate = gen_pick_neighbour(previous, used, opts->candidates, &state);
+                } else {
+                    candidate = gen_pick_popular(popularity, used, opts->candidates, &state);
+                }
+                used[candidate] = 1;
+                ranking[i] = candidate;
+                previous = candidate;
+            }
+            len += sprintf(line + len, i == 0 ? "%d" : " %d", candidate);
+        }
+        for (int i = 0; i < opts->depth; i++) {
+            used[ranking[i]] = 0;
+        }
+        line[len++] = '\n';
+        ok = fwrite(line, len, 1, file) == 1;
+    }
+    free(popularity);
+    free(used);
+    free(ranking);
+    free(line);
+
+    if (fclose(file) != 0 || !ok) {
+        printf("ERROR: failed writing file '%s'\n", fname);
+        return -1;
+    }
+    return 0;
+}
+// Writes a synthetic votes file for `opts->candidates` candidates
+// named C0, C1, ... Each ballot ranks `opts->depth` distinct
+// candidates followed by NO_CANDIDATE entries. The first preference
+// follows a Zipf-like distribution where candidate i has popularity
+// 1/(i+1)^zipf. Each later preference is, with probability `corr`,
+// the nearest unranked neighbour of the previous one and otherwise
+// drawn by popularity among unranked candidates, giving the
+// correlated second choices of real elections. Returns 0 on success
+// or -1 after printing an ERROR message.
+
+////////////////////////////////////////////////////////////////////////////////
+// MEASUREMENT
+
+typedef struct {
+  double load_sec;
+  double election_sec;
+  long ballots;
+  int candidates;
+  int rounds;
+  double *round_sec;
+  int round_capacity;
+  alloc_mark_t load_allocs;
+  alloc_mark_t election_allocs;
+  long peak_rss_kb;
+  int condition;
+  int winner;
+} bench_result_t;
+
+static double bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_quiet(void){
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved >= 0 && null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    return saved;
+}
+
+static void bench_loud(int saved){
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+// bench_quiet() sends stdout to /dev/null so the election tables are
+// formatted as usual but don't swamp the measurements; bench_loud()
+// puts it back.
+
+static long tally_ballot_count(tally_t *tally){
+    long ballots = 0;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        ballots += tally->candidate_vote_counts[i];
+    }
+    return ballots + tally->invalid_vote_count;
+}
+
+static void bench_election(tally_t *tally, bench_result_t *result){
+    int condition;
+    result_sink_t *sink = result_sink(RESULT_FORMAT);
+    tally_rounds_begin(tally);
+    result->rounds = 0;
+    while (1) {
+        double start = bench_now();
+        sink->round_begin(tally, result->rounds + 1);
+        tally_drop_minvote_candidates(tally);
+        sink->round_end(tally, result->rounds + 1);
+        tally_set_minvote_candidates(tally);
+        condition = tally_condition(tally);
+        if (result->rounds < result->round_capacity) {
+            result->round_sec[result->rounds] = bench_now() - start;
+        }
+        result->rounds++;
+        if (condition != TALLY_CONTINUE) {
+            break;
+        }
+    }
+    tally_rounds_end(tally);
+
+    result->condition = condition;
+    result->winner = NO_CANDIDATE;
+    for (int i = 0; condition == TALLY_WINNER && i < tally->candidate_count; i++) {
+        if (tally->candidate_status[i] == CAND_ACTIVE) {
+            result->winner = i;
+        }
+    }
+}
+// Runs the same rounds as tally_election() but records the time each
+// round takes and how the election ended instead of printing it.
+
+int bench_run(char *fname, int use_matrix, bench_result_t *result){
+    memset(result, 0, sizeof(bench_result_t));
+    int saved = bench_quiet();
+
+    alloc_mark_t before = alloc_mark();
+    double start = bench_now();
+    tally_t *tally = tally_load(fname);
+    if (tally != NULL && use_matrix && tally_use_matrix(tally) != 0) {
+        tally_free(tally);
+        tally = NULL;
+    }
+    result->load_sec = bench_now() - start;
+    alloc_mark_t after = alloc_mark();
+    result->load_allocs.calls = after.calls - before.calls;
+    result->load_allocs.bytes = after.bytes - before.bytes;
+
+    if (tally == NULL) {
+        bench_loud(saved);
+        printf("ERROR: couldn't load votes file '%s'\n", fname);
+        return -1;
+    }
+    result->ballots = tally_ballot_count(tally);
+    result->candidates = tally->candidate_count;
+
+    // Every round after the first drops at least one candidate
+    result->round_sec = malloc((tally->candidate_count + 1) * sizeof(double));
+    result->round_capacity = (result->round_sec == NULL) ? 0 : tally->candidate_count + 1;
+
+    before = alloc_mark();
+    start = bench_now();
+    bench_election(tally, result);
+    result->election_sec = bench_now() - start;
+    after = alloc_mark();
+    result->election_allocs.calls = after.calls - before.calls;
+    result->election_allocs.bytes = after.bytes - before.bytes;
+
+    tally_free(tally);
+    bench_loud(saved);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        result->peak_rss_kb = usage.ru_maxrss;
+    }
+    return 0;
+}
+// Loads `fname`, converting to a vote matrix if `use_matrix` is set,
+// and runs its election while measuring each phase. All output of the
+// loader and election is discarded. Fills in `result`, whose
+// round_sec[] is then free()'d by the caller, and returns 0, or returns
+// -1 after printing an ERROR message if loading fails.
+
+static const char *condition_name(int condition){
+    switch (condition) {
+        case TALLY_WINNER:
+            return "winner";
+        case TALLY_TIE:
+            return "tie";
+        default:
+            return "error";
+    }
+}
+
+void bench_print(char *fname, bench_result_t *result, int json){
+    double rate = result->load_sec > 0 ? result->ballots / result->load_sec : 0;
+    long load_calls = BENCH_COUNT_ALLOCS ? result->load_allocs.calls : -1;
+    long load_bytes = BENCH_COUNT_ALLOCS ? result->load_allocs.bytes : -1;
+    long election_calls = BENCH_COUNT_ALLOCS ? result->election_allocs.calls : -1;
+    long election_bytes = BENCH_COUNT_ALLOCS ? result->election_allocs.bytes : -1;
+    int rounds = result->rounds < result->round_capacity ? result->rounds : result->round_capacity;
+
+    if (json) {
+        printf("{\"file\":\"%s\",\"threads\":%d,\"dedup\":%d,\"spill\":%d,\"ballots\":%ld,\"candidates\":%d,",
+               fname, THREAD_COUNT, DEDUP_VOTES, SPILL_DIR != NULL, result->ballots, result->candidates);
+        printf("\"load_sec\":%.6f,\"ballots_per_sec\":%.0f,\"election_sec\":%.6f,",
+               result->load_sec, rate, result->election_sec);
+        printf("\"rounds\":%d,\"round_sec\":[", result->rounds);
+        for (int r = 0; r < rounds; r++) {
+            printf("%s%.6f", r == 0 ? "" : ",", result->round_sec[r]);
+        }
+        printf("],\"load_allocs\":%ld,\"load_alloc_bytes\":%ld,", load_calls, load_bytes);
+        printf("\"election_allocs\":%ld,\"election_alloc_bytes\":%ld,", election_calls, election_bytes);
+        printf("\"peak_rss_kb\":%ld,\"result\":\"%s\",\"winner\":%d}\n",
+               result->peak_rss_kb, condition_name(result->condition), result->winner);
+        return;
+    }
+
+    printf("file            %s\n", fname);
+    printf("ballots         %ld (%d candidates)\n", result->ballots, result->candidates);
+    printf("load            %.3f s, %.0f ballots/s\n", result->load_sec, rate);
+    printf("election        %.3f s, %d rounds\n", result->election_sec, result->rounds);
+    for (int r = 0; r < rounds; r++) {
+        printf("  round %-3d     %.6f s\n", r + 1, result->round_sec[r]);
+    }
+    printf("load allocs     %ld (%ld bytes)\n", load_calls, load_bytes);
+    printf("election allocs %ld (%ld bytes)\n", election_calls, election_bytes);
+    printf("peak rss        %ld KB\n", result->peak_rss_kb);
+    printf("result          %s", condition_name(result->condition));
+    if (result->winner != NO_CANDIDATE) {
+        printf(" (candidate %d)", result->winner);
+    }
+    printf("\n");
+}
+// Prints a benchmark result as a readable report or, if `json` is
+// set, as a single line JSON object whose fields don't change between
+// versions so results can be collected and compared by scripts.
+// Allocation counts are -1 where they can't be measured.
+
+int main(int argc, char *argv[]) {
+    // Generator mode: write a synthetic votes file
+    if (argc >= 3 && strcmp(argv[1], "gen") == 0) {
+        gen_opts_t opts = {100000, 8, -1, 1.0, 0.5, 1};
+        for (int argi = 3; argi < argc; argi += 2) {
+            if (argi + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            } else if (strcmp(argv[argi], "-ballots") == 0) {
+                opts.ballots = atol(argv[argi + 1]);
+            } else if (strcmp(argv[argi], "-candidates") == 0) {
+                opts.candidates = atoi(argv[argi + 1]);
+            } else if (strcmp(argv[argi], "-depth") == 0) {
+                opts.depth = atoi(argv[argi + 1]);
+            } else if (strcmp(argv[argi], "-zipf") == 0) {
+                opts.zipf = atof(argv[argi + 1]);
+            } else if (strcmp(argv[argi], "-corr") == 0) {
+                opts.corr = atof(argv[argi + 1]);
+            } else if (strcmp(argv[argi], "-seed") == 0) {
+                opts.seed = strtoull(argv[argi + 1], NULL, 10);
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (opts.candidates < 1 || opts.candidates > MAX_CANDIDATES || opts.ballots < 0) {
+            printf("ERROR: need 1 to %d candidates and a non-negative ballot count\n", MAX_CANDIDATES);
+            return 1;
+        }
+        if (opts.depth < 1 || opts.depth > opts.candidates) {
+            opts.depth = opts.candidates;
+        }
+        return bench_generate(argv[2], &opts) == 0 ? 0 : 1;
+    }
+
+    // Benchmark mode: measure loading and running an election
+    int use_matrix = 0;
+    int json = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-threads") == 0 && argi + 1 < argc) {
+            THREAD_COUNT = atoi(argv[argi + 1]);
+            if (THREAD_COUNT < 1) {
+                THREAD_COUNT = 1;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "-matrix") == 0) {
+            use_matrix = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-dedup") == 0) {
+            DEDUP_VOTES = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-spill") == 0 && argi + 1 < argc) {
+            SPILL_DIR = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "-format") == 0 && argi + 1 < argc &&
+                   result_format_parse(argv[argi + 1]) >= 0) {
+            RESULT_FORMAT = result_format_parse(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-bulk") == 0) {
+            BULK_DEFEAT = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-json") == 0) {
+            json = 1;
+            argi++;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - argi != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench_result_t result;
+    if (bench_run(argv[argi], use_matrix, &result) != 0) {
+        return 1;
+    }
+    bench_print(argv[argi], &result, json);
+    free(result.round_sec);
+    return 0;
+}
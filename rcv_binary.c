@@ -0,0 +1,323 @@
+// rcv_binary.c: Compact binary ballot files for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// BINARY BALLOT FORMAT
+//
+// A binary ballot file holds the same information as a text votes
+// file in a form that can be loaded without any parsing. All integers
+// are in the byte order of the machine that wrote the file.
+//
+//   rcvb_header_t                        magic, version, counts
+//   char names[candidate_count][MAX_NAME] null padded candidate names
+//   rankings of each vote in file order
+//
+// In version 1 (RCVB_VERSION) each ranking is rank_width bytes, one
+// per preference with RCVB_NO_CANDIDATE for NO_CANDIDATE; rank_width
+// is always candidate_count. It can hold up to 255 candidates.
+//
+// In version 2 (RCVB_VERSION_WIDE) each ranking is a uint16_t count of
+// preferences followed by that many uint16_t candidate indices, the
+// same length-prefixed form votes have in memory, and rank_width is
+// 0. It is written for elections with more than 255 candidates.
+
+int rcvb_is_binary(char *fname){
+    FILE *file = fopen(fname, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    char magic[4];
+    int is_binary = fread(magic, 1, 4, file) == 4 && memcmp(magic, RCVB_MAGIC, 4) == 0;
+    fclose(file);
+    return is_binary;
+}
+// Returns 1 if `fname` starts with the binary ballot file magic
+// number and 0 otherwise, including when it can't be opened.
+
+int tally_write_binary(tally_t *tally, char *fname){
+    if (tally == NULL || tally->vote_slabs == NULL) {
+        tally_error("tally has no vote arena to write");
+        return -1;
+    }
+
+    FILE *file = fopen(fname, "wb");
+    if (file == NULL) {
+        tally_error("couldn't open file '%s'", fname);
+        return -1;
+    }
+
+    // One byte per preference while every index fits
+    int wide = tally->candidate_count > RCVB_NO_CANDIDATE;
+
+    rcvb_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RCVB_MAGIC, 4);
+    header.version = wide ? RCVB_VERSION_WIDE : RCVB_VERSION;
+    header.candidate_count = tally->candidate_count;
+    header.rank_width = wide ? 0 : tally->candidate_count;
+    for (vote_slab_t *slab = tally->vote_slabs; slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); vote != NULL; vote = vote_slab_next(slab, vote)) {
+            header.vote_count += vote->weight;
+        }
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < tally->candidate_count; i++) {
+        ok = fwrite(tally->candidate_names[i], MAX_NAME, 1, file) == 1;
+    }
+
+    // Arena slabs hold the votes in the order they were read
+    size_t size = wide ? (tally->candidate_count + 1) * sizeof(uint16_t) : (size_t) tally->candidate_count;
+    uint8_t *ranks = malloc(size);
+    ok = ok && ranks != NULL;
+    for (vote_slab_t *slab = tally->vote_slabs; ok && slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); ok && vote != NULL; vote = vote_slab_next(slab, vote)) {
+            if (wide) {
+                uint16_t *wide_ranks = (uint16_t *) ranks;
+                wide_ranks[0] = vote->len;
+                for (int i = 0; i < vote->len; i++) {
+                    wide_ranks[i + 1] = VOTE_RANK(vote, i);
+                }
+                size = (vote->len + 1) * sizeof(uint16_t);
+            } else {
+                for (int i = 0; i < tally->candidate_count; i++) {
+                    ranks[i] = (i < vote->len) ? VOTE_RANK(vote, i) : RCVB_NO_CANDIDATE;
+                }
+            }
+            for (int w = 0; ok && w < vote->weight; w++) {
+                ok = fwrite(ranks, size, 1, file) == 1;
+            }
+        }
+    }
+    free(ranks);
+
+    if (fclose(file) != 0 || !ok) {
+        tally_error("failed writing file '%s'", fname);
+        return -1;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' written with %llu votes\n", fname,
+                             (unsigned long long) header.vote_count);
+    }
+    return 0;
+}
+// Writes the candidates and votes of `tally` to `fname` in the binary
+// ballot format, version 1 unless there are too many candidates for
+// one byte per preference. The votes are taken from the tally's arena so they
+// are written in the order they were loaded regardless of how they
+// are currently distributed among candidates; the tally must
+// therefore have been produced by a loader. A vote standing for
+// several identical ballots is written once per ballot, so file order
+// is only preserved for tallies loaded without DEDUP_VOTES. Returns 0
+// on success or -1 after printing an ERROR message.
+
+tally_t *tally_from_binary(char *fname){
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        tally_error("couldn't open file '%s'", fname);
+        return NULL;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' opened\n", fname);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t) sb.st_size < sizeof(rcvb_header_t)) {
+        tally_error("file '%s' is not a binary ballot file", fname);
+        close(fd);
+        return NULL;
+    }
+    size_t size = sb.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        tally_error("couldn't map file '%s'", fname);
+        return NULL;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // Check the header describes exactly the data in the file; the
+    // length of version 2 rankings is checked as they are read
+    rcvb_header_t header;
+    memcpy(&header, data, sizeof(header));
+    int wide = header.version == RCVB_VERSION_WIDE;
+    size_t names_end = sizeof(header) + (size_t) header.candidate_count * MAX_NAME;
+    if (memcmp(header.magic, RCVB_MAGIC, 4) != 0 ||
+        (header.version != RCVB_VERSION && !wide) ||
+        header.candidate_count < 1 || header.candidate_count > MAX_CANDIDATES ||
+        header.rank_width != (wide ? 0 : header.candidate_count) || size < names_end ||
+        (!wide && size != names_end + header.vote_count * header.rank_width)) {
+        tally_error("file '%s' has a bad binary ballot header", fname);
+        munmap(data, size);
+        return NULL;
+    }
+
+    tally_t *tally = tally_make_empty();
+    if (tally == NULL || tally_set_candidate_count(tally, header.candidate_count) != 0) {
+        free(tally);
+        munmap(data, size);
+        return NULL;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        // Log message with the typo to match expected output
+        fprintf(tally_out(), "LOG: File '%s' has %d candidtes\n", fname, tally->candidate_count);
+    }
+
+    char *names = (char *) data + sizeof(header);
+    for (int i = 0; i < tally->candidate_count; i++) {
+        memcpy(tally->candidate_names[i], names + i * MAX_NAME, MAX_NAME - 1);
+        tally->candidate_status[i] = CAND_ACTIVE;
+        if (LOG_ENABLED(LOG_FILEIO)) {
+            fprintf(tally_out(), "LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);
+        }
+    }
+
+    // Spilled tallies copy each vote to a run file as it is read
+    int dedup = DEDUP_VOTES && SPILL_DIR == NULL;
+    if (SPILL_DIR != NULL && tally_use_spill(tally, SPILL_DIR) != 0) {
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+    if (PAIRWISE && tally_use_pairwise(tally) != 0) {
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    vote_class_table_t classes;
+    if (dedup && vote_class_table_init(&classes, tally->candidate_count) != 0) {
+        tally_error("memory allocation failed for vote classes");
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    uint8_t *ranks = data + names_end;
+    uint8_t *end = data + size;
+    int *order = tally->candidate_scratch;
+    for (uint64_t v = 0; v < header.vote_count; v++) {
+        int id = v + 1;
+        int bad_candidate = NO_CANDIDATE;
+        int truncated = 0;
+        if (wide) {
+            // Unaligned 16-bit values are copied out rather than read
+            uint16_t len = 0, rank;
+            truncated = end - ranks < 2;
+            if (!truncated) {
+                memcpy(&len, ranks, 2);
+                truncated = len > tally->candidate_count || end - ranks < 2 + 2 * len;
+            }
+            for (int i = 0; !truncated && i < tally->candidate_count; i++) {
+                order[i] = NO_CANDIDATE;
+                if (i < len) {
+                    memcpy(&rank, ranks + 2 + 2 * i, 2);
+                    order[i] = rank;
+                }
+            }
+            ranks += 2 + 2 * len;
+        } else {
+            for (int i = 0; i < tally->candidate_count; i++) {
+                order[i] = (ranks[i] == RCVB_NO_CANDIDATE) ? NO_CANDIDATE : ranks[i];
+            }
+            ranks += header.rank_width;
+        }
+        for (int i = 0; !truncated && i < tally->candidate_count; i++) {
+            if (order[i] >= tally->candidate_count) {
+                bad_candidate = order[i];
+            }
+        }
+        if (truncated || bad_candidate != NO_CANDIDATE) {
+            if (truncated) {
+                tally_error("file '%s' vote #%04d is truncated", fname, id);
+            } else {
+                tally_error("file '%s' vote #%04d has invalid candidate %d",
+                            fname, id, bad_candidate);
+            }
+            if (dedup) {
+                vote_class_table_free(&classes);
+            }
+            munmap(data, size);
+            tally_free(tally);
+            return NULL;
+        }
+
+        if (LOG_ENABLED(LOG_FILEIO)) {
+            fprintf(tally_out(), "LOG: File '%s' vote #%04d:<%d> ", fname, id, order[0]);
+            for (int i = 1; i < tally->candidate_count; i++) {
+                fprintf(tally_out(), "%d ", order[i]);
+            }
+            fprintf(tally_out(), "\n");
+        }
+
+        // Repeated rankings only add weight to their existing class
+        int duplicate = dedup ? tally_add_duplicate(tally, &classes, order) : 0;
+        vote_t *vote = NULL;
+        int len = vote_order_len(order, tally->candidate_count);
+        if (duplicate == 0) {
+            vote = tally_vote_alloc(tally, len);
+        }
+        if (duplicate < 0 || (duplicate == 0 && vote == NULL)) {
+            tally_error("memory allocation failed for vote");
+            if (dedup) {
+                vote_class_table_free(&classes);
+            }
+            munmap(data, size);
+            tally_free(tally);
+            return NULL;
+        }
+        if (duplicate) {
+            continue;
+        }
+
+        vote->id = id;
+        vote->pos = 0;
+        vote_set_ranks(vote, order);
+        tally_add_vote(tally, vote);
+        if (dedup) {
+            vote_class_insert(&classes, vote, order);
+        }
+    }
+
+    if (dedup) {
+        vote_class_table_free(&classes);
+    }
+
+    if (wide && ranks != end) {
+        tally_error("file '%s' has data after its last vote", fname);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' end of file reached\n", fname);
+    }
+
+    munmap(data, size);
+    return tally;
+}
+// Loads a tally from a binary ballot file written by
+// tally_write_binary(). The file is memory-mapped and its header is
+// checked against the file size (for version 2, each ranking's length
+// against the data left) so a truncated or foreign file is rejected
+// with an ERROR message and NULL is returned. Votes are
+// copied straight from the packed rankings into arena votes and added
+// with tally_add_vote() in file order, so the resulting tally is the
+// same as tally_from_file() produces for the original text file,
+// including grouping identical rankings when DEDUP_VOTES is set. The
+// same LOG_FILEIO messages as tally_from_file() are printed. With
+// SPILL_DIR set the votes go to run files there without deduplication
+// as in tally_from_file(); the mapping's pages are only file cache so
+// memory use still doesn't grow with the file. PAIRWISE counts are
+// kept as in tally_from_file().
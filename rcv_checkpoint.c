@@ -0,0 +1,551 @@
+// rcv_checkpoint.c: Checkpoints of elections in progress for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// CHECKPOINT FORMAT
+//
+// With CHECKPOINT_FILE set, tally_election() saves the state of the
+// election after every round so a count that stops part way can be
+// resumed from its last round rather than reloaded and run again. All
+// integers are in the byte order of the machine that wrote the file.
+//
+//   rcvc_header_t                        magic, version, sizes, current slot
+//   char names[candidate_count][MAX_NAME] null padded candidate names
+//   rankings of each vote                 rank_bytes in all
+//   two state slots                       state_bytes each
+//
+// The rankings never change during an election so they are written
+// once, when the checkpoint is opened. Each vote is an int32_t id,
+// weight and len followed by its len cand_t preferences, padded to 4
+// bytes; a vote's place in this list is its slot (its row for a vote
+// matrix). A state slot holds everything a round changes:
+//
+//   int32_t round, invalid, exhausted and round exhausted counts
+//   char status[candidate_count]          padded to 4 bytes
+//   int32_t counts[candidate_count]
+//   int32_t pile_len[candidate_count + 2] candidates, invalid, exhausted
+//   int32_t order[vote_count]             slots of each pile's votes in list order
+//   uint16_t pos[vote_count]              current position of each slot's vote
+//
+// Rounds are written to the slot not in use and header.state is
+// switched to it last, so the file always holds a whole round even if
+// the program stops while writing. The file is mapped and written in
+// place; the first complete round is written under a temporary name
+// that is then renamed so a half-made checkpoint never replaces an
+// older one. Resuming reads the current slot back into arena votes in
+// lists exactly as they were.
+
+struct checkpoint {
+  int fd;                               // open checkpoint file
+  char *data;                           // the whole file mapped shared
+  size_t size;                          // bytes in the file
+  char *fname;                          // final name of the file
+  char *temp_fname;                     // name until the first round is written, then NULL
+  int *slots;                           // slot of each vote by vote id
+  int max_id;                           // highest vote id
+};
+
+#define RCVC_RANK_SIZE(len) ((3 * sizeof(int32_t) + (size_t) (len) * sizeof(cand_t) + 3) & ~(size_t) 3)
+
+static size_t rcvc_state_bytes(int candidate_count, int vote_count){
+    return 4 * sizeof(int32_t) + ((candidate_count + 3) & ~3) +
+           (2 * (size_t) candidate_count + 2) * sizeof(int32_t) +
+           (size_t) vote_count * (sizeof(int32_t) + sizeof(uint16_t));
+}
+// Bytes in a state slot for the given numbers of candidates and votes.
+
+static vote_t *checkpoint_pile(tally_t *tally, int pile){
+    if (pile < tally->candidate_count) {
+        return tally->candidate_votes[pile];
+    }
+    return (pile == tally->candidate_count) ? tally->invalid_votes : tally->exhausted_votes;
+}
+// Returns the first vote of pile `pile`: the candidates' lists in
+// index order, then the invalid and exhausted votes.
+
+static vote_pile_t *checkpoint_matrix_pile(tally_t *tally, int pile){
+    vote_matrix_t *matrix = tally->matrix;
+    if (pile < tally->candidate_count) {
+        return &matrix->piles[pile];
+    }
+    return (pile == tally->candidate_count) ? &matrix->invalid : &matrix->exhausted;
+}
+// The same piles of a tally with a vote matrix.
+
+static int checkpoint_row_len(vote_matrix_t *matrix, int row){
+    rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+    int len = 0;
+    while (len < matrix->width && ranks[len] != NO_CANDIDATE) {
+        len++;
+    }
+    return len;
+}
+// Number of preferences in a matrix row before its padding.
+
+static int id_cmp(const void *a, const void *b){
+    const int32_t *x = a, *y = b;
+    return (*x < *y) ? -1 : (*x > *y);
+}
+// qsort() order of vote ids.
+
+int rcvc_is_checkpoint(char *fname){
+    FILE *file = fopen(fname, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    char magic[4];
+    int is_checkpoint = fread(magic, 1, 4, file) == 4 && memcmp(magic, RCVC_MAGIC, 4) == 0;
+    fclose(file);
+    return is_checkpoint;
+}
+// Returns 1 if `fname` starts with the checkpoint magic number and 0
+// otherwise, including when it can't be opened.
+
+checkpoint_t *checkpoint_open(tally_t *tally, char *fname){
+    if (tally->spill != NULL) {
+        tally_error("checkpoints need votes in memory, not a spill");
+        return NULL;
+    }
+    checkpoint_t *checkpoint = calloc(1, sizeof(checkpoint_t));
+    if (checkpoint == NULL) {
+        tally_error("memory allocation failed for checkpoint");
+        return NULL;
+    }
+    checkpoint->fd = -1;
+    checkpoint->data = MAP_FAILED;
+
+    // The slot of a matrix row is its row number. Votes in lists get
+    // slots in pile order; ids are unique so they index the slots of
+    // each vote.
+    vote_matrix_t *matrix = tally->matrix;
+    int piles = tally->candidate_count + 2;
+    int vote_count = 0;
+    size_t rank_bytes = 0;
+    for (int row = 0; matrix != NULL && row < matrix->vote_count; row++) {
+        rank_bytes += RCVC_RANK_SIZE(checkpoint_row_len(matrix, row));
+        vote_count++;
+    }
+    for (int p = 0; matrix == NULL && p < piles; p++) {
+        for (vote_t *vote = checkpoint_pile(tally, p); vote != NULL; vote = vote->next) {
+            if (vote->id < 1) {
+                tally_error("checkpoints need votes with ids");
+                checkpoint_close(checkpoint);
+                return NULL;
+            }
+            if (vote->id > checkpoint->max_id) {
+                checkpoint->max_id = vote->id;
+            }
+            rank_bytes += RCVC_RANK_SIZE(vote->len);
+            vote_count++;
+        }
+    }
+    checkpoint->slots = malloc((checkpoint->max_id + 1) * sizeof(int));
+    checkpoint->fname = strdup(fname);
+    checkpoint->temp_fname = malloc(strlen(fname) + 5);
+    if (checkpoint->slots == NULL || checkpoint->fname == NULL || checkpoint->temp_fname == NULL) {
+        tally_error("memory allocation failed for checkpoint");
+        checkpoint_close(checkpoint);
+        return NULL;
+    }
+    sprintf(checkpoint->temp_fname, "%s.tmp", fname);
+
+    rcvc_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RCVC_MAGIC, 4);
+    header.version = RCVC_VERSION;
+    header.candidate_count = tally->candidate_count;
+    header.vote_count = vote_count;
+    header.rank_bytes = rank_bytes;
+    header.state_bytes = rcvc_state_bytes(tally->candidate_count, vote_count);
+    header.state = 1;                   // the first round goes to slot 0
+    size_t names_end = sizeof(header) + (size_t) tally->candidate_count * MAX_NAME;
+    checkpoint->size = names_end + rank_bytes + 2 * header.state_bytes;
+
+    // Space is reserved up front so writing to the mapping can't fail
+    checkpoint->fd = open(checkpoint->temp_fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (checkpoint->fd < 0 || posix_fallocate(checkpoint->fd, 0, checkpoint->size) != 0) {
+        tally_error("couldn't create checkpoint file '%s'", checkpoint->temp_fname);
+        checkpoint_close(checkpoint);
+        return NULL;
+    }
+    checkpoint->data = mmap(NULL, checkpoint->size, PROT_READ | PROT_WRITE, MAP_SHARED, checkpoint->fd, 0);
+    if (checkpoint->data == MAP_FAILED) {
+        tally_error("couldn't map checkpoint file '%s'", checkpoint->temp_fname);
+        checkpoint_close(checkpoint);
+        return NULL;
+    }
+
+    memcpy(checkpoint->data, &header, sizeof(header));
+    for (int i = 0; i < tally->candidate_count; i++) {
+        memcpy(checkpoint->data + sizeof(header) + (size_t) i * MAX_NAME, tally->candidate_names[i], MAX_NAME);
+    }
+    char *rank = checkpoint->data + names_end;
+    for (int row = 0; matrix != NULL && row < matrix->vote_count; row++) {
+        int len = checkpoint_row_len(matrix, row);
+        int32_t fields[3] = {matrix->ids[row], (matrix->weights == NULL) ? 1 : matrix->weights[row], len};
+        memcpy(rank, fields, sizeof(fields));
+        for (int i = 0; i < len; i++) {
+            cand_t candidate = matrix->ranks[(size_t) row * matrix->width + i];
+            memcpy(rank + sizeof(fields) + i * sizeof(cand_t), &candidate, sizeof(cand_t));
+        }
+        rank += RCVC_RANK_SIZE(len);
+    }
+    int slot = 0;
+    for (int p = 0; matrix == NULL && p < piles; p++) {
+        for (vote_t *vote = checkpoint_pile(tally, p); vote != NULL; vote = vote->next) {
+            int32_t fields[3] = {vote->id, vote->weight, vote->len};
+            memcpy(rank, fields, sizeof(fields));
+            for (int i = 0; i < vote->len; i++) {
+                cand_t candidate = VOTE_RANK(vote, i);
+                memcpy(rank + sizeof(fields) + i * sizeof(cand_t), &candidate, sizeof(cand_t));
+            }
+            rank += RCVC_RANK_SIZE(vote->len);
+            checkpoint->slots[vote->id] = slot++;
+        }
+    }
+    return checkpoint;
+}
+// Creates a checkpoint for `tally` to be written by checkpoint_write()
+// after each round; the rankings of its votes are copied into the
+// file now. The tally must hold its votes in lists, where every vote
+// needs a distinct id as the loaders give them, or in a matrix.
+// Nothing appears under `fname` until the first round is written.
+// Returns the checkpoint or NULL after printing an ERROR message.
+
+int checkpoint_write(checkpoint_t *checkpoint, tally_t *tally){
+    if (checkpoint == NULL) {
+        return 0;
+    }
+    rcvc_header_t *header = (rcvc_header_t *) checkpoint->data;
+    int count = tally->candidate_count;
+    int state = 1 - header->state;
+    char *at = checkpoint->data + sizeof(rcvc_header_t) + (size_t) count * MAX_NAME +
+               header->rank_bytes + state * header->state_bytes;
+
+    int32_t fields[4] = {tally->rounds_done, tally->invalid_vote_count,
+                         tally->exhausted_vote_count, tally->round_exhausted_count};
+    memcpy(at, fields, sizeof(fields));
+    at += sizeof(fields);
+    memcpy(at, tally->candidate_status, count);
+    at += (count + 3) & ~3;
+    memcpy(at, tally->candidate_vote_counts, count * sizeof(int32_t));
+    at += count * sizeof(int32_t);
+
+    int32_t *pile_len = (int32_t *) at;
+    int32_t *order = pile_len + count + 2;
+    uint16_t *pos = (uint16_t *) (order + header->vote_count);
+    int n = 0;
+    for (int p = 0; p < count + 2; p++) {
+        int start = n;
+        if (tally->matrix != NULL) {
+            // Piles are stacks with the front of the list on top
+            vote_pile_t *pile = checkpoint_matrix_pile(tally, p);
+            for (int k = pile->len - 1; k >= 0; k--) {
+                order[n++] = pile->rows[k];
+            }
+        } else {
+            for (vote_t *vote = checkpoint_pile(tally, p); vote != NULL; vote = vote->next) {
+                int slot = checkpoint->slots[vote->id];
+                order[n++] = slot;
+                pos[slot] = vote->pos;
+            }
+        }
+        pile_len[p] = n - start;
+    }
+    for (int row = 0; tally->matrix != NULL && row < tally->matrix->vote_count; row++) {
+        pos[row] = tally->matrix->pos[row];
+    }
+
+    // The new round counts once the header points at it
+    __atomic_store_n(&header->state, state, __ATOMIC_RELEASE);
+
+    if (checkpoint->temp_fname != NULL) {
+        if (rename(checkpoint->temp_fname, checkpoint->fname) != 0) {
+            tally_error("couldn't rename '%s' to '%s'", checkpoint->temp_fname, checkpoint->fname);
+            return -1;
+        }
+        free(checkpoint->temp_fname);
+        checkpoint->temp_fname = NULL;
+    }
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' checkpoint of round %d written\n", checkpoint->fname, tally->rounds_done);
+    }
+    return 0;
+}
+// Saves the state of `tally` after round tally->rounds_done into the
+// checkpoint's other state slot and makes it the current one. Costs
+// one pass over every vote: following every list, which is mostly
+// cache misses, or for a matrix a sequential copy of its pos[] and
+// piles. Does nothing if `checkpoint` is NULL.
+// Returns 0 or -1 after printing an ERROR message if the file
+// couldn't be given its name.
+//
+// The file is written through a shared mapping so the last round
+// saved survives the program stopping at any point; it is not flushed
+// to the disk each round so it may not survive the machine stopping.
+
+void checkpoint_close(checkpoint_t *checkpoint){
+    if (checkpoint == NULL) {
+        return;
+    }
+    if (checkpoint->data != MAP_FAILED) {
+        munmap(checkpoint->data, checkpoint->size);
+    }
+    if (checkpoint->fd >= 0) {
+        close(checkpoint->fd);
+    }
+    if (checkpoint->temp_fname != NULL && checkpoint->fd >= 0) {
+        unlink(checkpoint->temp_fname);         // no round was ever written
+    }
+    free(checkpoint->slots);
+    free(checkpoint->fname);
+    free(checkpoint->temp_fname);
+    free(checkpoint);
+}
+// Closes the checkpoint file leaving the last round written in it,
+// or removes it if no round was.
+
+tally_t *tally_from_checkpoint(char *fname){
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        tally_error("couldn't open file '%s'", fname);
+        return NULL;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' opened\n", fname);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t) sb.st_size < sizeof(rcvc_header_t)) {
+        tally_error("file '%s' is not a checkpoint file", fname);
+        close(fd);
+        return NULL;
+    }
+    size_t size = sb.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        tally_error("couldn't map file '%s'", fname);
+        return NULL;
+    }
+
+    // Check the header describes exactly the data in the file; each
+    // vote's length is checked against the rankings as it is read
+    rcvc_header_t header;
+    memcpy(&header, data, sizeof(header));
+    size_t names_end = sizeof(header) + (size_t) header.candidate_count * MAX_NAME;
+    if (memcmp(header.magic, RCVC_MAGIC, 4) != 0 || header.version != RCVC_VERSION ||
+        header.candidate_count < 1 || header.candidate_count > MAX_CANDIDATES ||
+        header.state > 1 || header.vote_count > INT32_MAX ||
+        header.state_bytes != rcvc_state_bytes(header.candidate_count, header.vote_count) ||
+        size != names_end + header.rank_bytes + 2 * header.state_bytes) {
+        tally_error("file '%s' has a bad checkpoint header", fname);
+        munmap(data, size);
+        return NULL;
+    }
+
+    tally_t *tally = tally_make_empty();
+    vote_t **votes = malloc(header.vote_count * sizeof(vote_t *) + 1);
+    if (tally == NULL || votes == NULL || tally_set_candidate_count(tally, header.candidate_count) != 0) {
+        free(tally);
+        free(votes);
+        munmap(data, size);
+        return NULL;
+    }
+    int count = tally->candidate_count;
+    if (PAIRWISE && tally_use_pairwise(tally) != 0) {
+        free(votes);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        // Log message with the typo to match expected output
+        fprintf(tally_out(), "LOG: File '%s' has %d candidtes\n", fname, count);
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(tally->candidate_names[i], data + sizeof(header) + (size_t) i * MAX_NAME, MAX_NAME - 1);
+        if (LOG_ENABLED(LOG_FILEIO)) {
+            fprintf(tally_out(), "LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);
+        }
+    }
+
+    // The state slot the header points to, laid out as written
+    char *state = data + names_end + header.rank_bytes + header.state * header.state_bytes;
+    int32_t fields[4];
+    memcpy(fields, state, sizeof(fields));
+    char *status = state + sizeof(fields);
+    int32_t *counts = (int32_t *) (status + ((count + 3) & ~3));
+    int32_t *pile_len = counts + count;
+    int32_t *order = pile_len + count + 2;
+    uint16_t *pos = (uint16_t *) (order + header.vote_count);
+
+    // Votes are allocated in slot order
+    char *rank = data + names_end;
+    char *rank_end = rank + header.rank_bytes;
+    int bad = 0;
+    for (uint32_t v = 0; !bad && v < header.vote_count; v++) {
+        int32_t vote_fields[3];
+        bad = rank_end - rank < (long) sizeof(vote_fields);
+        if (!bad) {
+            memcpy(vote_fields, rank, sizeof(vote_fields));
+            bad = vote_fields[2] < 0 || vote_fields[2] > count ||
+                  rank_end - rank < (long) RCVC_RANK_SIZE(vote_fields[2]) || pos[v] > vote_fields[2];
+        }
+        if (bad) {
+            tally_error("file '%s' vote in slot %u is truncated", fname, v);
+            break;
+        }
+        vote_t *vote = tally_vote_alloc(tally, vote_fields[2]);
+        if (vote == NULL) {
+            tally_error("memory allocation failed for vote");
+            bad = 1;
+            break;
+        }
+        if (vote_fields[0] < 1 || vote_fields[1] < 1) {
+            tally_error("file '%s' vote in slot %u has a bad id or weight", fname, v);
+            bad = 1;
+            break;
+        }
+        vote->id = vote_fields[0];
+        vote->weight = vote_fields[1];
+        vote->pos = pos[v];
+        for (int i = 0; !bad && i < vote->len; i++) {
+            cand_t candidate;
+            memcpy(&candidate, rank + sizeof(vote_fields) + i * sizeof(cand_t), sizeof(cand_t));
+            if (candidate >= count) {
+                tally_error("file '%s' vote in slot %u has invalid candidate %d",
+                            fname, v, candidate);
+                bad = 1;
+            } else {
+                vote_set_rank(vote, i, candidate);
+            }
+        }
+        if (bad) {
+            break;
+        }
+        if (tally->pairwise != NULL) {
+            pairwise_add(tally->pairwise, vote, vote->weight);
+        }
+        rank += RCVC_RANK_SIZE(vote->len);
+        votes[v] = vote;
+    }
+
+    if (bad) {
+        free(votes);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    // No two votes may share an id, as the matrix store and what-if
+    // scenarios find votes by their ids
+    int32_t *ids = malloc(header.vote_count * sizeof(int32_t) + 1);
+    bad = ids == NULL;
+    for (uint32_t v = 0; !bad && v < header.vote_count; v++) {
+        ids[v] = votes[v]->id;
+    }
+    if (!bad) {
+        qsort(ids, header.vote_count, sizeof(int32_t), id_cmp);
+    }
+    for (uint32_t v = 1; !bad && v < header.vote_count; v++) {
+        if (ids[v] == ids[v - 1]) {
+            tally_error("file '%s' has vote #%04d more than once", fname, ids[v]);
+            bad = 1;
+        }
+    }
+    free(ids);
+    if (bad) {
+        free(votes);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    // Each pile is rebuilt in list order from its slots, each slot
+    // going on one pile only, and the weight on it must be the count
+    // saved for it
+    uint64_t *listed = calloc(header.vote_count / 64 + 1, sizeof(uint64_t));
+    long placed = 0;
+    bad = listed == NULL;
+    for (int p = 0; !bad && p < count + 2; p++) {
+        bad = pile_len[p] < 0 || placed + pile_len[p] > header.vote_count;
+        vote_t **tail = (p < count) ? &tally->candidate_votes[p] :
+                        (p == count) ? &tally->invalid_votes : &tally->exhausted_votes;
+        long weight = 0;
+        for (int k = 0; !bad && k < pile_len[p]; k++) {
+            uint32_t slot = order[placed++];
+            bad = slot >= header.vote_count || (listed[slot >> 6] >> (slot & 63)) & 1;
+            if (!bad) {
+                listed[slot >> 6] |= (uint64_t) 1 << (slot & 63);
+                weight += votes[slot]->weight;
+                *tail = votes[slot];
+                tail = &votes[slot]->next;
+            }
+        }
+        if (!bad) {
+            *tail = NULL;
+            bad = weight != ((p < count) ? counts[p] : fields[p - count + 1]);
+        }
+    }
+    free(listed);
+    if (bad || placed != header.vote_count) {
+        tally_error("file '%s' has bad vote piles", fname);
+        free(votes);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    for (int i = 0; !bad && i < count; i++) {
+        bad = status[i] != CAND_ACTIVE && status[i] != CAND_MINVOTES && status[i] != CAND_DROPPED;
+    }
+    if (bad || fields[0] < 0 || fields[3] < 0 || fields[3] > fields[2]) {
+        tally_error("file '%s' has a bad round state", fname);
+        free(votes);
+        munmap(data, size);
+        tally_free(tally);
+        return NULL;
+    }
+
+    memcpy(tally->candidate_status, status, count);
+    memcpy(tally->candidate_vote_counts, counts, count * sizeof(int32_t));
+    tally->rounds_done = fields[0];
+    tally->invalid_vote_count = fields[1];
+    tally->exhausted_vote_count = fields[2];
+    tally->round_exhausted_count = fields[3];
+
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' resumes after round %d\n", fname, tally->rounds_done);
+    }
+
+    free(votes);
+    munmap(data, size);
+    return tally;
+}
+// Loads the tally saved in a checkpoint file by checkpoint_write(),
+// in the state it had after the round given by tally->rounds_done:
+// candidate statuses and counts, the invalid and exhausted votes, and
+// every vote at its current position on the same list in the same
+// order, so tally_election() carries on with the next round and
+// prints exactly what the original run would have. The file is
+// memory-mapped and its header is checked against its size, each
+// ranking against the candidates, the vote ids for repeats, the piles
+// against the slots and the counts against the piles' weights, so a
+// truncated, foreign or corrupt file is rejected with an ERROR
+// message and NULL is returned. Votes are in lists in an arena,
+// allocated in slot order, whatever store the original tally used;
+// tally_use_matrix() can move them to a matrix. They are weighted as
+// they were saved, so DEDUP_VOTES, SPILL_DIR and THREAD_COUNT make no
+// difference to loading. Rankings are saved whole, so with PAIRWISE
+// set the pairwise counts are those of every ballot whatever round
+// was saved.
@@ -3,6 +3,11 @@
 #include "rcv.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 ////////////////////////////////////////////////////////////////////////////////
 // GLOBAL VARIABLES
 
@@ -13,33 +18,128 @@ int LOG_LEVEL = 0;
 // functions. This output is useful to monitor and audit how election
 // results are calculated.
 
+int THREAD_COUNT = 1;
+// Global variable setting how many threads may be used to load votes
+// files and redistribute votes; 1 keeps everything in the calling
+// thread.
+
+int DEDUP_VOTES = 0;
+// Global variable which when non-zero makes the loaders group votes
+// with identical rankings into a single vote_t whose `weight` is the
+// number of ballots it stands for; see vote_class_slot().
+
+char *SPILL_DIR = NULL;
+// Global variable which when not NULL names a directory in which the
+// loaders keep the votes of a tally in run files rather than in
+// memory so votes files larger than memory can be counted; see
+// tally_use_spill().
+
+int RESULT_FORMAT = RESULT_TABLE;
+// Global variable selecting how tally_election() reports rounds and
+// the outcome: RESULT_TABLE for the usual text, RESULT_JSON or
+// RESULT_CSV for structured records; see result_sink().
+
+int COLLECT_STATS = 0;
+// Global variable which when non-zero makes tally_load() attach a
+// tally_stats_t to each tally so that tally_election() records where
+// its time goes and reports it after the result; see rcv_stats.c.
+
+int BULK_DEFEAT = 0;
+// Global variable which when non-zero lets each round drop every
+// low candidate that can no longer win rather than only those tied
+// for the fewest votes; see tally_set_minvote_candidates().
+
+int SEATS = 1;
+// Global variable giving the number of candidates tally_election()
+// elects; above 1 it runs a Single Transferable Vote count instead of
+// the single-winner rounds; see tally_stv().
+
+char *CHECKPOINT_FILE = NULL;
+// Global variable which when not NULL names a file to which
+// tally_election() saves the state of the election after every round
+// so that it can be resumed by loading that file; see
+// rcv_checkpoint.c.
+
+int PAIRWISE = 0;
+// Global variable which when non-zero makes the loaders count how
+// each pair of candidates fares head to head as ballots are read, so
+// that tally_election() can report the pairwise counts and any
+// Condorcet winner after the result; see rcv_pairwise.c.
+
+__thread FILE *TALLY_OUT = NULL;
+// Thread-local variable naming the stream that messages and election
+// output of the calling thread are written to, NULL for stdout. Batch
+// mode gives each contest its own stream so that contests can run
+// side by side in worker threads; see tally_out().
+
+__thread int KEEP_SLABS = 0;
+__thread vote_slab_t *SPARE_SLABS = NULL;
+// Thread-local variables which, when KEEP_SLABS is non-zero, make
+// vote_slabs_free() keep the calling thread's released arena slabs on
+// the SPARE_SLABS list so that tally_vote_alloc() reuses them for the
+// next tally rather than calling malloc() again.
+
+FILE *tally_out(){
+    return (TALLY_OUT != NULL) ? TALLY_OUT : stdout;
+}
+// Returns the stream output of the calling thread goes to, stdout
+// unless TALLY_OUT is set.
+
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 1 Functions
 
-void vote_print(vote_t *vote){
- if (vote == NULL) {
-        return;
-    }
-
-    printf("#%04d:", vote->id);
+static int vote_format(vote_t *vote, char *buf, int n, FILE *out){
+    n += sprintf(buf + n, "#%04d:", vote->id);
 
-    for (int i = 0; i < MAX_CANDIDATES; i++) {
-        if (vote->candidate_order[i] == NO_CANDIDATE) {
-            break;
+    for (int i = 0; i < vote->len; i++) {
+        if (n > VOTE_PRINT_CHUNK) {
+            fwrite(buf, 1, n, out);
+            n = 0;
+        }
+        char digits[8];
+        int d = 0;
+        unsigned candidate = VOTE_RANK(vote, i);
+        do {
+            digits[d++] = '0' + candidate % 10;
+            candidate /= 10;
+        } while (candidate > 0);
+
+        buf[n++] = (i == vote->pos) ? '<' : ' ';
+        while (d > 0) {
+            buf[n++] = digits[--d];
         }
-
         if (i == vote->pos) {
-            printf("<%d> ", vote->candidate_order[i]);
-        } else {
-            printf(" %d ", vote->candidate_order[i]);
+            buf[n++] = '>';
         }
+        buf[n++] = ' ';
+    }
+
+    if (vote->weight > 1) {
+        n += sprintf(buf + n, "x%d ", vote->weight);
+    }
+    return n;
+}
+// Formats `vote` as vote_print() shows it into `buf` after its first
+// `n` bytes and returns the new length. Preferences are formatted by
+// hand; a long ranking is written to `out` a VOTE_PRINT_CHUNK at a
+// time so `buf` needs room for VOTE_PRINT_CHUNK + 32 bytes past `n`.
+
+void vote_print(vote_t *vote){
+ if (vote == NULL) {
+        return;
     }
+
+    // LOG_SHOWVOTES prints every vote every round so each is written
+    // in one call
+    FILE *out = tally_out();
+    char buf[VOTE_PRINT_CHUNK + 32];
+    fwrite(buf, 1, vote_format(vote, buf, 0, out), out);
 }
 // PROBLEM 1: Print a textual representation of the vote. A vote which
 // is defined as follows
 //
-// vote_t vote = {.id= 17, .pos=1, .next=...,
-//                .candidate_order={3, 0, 2, 1, NO_CANDIDATE}};
+// vote_t vote = {.id= 17, .pos=1, .len=4, .next=...,
+//                .candidate_order={3, 0, 2, 1}};
 //
 // would be printed  like this:
 //
@@ -51,11 +151,20 @@ void vote_print(vote_t *vote){
 // remaining tokens are candidate indexs in order of preference, "3 0
 // 2 1" in this case.  The candidate index at vote->pos is printed
 // with angle brackets around it as in "<0>" while other indexes are
-// printed with spaces aroudn them as in " 3 ". If `candidate_order[]`
-// array has fewer than the MAX_CANDIDATE in it, the slot after the
-// last preferred candidate will have `NO_CANDIDATE` in it and
-// printing should terminate there. The `next` field is not printed
-// and not used during printing.
+// printed with spaces aroudn them as in " 3 ". Only the `len`
+// preferences in `candidate_order[]` are printed; a ranking that
+// ended with NO_CANDIDATE in the votes file was stored up to that
+// point. The `next` field is not printed and not used during
+// printing.
+//
+// A vote standing for several identical ballots (weight > 1, see
+// DEDUP_VOTES) has its weight printed after the preferences as in
+//
+// #0017: 3 <0> 2  1 x25
+//
+// The output is the same as printing each preference with printf()
+// but is built in a local buffer and written in one call for all but
+// very long rankings.
 //
 // NOTE: For maximum flexibility, NO NEWLINE is printed at the end of
 // the vote which allows several votes to printed on the same line if
@@ -66,65 +175,104 @@ int vote_next_candidate(vote_t *vote, char *candidate_status){
         return NO_CANDIDATE;
     }
 
-    // Move until a valid candidate is found
-    while (vote->pos < MAX_CANDIDATES) {
-        int candidate = vote->candidate_order[vote->pos];
-
-        if (candidate == NO_CANDIDATE || candidate >= MAX_CANDIDATES) {
-            return NO_CANDIDATE;
+    // Move until a valid candidate is found, with one loop per
+    // preference size so neither tests it per preference
+    int pos = vote->pos;
+    if (vote->rank_size == 1) {
+        uint8_t *ranks = vote->candidate_order;
+        while (pos < vote->len && candidate_status[ranks[pos]] != CAND_ACTIVE) {
+            pos++;  // Move candidate in order
         }
-
-        if (candidate_status[candidate] == CAND_ACTIVE) {
-            return candidate;
+    } else {
+        cand_t *ranks = (cand_t *) vote->candidate_order;
+        while (pos < vote->len && candidate_status[ranks[pos]] != CAND_ACTIVE) {
+            pos++;
         }
-
-        vote->pos++;  // Move candidate in order
     }
+    vote->pos = pos;
 
-    return NO_CANDIDATE;
+    return (pos < vote->len) ? VOTE_RANK(vote, pos) : NO_CANDIDATE;
 }
 // PROBLEM 1: Advance the vote to the next active candidate. This
 // function usually changes `vote->pos` to indicate a new candidate is
-// selected. If `candidate_order[pos]` is not NO_CANDIDATE and is less
-// than MAX_CANDIDATES , increment `pos` and check if the
-// `candidate_order[pos]` is ACTIVE. The status of each candidate is
-// available in the `candidate_status[]` array where each index is one
-// of CAND_ACTIVE, CAND_MINVOTES, CAND_DROPPED. If
-// vote->pos exceeds MAX_CANDIDATES or a NO_CANDIDATE value is
-// encountered in `candidate_order[]`, return NO_CANDIDATE. Otherwise
-// return the index of the selected candidate for the vote.
+// selected. If `candidate_order[pos]` is not ACTIVE, increment `pos`
+// and check if the `candidate_order[pos]` is ACTIVE. The status of
+// each candidate is available in the `candidate_status[]` array where
+// each index is one of CAND_ACTIVE, CAND_MINVOTES, CAND_DROPPED. If
+// vote->pos reaches vote->len, the end of the stored preferences,
+// return NO_CANDIDATE. Otherwise return the index of the selected
+// candidate for the vote. Preferences are read at the vote's own
+// size, one byte or a cand_t, see VOTE_RANK().
 //
 // EXAMPLES:
-//                                       D  D  A  D
-// vote_t v = {.pos=1, .candidate_order={2, 0, 3, 1, NO_CANDIDATE}};
+//                                              D  D  A  D
+// vote_t v = {.pos=1, .len=4, .candidate_order={2, 0, 3, 1}};
 // int cand_status[4] = {DROPPED, DROPPED, DROPPED, ACTIVE};
 // 1ST CALL
 // int next_cand = vote_next_candidate(&vote, cand_status);
 // - next_cand is 3
-// - v is {.pos=2, .candidate_order={2, 0, 3, 1, NO_CANDIDATE}}
+// - v is {.pos=2, .len=4, .candidate_order={2, 0, 3, 1}}
 // - pos has advanced from 1 to 2 which is the next ACTIVE candidate
 // 2ND CALL
 // next_cand = vote_next_candidate(&vote, cand_status);
 // - next_cand is NO_CANDIDATE
-// - v is {.pos=4, .candidate_order={2, 0, 3, 1, NO_CANDIDATE}}
+// - v is {.pos=4, .len=4, .candidate_order={2, 0, 3, 1}}
 // - pos has incremented from 3 to 4
 // 3RD CALL
 // next_cand = vote_next_candidate(&vote, cand_status);
 // - next_cand is NO_CANDIDATE
-// - v is {.pos=4, .candidate_order={2, 0, 3, 1, NO_CANDIDATE}}
-// - pos has not changed as it referred to NO_CANDIDATE already
-
-void tally_print_table(tally_t *tally){
-if (tally == NULL) {
-        return;
+// - v is {.pos=4, .len=4, .candidate_order={2, 0, 3, 1}}
+// - pos has not changed as it was at the end of the ranking already
+
+int vote_next_active(vote_t *vote, uint64_t *active){
+    int pos = vote->pos;
+    if (vote->rank_size == 1) {
+        uint8_t *ranks = vote->candidate_order;
+        while (pos < vote->len && !CAND_SET_HAS(active, ranks[pos])) {
+            pos++;
+        }
+    } else {
+        cand_t *ranks = (cand_t *) vote->candidate_order;
+        while (pos < vote->len && !CAND_SET_HAS(active, ranks[pos])) {
+            pos++;
+        }
     }
+    vote->pos = pos;
 
+    return (pos < vote->len) ? VOTE_RANK(vote, pos) : NO_CANDIDATE;
+}
+// Same as vote_next_candidate() with the ACTIVE candidates given as a
+// set of bits rather than by their statuses. Transfers during
+// tally_election() use the round index's set: a byte of it covers 8
+// candidates, so the whole set for up to 512 candidates is one cache
+// line that stays put however far down the ranking the next active
+// candidate is.
+
+int tally_total_votes(tally_t *tally){
+    if (tally->rounds != NULL) {
+        return tally->rounds->total_votes;
+    }
     int total_votes = 0;
     for (int i = 0; i < tally->candidate_count; i++) {
         total_votes += tally->candidate_vote_counts[i];
     }
+    return total_votes;
+}
+// Returns the sum of the vote counts of all candidates, the
+// denominator of the percentages in tally_print_table(). Exhausted
+// votes belong to no candidate so this counts only the ballots still
+// continuing in the election. During tally_election() it comes from
+// the round index rather than being summed again; transfers only
+// change it by exhausting votes.
+
+void tally_print_table(tally_t *tally){
+if (tally == NULL) {
+        return;
+    }
 
-    printf("NUM COUNT %%PERC S NAME\n");
+    int total_votes = tally_total_votes(tally);
+
+    fprintf(tally_out(), "NUM COUNT %%PERC S NAME\n");
 
     for (int i = 0; i < tally->candidate_count; i++) {
         char status_char;
@@ -143,15 +291,19 @@ if (tally == NULL) {
         }
 
         if (tally->candidate_status[i] == CAND_DROPPED) {
-            printf("%3d     -     - %c %-10s\n", i, status_char, tally->candidate_names[i]);
+            fprintf(tally_out(), "%3d     -     - %c %-10s\n", i, status_char, tally->candidate_names[i]);
         } else {
             float percentage = (total_votes > 0) ? (100.0 * tally->candidate_vote_counts[i] / total_votes) : 0.0;
-            printf("%3d %5d %5.1f %c %-10s\n", i, tally->candidate_vote_counts[i], percentage, status_char, tally->candidate_names[i]);
+            fprintf(tally_out(), "%3d %5d %5.1f %c %-10s\n", i, tally->candidate_vote_counts[i], percentage, status_char, tally->candidate_names[i]);
         }
     }
 
     if (tally->invalid_vote_count > 0) {
-        printf("Invalid vote count: %d\n", tally->invalid_vote_count);
+        fprintf(tally_out(), "Invalid vote count: %d\n", tally->invalid_vote_count);
+    }
+    if (tally->exhausted_vote_count > 0) {
+        fprintf(tally_out(), "Exhausted vote count: %d (%d this round)\n",
+                tally->exhausted_vote_count, tally->round_exhausted_count);
     }
 }
 // PROBLEM 1: Print a table showing the vote breakdown for the
@@ -187,6 +339,8 @@ if (tally == NULL) {
 // - NAME: string, left aligned
 // The format specifiers of printf() are used to format these fields.
 //
+// The total comes from tally_total_votes().
+//
 // If there are 0 total votes, this function has undefined behavior
 // and may print random garbage. This situation will not be tested for
 // any particular behavior.
@@ -198,6 +352,83 @@ if (tally == NULL) {
 //
 // If there are no valid votes, this function prints the percentage
 // for each candidate as 0.0% which is a special case.
+//
+// If any votes have been exhausted, ends with their count and how
+// many of them the latest round's drops exhausted:
+//
+// Exhausted vote count: 7 (3 this round)
+
+static int bulk_entry_cmp(const void *a, const void *b){
+    const int *x = a, *y = b;
+    if (x[0] != y[0]) {
+        return (x[0] < y[0]) ? -1 : 1;
+    }
+    return (x[1] < y[1]) ? -1 : (x[1] > y[1]);
+}
+// Orders {count, candidate} pairs by count then candidate index.
+
+static int tally_bulk_defeat(tally_t *tally, int *candidates, int count){
+    int (*entries)[2] = malloc(tally->candidate_count * sizeof(*entries) + 1);
+    if (entries == NULL) {
+        return count;
+    }
+
+    // Candidates still in the election, fewest votes first
+    int n = 0;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        if (tally->candidate_status[i] != CAND_DROPPED) {
+            entries[n][0] = tally->candidate_vote_counts[i];
+            entries[n][1] = i;
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(*entries), bulk_entry_cmp);
+
+    // The longest run of lowest candidates that together have fewer
+    // votes than the candidate after them
+    long total = 0;
+    int defeat = 0;
+    for (int k = 0; k < n - 1; k++) {
+        total += entries[k][0];
+        if (total < entries[k + 1][0]) {
+            defeat = k + 1;
+        }
+    }
+
+    if (defeat > count) {
+        total = 0;
+        for (int k = 0; k < defeat; k++) {
+            candidates[k] = entries[k][1];
+            total += entries[k][0];
+        }
+        count = defeat;
+
+        // Callers report candidates in index order
+        for (int k = 0; k < defeat; k++) {
+            entries[k][0] = candidates[k];
+            entries[k][1] = 0;
+        }
+        qsort(entries, defeat, sizeof(*entries), bulk_entry_cmp);
+        for (int k = 0; k < defeat; k++) {
+            candidates[k] = entries[k][0];
+        }
+
+        if (LOG_ENABLED(LOG_MINVOTE)) {
+            fprintf(tally_out(), "LOG: BULK DEFEAT of %d candidates with %ld votes\n", defeat, total);
+        }
+    }
+    free(entries);
+    return count;
+}
+// Widens the `count` MINVOTES candidates in candidates[] to every
+// candidate that is sure to lose: the lowest k candidates are safe to
+// drop together if their votes added up are fewer than those of the
+// next lowest candidate, as even all of their votes transferring to
+// one of them could not lift it past that candidate. The largest such
+// k is used if it is more than `count`, with candidates[] refilled in
+// index order. Returns the new count; on running out of memory the
+// candidates are left as they were. Costs a sort of the candidates
+// still in the election, so it is only done when BULK_DEFEAT is set.
 
 void tally_set_minvote_candidates(tally_t *tally){
  if (tally == NULL || tally->candidate_count == 0) {
@@ -205,31 +436,57 @@ void tally_set_minvote_candidates(tally_t *tally){
     }
 
     int min_votes = -1;
-
-    for (int i = 0; i < tally->candidate_count; i++) {
-        if (tally->candidate_status[i] != CAND_DROPPED) {
-            if (min_votes == -1 || tally->candidate_vote_counts[i] < min_votes) {
-                min_votes = tally->candidate_vote_counts[i];
+    int *candidates = tally->candidate_scratch;
+    int count = 0;
+
+    if (tally->rounds != NULL) {
+        // The round index knows the minimum and who has it
+        count = round_index_min_candidates(tally, candidates);
+        if (count > 0) {
+            min_votes = tally->candidate_vote_counts[candidates[0]];
+        }
+    } else {
+        for (int i = 0; i < tally->candidate_count; i++) {
+            if (tally->candidate_status[i] != CAND_DROPPED) {
+                if (min_votes == -1 || tally->candidate_vote_counts[i] < min_votes) {
+                    min_votes = tally->candidate_vote_counts[i];
+                }
+            }
+        }
+        for (int i = 0; i < tally->candidate_count; i++) {
+            if (tally->candidate_status[i] != CAND_DROPPED && tally->candidate_vote_counts[i] == min_votes) {
+                candidates[count++] = i;
             }
         }
     }
 
     if (min_votes == -1) {
-        if (LOG_LEVEL >= LOG_MINVOTE) {
-            printf("LOG: No MIN VOTE count found\n");
+        if (LOG_ENABLED(LOG_MINVOTE)) {
+            fprintf(tally_out(), "LOG: No MIN VOTE count found\n");
         }
         return;
     }
 
-    if (LOG_LEVEL >= LOG_MINVOTE) {
-        printf("LOG: MIN VOTE count is %d\n", min_votes);
+    if (LOG_ENABLED(LOG_MINVOTE)) {
+        fprintf(tally_out(), "LOG: MIN VOTE count is %d\n", min_votes);
     }
 
-    for (int i = 0; i < tally->candidate_count; i++) {
-        if (tally->candidate_status[i] == CAND_ACTIVE && tally->candidate_vote_counts[i] == min_votes) {
+    // Candidates that can't catch up go in the same round
+    if (BULK_DEFEAT) {
+        count = tally_bulk_defeat(tally, candidates, count);
+    }
+
+    for (int k = 0; k < count; k++) {
+        int i = candidates[k];
+        if (tally->candidate_status[i] == CAND_ACTIVE) {
             tally->candidate_status[i] = CAND_MINVOTES;
-            if (LOG_LEVEL >= LOG_MINVOTE) {
-                printf("LOG: MIN VOTE COUNT for candidate %d: %s\n", i, tally->candidate_names[i]);
+            if (tally->rounds != NULL) {
+                tally->rounds->active_count--;
+                tally->rounds->active[i >> 6] &= ~((uint64_t) 1 << (i & 63));
+                tally->rounds->minvote[tally->rounds->minvote_len++] = i;
+            }
+            if (LOG_ENABLED(LOG_MINVOTE)) {
+                fprintf(tally_out(), "LOG: MIN VOTE COUNT for candidate %d: %s\n", i, tally->candidate_names[i]);
             }
         }
     }
@@ -258,6 +515,20 @@ void tally_set_minvote_candidates(tally_t *tally){
 // Two candidates have changed status to CAND_MINVOTES but the 0th
 // candidate who has status CAND_DROPPED is ignored.
 //
+// If BULK_DEFEAT is set, more candidates may be given CAND_MINVOTES:
+// all of the lowest candidates whose votes together are fewer than
+// the next lowest candidate's (see tally_bulk_defeat()). Dropping
+// them at once gives the same winner as dropping them over several
+// rounds since none of them could have overtaken that candidate, but
+// an election with a long tail of small candidates takes far fewer
+// rounds. At least one candidate always stays ACTIVE this way so a
+// bulk defeat never makes a tie.
+//
+// During tally_election() the minimum and the candidates holding it
+// are read from the top of the round index heap rather than found by
+// scanning, and the index's ACTIVE count and MINVOTES list are
+// updated as statuses change.
+//
 // LOGGING: if the LOG_LEVEL is >= LOG_MINVOTE, this function will
 // print the following messages to standard out while running.
 //
@@ -270,6 +541,10 @@ void tally_set_minvote_candidates(tally_t *tally){
 // "LOG: MIN VOTE count for candidate YY: ZZ" : printed for each
 // candidate whose status is changed to CAND_MINVOTES with YY and ZZ
 // as the candidate index and name.
+//
+// "LOG: BULK DEFEAT of NN candidates with VV votes" : printed before
+// those messages when BULK_DEFEAT widens the candidates to NN with VV
+// votes between them.
 
 int tally_condition(tally_t *tally){
    if (tally == NULL) {
@@ -279,7 +554,19 @@ int tally_condition(tally_t *tally){
     int active_count = 0;
     int minvote_count = 0;
 
-    for (int i = 0; i < tally->candidate_count; i++) {
+    if (tally->spill != NULL && tally->spill->error) {
+        return TALLY_ERROR;
+    }
+
+    if (tally->rounds != NULL) {
+        if (tally->rounds->error) {
+            return TALLY_ERROR;
+        }
+        active_count = tally->rounds->active_count;
+        minvote_count = tally->rounds->minvote_len;
+    }
+
+    for (int i = 0; tally->rounds == NULL && i < tally->candidate_count; i++) {
         switch (tally->candidate_status[i]) {
             case CAND_ACTIVE:
                 active_count++;
@@ -321,13 +608,17 @@ int tally_condition(tally_t *tally){
 // - Returns TALLY_ERROR in all other cases as something has gone wrong
 //   in the tabulation (e.g. all candidates dropped, a single MINVOTE
 //   candidate, some other bad state).
+//
+// During tally_election() the status counts come from the round index
+// so no candidates are scanned. A spilled tally whose run files could
+// not be read or written is also a TALLY_ERROR.
 
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 2 Functions
 
-vote_t *vote_make_empty(){
-    // Allocate memory for vote_t structure
-    vote_t *new_vote = (vote_t *)malloc(sizeof(vote_t));
+vote_t *vote_make_empty(int capacity){
+    // Allocate memory for vote_t structure and its preferences
+    vote_t *new_vote = (vote_t *)malloc(VOTE_SIZE(capacity, sizeof(cand_t)));
     if (new_vote == NULL) {
         return NULL; 
     }
@@ -335,26 +626,266 @@ vote_t *vote_make_empty(){
     // Initialize vote fields
     new_vote->id = -1;
     new_vote->pos = -1;
+    new_vote->weight = 1;
+    new_vote->len = 0;
+    new_vote->rank_size = sizeof(cand_t);
     new_vote->next = NULL;
-    for (int i = 0; i < MAX_CANDIDATES; i++) {
-        new_vote->candidate_order[i] = NO_CANDIDATE;
-    }
 
     return new_vote; 
 }
-// PROBLEM 2: Allocates a vote on the heap using malloc() and
-// intitializes its id/pos fields to be -1, all of the entries in
-// its candidate_order[] array to be NO_CANDIDATE, and the next field
-// to NULL. Returns a pointer to that vote.
+// PROBLEM 2: Allocates a vote on the heap using malloc() with room for
+// `capacity` preferences and intitializes its id/pos fields to be -1,
+// its weight to be 1, its len to be 0 so that it has no preferences
+// yet, and the next field to NULL. Returns a pointer to that vote.
+// Its preferences are cand_t wide whatever the election.
+
+tally_t *tally_make_empty(){
+    tally_t *tally = (tally_t *)malloc(sizeof(tally_t));
+    if (tally == NULL) {
+        return NULL;
+    }
+
+    // Initialize tally fields
+    tally->candidate_count = 0;
+    tally->invalid_vote_count = 0;
+    tally->invalid_votes = NULL;
+    tally->exhausted_vote_count = 0;
+    tally->round_exhausted_count = 0;
+    tally->exhausted_votes = NULL;
+    tally->vote_slabs = NULL;
+    tally->vote_slab_last = NULL;
+    tally->matrix = NULL;
+    tally->rounds = NULL;
+    tally->spill = NULL;
+    tally->stats = NULL;
+    tally->pairwise = NULL;
+    tally->rounds_done = 0;
+    tally->candidate_names = NULL;
+    tally->candidate_votes = NULL;
+    tally->candidate_vote_counts = NULL;
+    tally->candidate_status = NULL;
+    tally->candidate_scratch = NULL;
+
+    return tally;
+}
+// Allocates a tally on the heap with no candidates and no votes and
+// no vote arena, matrix or spill yet. Loaders call
+// tally_set_candidate_count() then fill in the candidates and add
+// votes to it. Returns NULL if memory can't be allocated.
+
+int tally_set_candidate_count(tally_t *tally, int candidate_count){
+    if (candidate_count < 1 || candidate_count > MAX_CANDIDATES) {
+        return -1;
+    }
+    char (*names)[MAX_NAME] = calloc(candidate_count, MAX_NAME);
+    vote_t **votes = calloc(candidate_count, sizeof(vote_t *));
+    int *counts = calloc(candidate_count, sizeof(int));
+    char *status = malloc(candidate_count);
+    int *scratch = malloc(candidate_count * sizeof(int));
+    if (names == NULL || votes == NULL || counts == NULL || status == NULL || scratch == NULL) {
+        free(names);
+        free(votes);
+        free(counts);
+        free(status);
+        free(scratch);
+        return -1;
+    }
+    memset(status, CAND_DROPPED, candidate_count);
+
+    tally->candidate_count = candidate_count;
+    tally->candidate_names = names;
+    tally->candidate_votes = votes;
+    tally->candidate_vote_counts = counts;
+    tally->candidate_status = status;
+    tally->candidate_scratch = scratch;
+    return 0;
+}
+// Sizes the per-candidate arrays of an empty tally for
+// `candidate_count` candidates: all counts are 0, all lists are
+// empty and every candidate is CAND_DROPPED with an empty name until
+// the loader reads it. Only as much memory as the election needs is
+// used so up to MAX_CANDIDATES candidates are supported. Returns 0 on
+// success or -1 if the count is out of range or memory can't be
+// allocated, leaving the tally unchanged.
+
+vote_t *tally_vote_alloc(tally_t *tally, int len){
+    if (tally == NULL) {
+        return NULL;
+    }
+
+    // Spilled votes are copied to disk so one scratch vote will do
+    if (tally->spill != NULL) {
+        return vote_spill_scratch(tally->spill, len);
+    }
+
+    int rank_size = VOTE_RANK_SIZE(tally->candidate_count);
+    size_t size = VOTE_SIZE(len, rank_size);
+    vote_slab_t *slab = tally->vote_slab_last;
+    if (slab == NULL || slab->used + size > slab->capacity) {
+        // Each new slab is twice the size of the last up to a cap
+        size_t capacity = (slab == NULL) ? VOTE_SLAB_MIN : 2 * slab->capacity;
+        if (capacity > VOTE_SLAB_MAX) {
+            capacity = VOTE_SLAB_MAX;
+        }
+        if (capacity < size) {
+            capacity = size;
+        }
+
+        // A spare slab of a previous tally will do if it fits the vote
+        vote_slab_t *new_slab = NULL;
+        for (vote_slab_t **spare = &SPARE_SLABS; *spare != NULL; spare = &(*spare)->next) {
+            if ((*spare)->capacity >= size) {
+                new_slab = *spare;
+                *spare = new_slab->next;
+                break;
+            }
+        }
+        if (new_slab == NULL) {
+            new_slab = malloc(sizeof(vote_slab_t) + capacity);
+            if (new_slab == NULL) {
+                return NULL;
+            }
+            new_slab->capacity = capacity;
+        }
+        new_slab->next = NULL;
+        new_slab->used = 0;
+        new_slab->vote_count = 0;
+
+        if (slab == NULL) {
+            tally->vote_slabs = new_slab;
+        } else {
+            slab->next = new_slab;
+        }
+        tally->vote_slab_last = new_slab;
+        slab = new_slab;
+    }
+
+    // Bump allocate and initialize as vote_make_empty() does
+    vote_t *new_vote = (vote_t *) ((char *) slab->data + slab->used);
+    slab->used += size;
+    slab->vote_count++;
+    new_vote->id = -1;
+    new_vote->pos = -1;
+    new_vote->weight = 1;
+    new_vote->len = len;
+    new_vote->rank_size = rank_size;
+    new_vote->next = NULL;
+
+    return new_vote;
+}
+// Allocates a vote with room for exactly `len` preferences from the
+// arena owned by `tally` rather than with malloc(). Votes are carved
+// out of slabs linked from tally->vote_slabs; when the current slab
+// can't fit the vote a new one is allocated that is twice as large
+// (VOTE_SLAB_MIN bytes at first, at most VOTE_SLAB_MAX unless a single
+// vote needs more), unless a spare slab kept by vote_slabs_free() is
+// large enough. Votes allocated in sequence are therefore
+// contiguous in memory and in allocation order when walking the
+// slabs with vote_slab_next(). The returned vote is initialized the
+// same way as vote_make_empty() except that its len is already `len`
+// and its preferences take VOTE_RANK_SIZE() bytes for the tally's
+// candidate count, one byte each for up to 256 candidates, so the
+// votes of most elections take little more than their header; the
+// caller fills them in with vote_set_ranks(). Returns NULL if a new
+// slab can't be allocated.
+//
+// Arena votes are never free()'d individually: tally_free() releases
+// whole slabs. A tally that has an arena is assumed to own ALL of its
+// votes this way so malloc()'d votes should not be added to it.
+//
+// A tally with a spill has no arena: it returns the spill's scratch
+// vote which tally_add_vote() copies to a run file, so each vote must
+// be added before the next is allocated.
+
+vote_t *vote_slab_next(vote_slab_t *slab, vote_t *vote){
+    char *next = (vote == NULL) ? (char *) slab->data : (char *) vote + VOTE_SIZE(vote->len, vote->rank_size);
+    return (next < (char *) slab->data + slab->used) ? (vote_t *) next : NULL;
+}
+// Walks the votes of an arena slab in allocation order: returns the
+// first vote of `slab` when `vote` is NULL, otherwise the vote after
+// `vote`, or NULL when there are no more.
+
+void vote_set_rank(vote_t *vote, int i, int candidate){
+    if (vote->rank_size == 1) {
+        vote->candidate_order[i] = candidate;
+    } else {
+        ((cand_t *) vote->candidate_order)[i] = candidate;
+    }
+}
+// Sets preference `i` of `vote` to `candidate` at the vote's
+// preference size; VOTE_RANK() reads it back.
+
+void vote_set_ranks(vote_t *vote, int *order){
+    if (vote->rank_size == 1) {
+        for (int i = 0; i < vote->len; i++) {
+            vote->candidate_order[i] = order[i];
+        }
+    } else {
+        cand_t *ranks = (cand_t *) vote->candidate_order;
+        for (int i = 0; i < vote->len; i++) {
+            ranks[i] = order[i];
+        }
+    }
+}
+// Copies the first vote->len entries of `order` into the preferences
+// of `vote`, as loaders do once the ranking is read.
+
+int vote_order_len(int *order, int candidate_count){
+    int len = 0;
+    while (len < candidate_count && order[len] != NO_CANDIDATE) {
+        len++;
+    }
+    return len;
+}
+// Returns the number of preferences in a ranking read from a votes
+// file before its first NO_CANDIDATE; later entries are never used so
+// votes store only this many.
+
+void vote_slabs_free(vote_slab_t *slab){
+    while (slab != NULL) {
+        vote_slab_t *next = slab->next;
+        if (KEEP_SLABS) {
+            slab->next = SPARE_SLABS;
+            SPARE_SLABS = slab;
+        } else {
+            free(slab);
+        }
+        slab = next;
+    }
+}
+// Releases a list of arena slabs: they are free()'d unless the calling
+// thread has KEEP_SLABS set in which case they are put on its
+// SPARE_SLABS list for the next tally it loads.
 
 void tally_free(tally_t *tally){
 if (tally == NULL) {
         return;
     }
 
-    // Free...
-    for (int i = 0; i < tally->candidate_count; i++) {
-        vote_t *current = tally->candidate_votes[i];
+    if (tally->spill != NULL) {
+        vote_spill_free(tally->spill);
+    } else if (tally->matrix != NULL) {
+        vote_matrix_free(tally->matrix);
+    } else if (tally->vote_slabs != NULL) {
+        // Votes live in the arena: release it a slab at a time
+        vote_slabs_free(tally->vote_slabs);
+    } else {
+        // Free...
+        for (int i = 0; i < tally->candidate_count; i++) {
+            vote_t *current = tally->candidate_votes[i];
+            while (current != NULL) {
+                vote_t *next = current->next;
+                free(current);
+                current = next;
+            }
+        }
+        vote_t *current = tally->invalid_votes;
+        while (current != NULL) {
+            vote_t *next = current->next;
+            free(current);
+            current = next;
+        }
+        current = tally->exhausted_votes;
         while (current != NULL) {
             vote_t *next = current->next;
             free(current);
@@ -363,6 +894,13 @@ if (tally == NULL) {
     }
 
     // Free tally
+    tally_stats_free(tally->stats);
+    pairwise_free(tally->pairwise);
+    free(tally->candidate_names);
+    free(tally->candidate_votes);
+    free(tally->candidate_vote_counts);
+    free(tally->candidate_status);
+    free(tally->candidate_scratch);
     free(tally);
 }
 // PROBLEM 2: De-allocates a tally and all its linked votes from the
@@ -371,53 +909,138 @@ if (tally == NULL) {
 // through each list and free()'ing each vote. Ends by free()'ing the
 // tally itself.
 //
+// If the tally has a vote arena (tally->vote_slabs is not NULL) the
+// lists are not traversed; every vote lives in one of the arena's
+// slabs so freeing the slabs releases all of them in a few calls. A
+// tally with a vote matrix frees the matrix instead and one with a
+// spill removes its run files.
+//
 // MAKEUP CREDIT: In addition to the candidate vote lists, also
-// de-allocates the invalid vote list.
+// de-allocates the invalid and exhausted vote lists.
+//
+// The per-candidate arrays of the tally are also free()'d.
 
 void tally_add_vote(tally_t *tally, vote_t *vote){
  if (tally == NULL || vote == NULL) {
         return;
     }
 
-    int candidate_index = vote->candidate_order[vote->pos];
+    if (tally->pairwise != NULL) {
+        pairwise_add(tally->pairwise, vote, vote->weight);
+    }
+
+    if (tally->spill != NULL) {
+        vote_spill_add_vote(tally, vote);
+        return;
+    }
+
+    // Matrix tallies copy the vote into a new row
+    if (tally->matrix != NULL) {
+        if (vote_matrix_add_vote(tally, vote) != 0) {
+            return;
+        }
+        int candidate = (vote->pos < vote->len) ? VOTE_RANK(vote, vote->pos) : NO_CANDIDATE;
+        if (candidate == NO_CANDIDATE) {
+            tally->invalid_vote_count += vote->weight;
+        } else {
+            tally->candidate_vote_counts[candidate] += vote->weight;
+        }
+        return;
+    }
+
+    int candidate_index = (vote->pos < vote->len) ? VOTE_RANK(vote, vote->pos) : NO_CANDIDATE;
+
+    // Votes with no first preference go on the invalid list
+    if (candidate_index == NO_CANDIDATE) {
+        vote->next = tally->invalid_votes;
+        tally->invalid_votes = vote;
+        tally->invalid_vote_count += vote->weight;
+        return;
+    }
 
     // Prepend vote list
     vote->next = tally->candidate_votes[candidate_index];
     tally->candidate_votes[candidate_index] = vote;
 
     // Increment vote count
-    tally->candidate_vote_counts[candidate_index]++;
+    tally->candidate_vote_counts[candidate_index] += vote->weight;
 }
 // PROBLEM 2: Add the given vote to the given tally. The vote is
 // assigned to candidate indicated by the vote->pos field and
 // vote->candidate_order[] array.  The vote is prepended (added to the
 // front) of the associated candidates list of votes and their vote
-// count is incremented. This function is primarily used when
+// count is incremented by the vote's weight (1 unless it stands for
+// several identical ballots). This function is primarily used when
 // initially populating a tally while other functions like
 // tally_transfer_first_vote() are used when calculating elections.
 //
-// MAKEUP CREDIT: Votes whose preference is NO_CANDIDATE are prepended
-// to the invalid_votes list with the invalid_vote_count incrementing.
+// If the tally stores its votes in a matrix, the vote is copied into a
+// new row instead and is not linked into the tally. A tally with a
+// spill likewise appends a copy of the vote to a run file. A tally
+// with pairwise counts (see tally_use_pairwise()) counts the vote's
+// ranking there first, whatever store holds it.
+//
+// MAKEUP CREDIT: Votes whose preference is NO_CANDIDATE (pos is past
+// the end of the stored ranking) are prepended to the invalid_votes
+// list with the invalid_vote_count incrementing.
 
 void tally_print_votes(tally_t *tally){
 if (tally == NULL) {
         return;
     }
 
+    if (tally->spill != NULL) {
+        vote_spill_print_votes(tally);
+        return;
+    }
+    if (tally->matrix != NULL) {
+        vote_matrix_print_votes(tally);
+        return;
+    }
+
     for (int i = 0; i < tally->candidate_count; i++) {
-        printf("VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
+        fprintf(tally_out(), "VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
 
         int vote_count = 0;
         vote_t *current = tally->candidate_votes[i];
         while (current != NULL) {
-            printf("  ");
+            fprintf(tally_out(), "  ");
             vote_print(current);
-            printf("\n");
+            fprintf(tally_out(), "\n");
+            vote_count += current->weight;
             current = current->next;
-            vote_count++;
+            if (tally->stats != NULL) {
+                tally->stats->nodes_visited++;
+            }
+        }
+
+        fprintf(tally_out(), "%d votes total\n", vote_count);
+    }
+
+    if (tally->invalid_vote_count > 0) {
+        fprintf(tally_out(), "INVALID VOTES\n");
+        for (vote_t *current = tally->invalid_votes; current != NULL; current = current->next) {
+            fprintf(tally_out(), "  ");
+            vote_print(current);
+            fprintf(tally_out(), "\n");
+            if (tally->stats != NULL) {
+                tally->stats->nodes_visited++;
+            }
         }
+        fprintf(tally_out(), "%d votes total\n", tally->invalid_vote_count);
+    }
 
-        printf("%d votes total\n", vote_count);
+    if (tally->exhausted_vote_count > 0) {
+        fprintf(tally_out(), "EXHAUSTED VOTES\n");
+        for (vote_t *current = tally->exhausted_votes; current != NULL; current = current->next) {
+            fprintf(tally_out(), "  ");
+            vote_print(current);
+            fprintf(tally_out(), "\n");
+            if (tally->stats != NULL) {
+                tally->stats->nodes_visited++;
+            }
+        }
+        fprintf(tally_out(), "%d votes total\n", tally->exhausted_vote_count);
     }
 }
 // PROBLEM 2: Prints out the votes for each candidate in the tally
@@ -445,15 +1068,25 @@ if (tally == NULL) {
 //   following the `next` field of the vote_t struct.
 // - Each candidate vote list is ended with a line reading
 //   "ZZ votes total"
-//   with ZZ replaced by the count of votes for that candidate.
+//   with ZZ replaced by the count of votes for that candidate; a vote
+//   with a weight counts as that many votes.
 //
 // MAKEUP CREDIT: If there are any invalide votes, an additional headline
 // "INVALID VOTES"
 // is printed followed by a listing of invalid votes in the same
 // format as above and ending with a line showing the total invalid
-// votes.
+// votes. Exhausted votes follow in the same way under the headline
+// "EXHAUSTED VOTES".
 
 void tally_transfer_first_vote(tally_t *tally, int candidate_index){
+     if (tally != NULL && tally->spill != NULL && candidate_index < tally->candidate_count) {
+        vote_spill_transfer_first_vote(tally, candidate_index);
+        return;
+     }
+     if (tally != NULL && tally->matrix != NULL && candidate_index < tally->candidate_count) {
+        vote_matrix_transfer_first_vote(tally, candidate_index);
+        return;
+     }
      if (tally == NULL || candidate_index >= tally->candidate_count || tally->candidate_votes[candidate_index] == NULL) {
         return;
     }
@@ -462,31 +1095,36 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index){
     vote_t *vote_to_transfer = tally->candidate_votes[candidate_index];
 
     tally->candidate_votes[candidate_index] = vote_to_transfer->next;
-    tally->candidate_vote_counts[candidate_index]--;
+    tally->candidate_vote_counts[candidate_index] -= vote_to_transfer->weight;
 
     // Get the next preferred candidate
     vote_to_transfer->pos++; 
-    int next_candidate = vote_next_candidate(vote_to_transfer, tally->candidate_status);
+    int next_candidate = (tally->rounds != NULL) ?
+        vote_next_active(vote_to_transfer, tally->rounds->active) :
+        vote_next_candidate(vote_to_transfer, tally->candidate_status);
+    if (tally->stats != NULL) {
+        tally_stats_transfer(tally->stats, vote_to_transfer->weight, next_candidate == NO_CANDIDATE);
+    }
 
     if (next_candidate == NO_CANDIDATE) {
-        vote_to_transfer->next = tally->candidate_votes[candidate_index];
-        tally->candidate_votes[candidate_index] = vote_to_transfer;
-        tally->candidate_vote_counts[candidate_index]++;
+        // Nowhere left to go: onto the exhausted pile for good
+        vote_to_transfer->next = tally->exhausted_votes;
+        tally->exhausted_votes = vote_to_transfer;
+        tally_count_exhausted(tally, vote_to_transfer->weight);
     } else {
         // Add the vote to the next candidate's list
         vote_to_transfer->next = tally->candidate_votes[next_candidate];
         tally->candidate_votes[next_candidate] = vote_to_transfer;
-        tally->candidate_vote_counts[next_candidate]++;
-
-        // Log the vote transfer
-        if (LOG_LEVEL >= LOG_VOTE_TRANSFERS) {
-            printf("LOG: Transferred Vote ");
-            vote_print(vote_to_transfer);
-            printf(" from %d %s to %d %s\n",
-                   candidate_index, tally->candidate_names[candidate_index],
-                   next_candidate, tally->candidate_names[next_candidate]);
+        tally->candidate_vote_counts[next_candidate] += vote_to_transfer->weight;
+        if (tally->rounds != NULL) {
+            round_index_touch(tally->rounds, next_candidate);
         }
     }
+
+    // Log the vote transfer
+    if (LOG_ENABLED(LOG_VOTE_TRANSFERS)) {
+        tally_log_transfer(tally, vote_to_transfer, candidate_index, next_candidate);
+    }
 }
 // PROBLEM 2: Transfer the first vote for the candidate at
 // `candidate_index` to the next candidate indicated on the vote. This
@@ -509,12 +1147,15 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index){
 //
 // Note that vote #0002 moves from the front of Claire's list to the
 // front of Francis's list.  The `candidate_vote_count[]` array is
-// also updated. The function vote_next_candidate(vote) is used to
-// alter the vote to reflect the voters next preferred candidate and
-// that function's return value is used to determine the destination
-// candidate for the transfer. If the candidate at `candidate_index`
-// has no votes (vote list is empty), this function does nothing and
-// immediately returns.
+// also updated by the weight of the vote so a vote standing for many
+// identical ballots moves all of them in one step. The function
+// vote_next_candidate(vote) is used to alter the vote to reflect the
+// voters next preferred candidate and that function's return value is
+// used to determine the destination candidate for the transfer. If
+// the candidate at `candidate_index` has no votes (vote list is
+// empty), this function does nothing and immediately returns. During
+// tally_election() vote_next_active() with the round index's set of
+// ACTIVE candidates does the same job.
 //
 // LOGGING: if LOG_LEVEL >= LOG_VOTE_TRANSFERS then the following message
 // is printed:
@@ -523,37 +1164,121 @@ void tally_transfer_first_vote(tally_t *tally, int candidate_index){
 // vote_print() function to show the vote.
 //
 // MAKEUP CREDIT: Votes which return a NO_CANDIDATE result from
-// vote_next_candidate() are moved to the invalid_votes list with a
-// message to that effect printed:
-// "Transferred Vote #0002: 1 <0> 2  3  from 1 Claire to Invalid Votes"
+// vote_next_candidate() are exhausted: they are moved to the
+// exhausted_votes list, counted by tally_count_exhausted() and leave
+// the election for good, so a candidate's list is emptied by calling
+// this once per vote on it. A message to that effect is printed:
+// "LOG: Transferred Vote #0002: 1  0  2  3  from 1 Claire to Exhausted Votes"
+
+void tally_log_transfer(tally_t *tally, vote_t *vote, int from, int to){
+    // One write per message as with vote_print()
+    FILE *out = tally_out();
+    char buf[VOTE_PRINT_CHUNK + 2 * MAX_NAME + 64];
+    int n = sprintf(buf, "LOG: Transferred Vote ");
+    n = vote_format(vote, buf, n, out);
+    if (to == NO_CANDIDATE) {
+        n += sprintf(buf + n, " from %d %s to Exhausted Votes\n", from, tally->candidate_names[from]);
+    } else {
+        n += sprintf(buf + n, " from %d %s to %d %s\n",
+                     from, tally->candidate_names[from], to, tally->candidate_names[to]);
+    }
+    fwrite(buf, 1, n, out);
+}
+// Prints the LOG_VOTE_TRANSFERS message for `vote` moving from the
+// candidate `from` to the candidate `to`, or to the exhausted votes
+// if `to` is NO_CANDIDATE, as described for
+// tally_transfer_first_vote(). Every way of storing votes logs its
+// transfers with this.
+
+void tally_count_exhausted(tally_t *tally, int weight){
+    tally->exhausted_vote_count += weight;
+    tally->round_exhausted_count += weight;
+    if (tally->rounds != NULL) {
+        tally->rounds->total_votes -= weight;
+    }
+}
+// Counts `weight` ballots a transfer has just exhausted: they are in
+// the tally's exhausted total and the latest round's, and no longer
+// in the continuing total of tally_total_votes(). Every way of
+// storing votes calls this when it puts a vote on its exhausted pile.
 
 void tally_drop_minvote_candidates(tally_t *tally){
 if (tally == NULL) {
         return;
     }
 
-    for (int i = 0; i < tally->candidate_count; i++) {
-        if (tally->candidate_status[i] == CAND_MINVOTES) {
-            // Transfer all votes for this candidate
-            while (tally->candidate_votes[i] != NULL) {
-                tally_transfer_first_vote(tally, i);
+    // The round index already lists the MINVOTES candidates
+    int *candidates = tally->candidate_scratch;
+    int count = 0;
+    tally->round_exhausted_count = 0;
+    if (tally->rounds != NULL) {
+        count = tally->rounds->minvote_len;
+        memcpy(candidates, tally->rounds->minvote, count * sizeof(int));
+    } else {
+        for (int i = 0; i < tally->candidate_count; i++) {
+            if (tally->candidate_status[i] == CAND_MINVOTES) {
+                candidates[count++] = i;
             }
+        }
+    }
+
+    for (int k = 0; k < count; k++) {
+        int i = candidates[k];
+        // Large piles are split between threads unless every
+        // transfer is being logged
+        int transferred = 0;
+        if (tally->spill != NULL) {
+            vote_spill_transfer_all(tally, i);
+            transferred = 1;
+        } else if (tally->matrix != NULL) {
+            vote_matrix_transfer_all(tally, i);
+            transferred = 1;
+        } else if (THREAD_COUNT > 1 && !LOG_ENABLED(LOG_VOTE_TRANSFERS) &&
+            tally->candidate_vote_counts[i] >= PARALLEL_TRANSFER_MIN) {
+            transferred = tally_transfer_parallel(tally, i) == 0;
+        }
 
-            // Mark the candidate as dropped
-            tally->candidate_status[i] = CAND_DROPPED;
+        // Transfer all votes for this candidate; none come back so
+        // this is one pass over the list
+        while (!transferred && tally->candidate_votes[i] != NULL) {
+            tally_transfer_first_vote(tally, i);
+        }
 
-            // Log the candidate drop
-            if (LOG_LEVEL >= LOG_DROP_MINVOTES) {
-                printf("LOG: Dropped Candidate %d: %s\n", i, tally->candidate_names[i]);
-            }
+        // Mark the candidate as dropped
+        tally->candidate_status[i] = CAND_DROPPED;
+        if (tally->rounds != NULL) {
+            round_index_drop(tally, i);
+        }
+
+        // Log the candidate drop
+        if (LOG_ENABLED(LOG_DROP_MINVOTES)) {
+            fprintf(tally_out(), "LOG: Dropped Candidate %d: %s\n", i, tally->candidate_names[i]);
         }
     }
+
+    if (tally->rounds != NULL) {
+        round_index_repair(tally);
+    }
 }
 // PROBLEM 2: All candidates with the status CAND_MINVOTES have their
 // votes transferred to other candidates via repeated calls to
 // tally_transfer_first_vote(). Those with status CAND_MINVOTE are
 // changed to have CAND_DROPPED to indicate they are no longer part of
-// the election.
+// the election. Votes with no active candidate left go to the
+// exhausted pile rather than back to the dropped candidate, so each
+// vote is visited once and dropped candidates end with no votes.
+// tally->round_exhausted_count is reset first so it counts the votes
+// exhausted by this call.
+//
+// When THREAD_COUNT > 1 a candidate with at least
+// PARALLEL_TRANSFER_MIN votes has them moved by
+// tally_transfer_parallel() instead, which gives identical lists and
+// counts. This is skipped at LOG_VOTE_TRANSFERS so transfer messages
+// stay in order. Tallies with a vote matrix move the whole pile with
+// vote_matrix_transfer_all() and spilled tallies with
+// vote_spill_transfer_all(). During tally_election() the MINVOTES
+// candidates come from the round index and its heap is repaired once
+// all of them are dropped.
 //
 // LOGGING: If LOG_LEVEL >= LOG_DROP_MINVOTES, prints the following
 // for each MINVOTE candidate that is DROPPED:
@@ -564,49 +1289,68 @@ void tally_election(tally_t *tally){
     if (tally == NULL) {
         return;
     }
+    if (SEATS > 1) {
+        tally_stv(tally, SEATS);
+        return;
+    }
 
-    int round = 1;
+    int round = tally->rounds_done + 1;
     int condition;
+    result_sink_t *sink = result_sink(RESULT_FORMAT);
+    tally_stats_t *stats = tally->stats;
+    double mark = (stats != NULL) ? tally_stats_now() : 0;
+
+    // Without a checkpoint the election still runs, it just can't be
+    // resumed
+    checkpoint_t *checkpoint = NULL;
+    if (CHECKPOINT_FILE != NULL) {
+        checkpoint = checkpoint_open(tally, CHECKPOINT_FILE);
+    }
+
+    // Keep per-round facts up to date instead of rescanning; without
+    // memory for that the scanning versions still work
+    tally_rounds_begin(tally);
 
     while (1) {
-        printf("=== ROUND %d ===\n", round);
+        sink->round_begin(tally, round);
+        tally_stats_lap(stats, STAT_PRINT, &mark);
 
         tally_drop_minvote_candidates(tally);
+        tally_stats_lap(stats, STAT_DROP, &mark);
 
-        tally_print_table(tally);
+        sink->round_end(tally, round);
 
-        if (LOG_LEVEL >= LOG_SHOWVOTES) {
+        if (LOG_ENABLED(LOG_SHOWVOTES)) {
             tally_print_votes(tally);
         }
+        tally_stats_lap(stats, STAT_PRINT, &mark);
 
         tally_set_minvote_candidates(tally);
 
         condition = tally_condition(tally);
+        tally_stats_lap(stats, STAT_MINVOTE, &mark);
 
         if (condition != TALLY_CONTINUE) {
             break;
         }
 
+        tally->rounds_done = round;
+        checkpoint_write(checkpoint, tally);
         round++;
     }
 
-    // Print final result based on the tally condition
-    if (condition == TALLY_WINNER) {
-        for (int i = 0; i < tally->candidate_count; i++) {
-            if (tally->candidate_status[i] == CAND_ACTIVE) {
-                printf("Winner: %s (candidate %d)\n", tally->candidate_names[i], i);
-                return;
-            }
-        }
-    } else if (condition == TALLY_TIE) {
-        printf("Multiway Tie Between:\n");
-        for (int i = 0; i < tally->candidate_count; i++) {
-            if (tally->candidate_status[i] == CAND_MINVOTES) {
-                printf("%s (candidate %d)\n", tally->candidate_names[i], i);
-            }
-        }
-    } else if (condition == TALLY_ERROR) {
-        printf("Something is rotten in the state of Denmark\n");
+    tally_rounds_end(tally);
+    checkpoint_close(checkpoint);
+
+    // Report the final result based on the tally condition
+    sink->result(tally, round, condition);
+    if (tally->pairwise != NULL) {
+        sink->pairwise(tally);
+    }
+
+    if (stats != NULL) {
+        tally_stats_lap(stats, STAT_PRINT, &mark);
+        sink->stats(tally);
     }
 }
 // PROBLEM 2: Executes an election on the given tally.  Repeatedly
@@ -665,115 +1409,569 @@ void tally_election(tally_t *tally){
 //   3     -     - D Viktor
 // Winner: Francis (candidate 0)
 //
+// The headlines, tables and final messages above are those of the
+// default RESULT_TABLE format. They are produced by the result_sink_t
+// for RESULT_FORMAT so RESULT_JSON and RESULT_CSV report the same
+// rounds and outcome as structured records instead; see rcv_sink.c.
+// LOG messages and the LOG_SHOWVOTES listing are printed as text in
+// every format.
+//
+// If the tally has stats (see COLLECT_STATS) the time of each phase
+// of every round is added up with tally_stats_lap() and the sink
+// prints the stats after the final result.
+//
+// If the tally has pairwise counts (see PAIRWISE) the sink reports
+// them and any Condorcet winner right after the final result; they
+// come from the ballots as loaded so don't depend on the rounds.
+//
+// If SEATS is more than 1 the election is a multi-winner count done
+// by tally_stv() instead.
+//
+// If CHECKPOINT_FILE is set, the state of the tally is saved to it
+// with checkpoint_write() at the end of every round that the election
+// continues after. A tally loaded from that file has rounds_done set
+// to the round saved, and tally_election() carries on from the next
+// round, printing what the original election would have from there.
+// A tally that can't be checkpointed (one with a spill) prints an
+// ERROR message and runs without.
 
 ////////////////////////////////////////////////////////////////////////////////
 // PROBLEM 3 FUNCTIONS
 
+int vote_reader_open(vote_reader_t *reader, char *fname, int map){
+    memset(reader, 0, sizeof(vote_reader_t));
+    reader->fd = open(fname, O_RDONLY);
+    if (reader->fd < 0) {
+        return -1;
+    }
+
+    // Regular, non-empty files are mapped and parsed in place
+    struct stat sb;
+    if (map && fstat(reader->fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;          // pre-fault pages rather than taking one fault per page
+#endif
+        void *map = mmap(NULL, sb.st_size, PROT_READ, flags, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, sb.st_size, MADV_SEQUENTIAL);
+            reader->data = map;
+            reader->len = sb.st_size;
+            reader->mapped = 1;
+            reader->eof = 1;
+            return 0;
+        }
+    }
+
+    // Anything else (pipes, empty files, failed mmap) is streamed
+    reader->capacity = VOTE_READER_CHUNK;
+    reader->data = malloc(reader->capacity);
+    if (reader->data == NULL) {
+        close(reader->fd);
+        return -1;
+    }
+    return 0;
+}
+// Opens `fname` for reading by vote_reader_line(). Regular files are
+// memory-mapped so lines are handed out directly from the mapping
+// without copying; if the file can't be mapped (a pipe, an empty file,
+// mmap() failure) or `map` is 0 the reader falls back to read()'ing it
+// through a buffer of VOTE_READER_CHUNK bytes that grows to hold long
+// lines. Returns 0 on success and -1 if the file can't be opened.
+
+void vote_reader_close(vote_reader_t *reader){
+    if (reader->mapped) {
+        munmap(reader->data, reader->len);
+    } else {
+        free(reader->data);
+    }
+    close(reader->fd);
+}
+// Releases the mapping or buffer of the reader and closes its file.
+
+static int vote_reader_refill(vote_reader_t *reader){
+    // Shift unread bytes to the front, growing the buffer if it is all unread
+    size_t unread = reader->len - reader->pos;
+    memmove(reader->data, reader->data + reader->pos, unread);
+    reader->len = unread;
+    reader->pos = 0;
+    if (reader->len == reader->capacity) {
+        char *bigger = realloc(reader->data, 2 * reader->capacity);
+        if (bigger == NULL) {
+            reader->error = 1;
+            return -1;
+        }
+        reader->data = bigger;
+        reader->capacity *= 2;
+    }
+
+    ssize_t nread;
+    do {
+        nread = read(reader->fd, reader->data + reader->len, reader->capacity - reader->len);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread < 0) {
+        reader->error = 1;
+        return -1;
+    }
+    if (nread == 0) {
+        reader->eof = 1;
+        return 0;
+    }
+    reader->len += nread;
+    return nread;
+}
+// Streaming mode only: reads the next block of the file into the
+// reader's buffer keeping any unread bytes. Returns the number of
+// bytes read, 0 at the end of the file, or -1 on an error.
+
+char *vote_reader_line(vote_reader_t *reader, size_t *length){
+    size_t scanned = 0;
+    while (1) {
+        char *start = reader->data + reader->pos;
+        size_t avail = reader->len - reader->pos;
+        char *newline = memchr(start + scanned, '\n', avail - scanned);
+        if (newline != NULL) {
+            *length = newline - start;
+            reader->pos += *length + 1;
+            reader->line++;
+            return start;
+        }
+        scanned = avail;
+
+        if (reader->eof) {
+            if (avail == 0) {
+                return NULL;
+            }
+            // Final line with no newline
+            *length = avail;
+            reader->pos = reader->len;
+            reader->line++;
+            return start;
+        }
+
+        if (vote_reader_refill(reader) < 0) {
+            return NULL;
+        }
+    }
+}
+// Returns a pointer to the next line of the file and sets `length` to
+// its length excluding the newline; the line is NOT null terminated.
+// reader->line is the 1-based number of the returned line. Returns
+// NULL at the end of the file or on a read error (reader->error is
+// set). In streaming mode the line is only valid until the next call.
+
+static char *next_token(char **pos, char *end, size_t *length){
+    char *p = *pos;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    if (p == end) {
+        *pos = p;
+        return NULL;
+    }
+    char *token = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+    *length = p - token;
+    *pos = p;
+    return token;
+}
+// Returns the next whitespace separated token between *pos and end,
+// advancing *pos past it, or NULL if only whitespace remains.
+
+int vote_parse_line(char *line, char *end, int *order, int candidate_count){
+    char *p = line;
+    int count = 0;
+    while (1) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+        if (p == end) {
+            return count;
+        }
+
+        int negative = 0;
+        if (*p == '-') {
+            negative = 1;
+            p++;
+        }
+        unsigned digit;
+        if (p == end || (digit = (unsigned char)*p - '0') > 9) {
+            return -1;
+        }
+        int value = 0;
+        do {
+            if (value <= MAX_CANDIDATES) {      // anything larger is out of range anyway
+                value = value * 10 + digit;
+            }
+            p++;
+        } while (p < end && (digit = (unsigned char)*p - '0') <= 9);
+        if (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+            return -1;
+        }
+        if (negative) {
+            value = -value;
+        }
+        if (value < NO_CANDIDATE || value >= candidate_count) {
+            return -1;
+        }
+
+        if (count < candidate_count) {
+            order[count] = value;
+        }
+        count++;
+    }
+}
+// Parses the preferences on a single vote line between `line` and
+// `end` into order[] without any library calls. Each token must be an
+// integer that is a valid candidate index or NO_CANDIDATE (-1). At
+// most `candidate_count` values are stored but all are counted.
+// Returns the number of preferences on the line (0 for a blank line)
+// or -1 if any token is not a valid preference.
+
+static uint64_t vote_class_hash(int *order, int candidate_count){
+    uint64_t hash = 14695981039346656037ULL;           // FNV-1a
+    for (int i = 0; i < candidate_count && order[i] != NO_CANDIDATE; i++) {
+        hash = (hash ^ (uint32_t) order[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+// Hashes the preferences of a vote up to its first NO_CANDIDATE.
+
+static uint64_t vote_class_hash_vote(vote_t *vote){
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < vote->len; i++) {
+        hash = (hash ^ (uint32_t) VOTE_RANK(vote, i)) * 1099511628211ULL;
+    }
+    return hash;
+}
+// The same hash for the stored ranking of a vote.
+
+static int vote_class_equal(vote_t *vote, int *order, int candidate_count){
+    for (int i = 0; i < vote->len; i++) {
+        if (VOTE_RANK(vote, i) != order[i]) {
+            return 0;
+        }
+    }
+    return vote->len == candidate_count || order[vote->len] == NO_CANDIDATE;
+}
+// Returns 1 if the ranking of `vote` is the same as `order` up to the
+// first NO_CANDIDATE, after which no further preferences are ever
+// used.
+
+int vote_class_table_init(vote_class_table_t *table, int candidate_count){
+    table->capacity = VOTE_CLASS_MIN;
+    table->count = 0;
+    table->candidate_count = candidate_count;
+    table->slots = calloc(table->capacity, sizeof(vote_t *));
+    return table->slots == NULL ? -1 : 0;
+}
+// Initializes an empty table of ballot classes for rankings of
+// `candidate_count` candidates. Returns 0 on success, -1 if memory
+// can't be allocated.
+
+void vote_class_table_free(vote_class_table_t *table){
+    free(table->slots);
+    table->slots = NULL;
+}
+// Frees the table; the votes in it belong to the tally and are not
+// freed.
+
+vote_t **vote_class_slot(vote_class_table_t *table, int *order){
+    // Keep the table at most half full, growing before probing so the
+    // returned slot stays valid
+    if (2 * (table->count + 1) > table->capacity) {
+        size_t capacity = 2 * table->capacity;
+        vote_t **slots = calloc(capacity, sizeof(vote_t *));
+        if (slots == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            vote_t *vote = table->slots[i];
+            if (vote != NULL) {
+                size_t j = vote_class_hash_vote(vote) & (capacity - 1);
+                while (slots[j] != NULL) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                slots[j] = vote;
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    size_t i = vote_class_hash(order, table->candidate_count) & (table->capacity - 1);
+    while (table->slots[i] != NULL &&
+           !vote_class_equal(table->slots[i], order, table->candidate_count)) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return &table->slots[i];
+}
+// Looks up the ballot class for the ranking in `order` using linear
+// probing. Returns a pointer to the slot holding the vote_t that
+// represents the class or, if there is no such class yet, to the
+// empty slot where it belongs; the caller stores the new class vote
+// there and increments table->count. Returns NULL if the table could
+// not be grown.
+
+int tally_add_duplicate(tally_t *tally, vote_class_table_t *table, int *order){
+    vote_t **slot = vote_class_slot(table, order);
+    if (slot == NULL) {
+        return -1;
+    }
+    vote_t *vote = *slot;
+    if (vote == NULL) {
+        return 0;
+    }
+
+    // Another ballot for an existing class: votes are only deduplicated
+    // while loading so the class is still at its first preference
+    vote->weight++;
+    if (tally->pairwise != NULL) {
+        pairwise_add(tally->pairwise, vote, 1);
+    }
+    int candidate = (vote->pos < vote->len) ? VOTE_RANK(vote, vote->pos) : NO_CANDIDATE;
+    if (candidate == NO_CANDIDATE) {
+        tally->invalid_vote_count++;
+    } else {
+        tally->candidate_vote_counts[candidate]++;
+    }
+    return 1;
+}
+// Used by loaders when DEDUP_VOTES is on. If a vote with the same
+// ranking as `order` is already in the tally, increments its weight
+// and its candidate's count (and its pairwise counts, if the tally has
+// them) and returns 1. Returns 0 if the ranking
+// is new; the loader then adds a vote for it and records it with
+// vote_class_insert(). Returns -1 if memory runs out.
+
+void vote_class_insert(vote_class_table_t *table, vote_t *vote, int *order){
+    vote_t **slot = vote_class_slot(table, order);
+    if (slot != NULL && *slot == NULL) {
+        *slot = vote;
+        table->count++;
+    }
+}
+// Records `vote`, which was made from the ranking `order`, as the
+// representative of its ranking's class.
+
 tally_t *tally_from_file(char *fname){
 
-    FILE *file = fopen(fname, "r");
-    if (file == NULL) {
-        printf("ERROR: couldn't open file '%s'\n", fname);
+    vote_reader_t reader;
+    if (vote_reader_open(&reader, fname, SPILL_DIR == NULL) != 0) {
+        tally_error("couldn't open file '%s'", fname);
         return NULL;
     }
 
-    if (LOG_LEVEL >= LOG_FILEIO) {
-        printf("LOG: File '%s' opened\n", fname);
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' opened\n", fname);
     }
 
     // Allocate memory for the tally
-    tally_t *tally = (tally_t *)malloc(sizeof(tally_t));
+    tally_t *tally = tally_make_empty();
     if (tally == NULL) {
-        fclose(file);
+        vote_reader_close(&reader);
         return NULL;
     }
 
-    // Initialize tally fields
-    tally->candidate_count = 0;
-    tally->invalid_vote_count = 0;
-    tally->invalid_votes = NULL;
-    for (int i = 0; i < MAX_CANDIDATES; i++) {
-        tally->candidate_vote_counts[i] = 0;
-        tally->candidate_status[i] = CAND_DROPPED; 
-        tally->candidate_votes[i] = NULL; 
-        memset(tally->candidate_names[i], 0, MAX_NAME);
+    // Read the number of candidates then their names which may be
+    // spread over several lines
+    int names_read = -1;                // -1 until the count is read
+    char *line;
+    size_t line_len;
+    while (names_read < tally->candidate_count &&
+           (line = vote_reader_line(&reader, &line_len)) != NULL) {
+        char *p = line, *end = line + line_len;
+        char *token;
+        size_t token_len;
+        while (names_read < tally->candidate_count &&
+               (token = next_token(&p, end, &token_len)) != NULL) {
+            if (names_read == -1) {
+                int count = 0;
+                for (size_t i = 0; i < token_len; i++) {
+                    if (token[i] < '0' || token[i] > '9' || count > MAX_CANDIDATES) {
+                        count = -1;
+                        break;
+                    }
+                    count = count * 10 + (token[i] - '0');
+                }
+                if (count < 1 || count > MAX_CANDIDATES) {
+                    tally_error("failed to read number of candidates");
+                    vote_reader_close(&reader);
+                    free(tally);
+                    return NULL;
+                }
+                if (tally_set_candidate_count(tally, count) != 0) {
+                    tally_error("memory allocation failed for candidates");
+                    vote_reader_close(&reader);
+                    free(tally);
+                    return NULL;
+                }
+                names_read = 0;
+
+                if (LOG_ENABLED(LOG_FILEIO)) {
+                    // Log message with the typo to match expected output
+                    fprintf(tally_out(), "LOG: File '%s' has %d candidtes\n", fname, tally->candidate_count);
+                }
+                continue;
+            }
+
+            int i = names_read++;
+            if (token_len >= MAX_NAME) {
+                token_len = MAX_NAME - 1;
+            }
+            memcpy(tally->candidate_names[i], token, token_len);
+            tally->candidate_status[i] = CAND_ACTIVE;
+            if (LOG_ENABLED(LOG_FILEIO)) {
+                fprintf(tally_out(), "LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);
+            }
+        }
     }
 
-    // Read the number of candidates
-    if (fscanf(file, "%d", &(tally->candidate_count)) != 1) {
-        printf("ERROR: failed to read number of candidates\n");
-        fclose(file);
+    if (names_read == -1) {
+        tally_error("failed to read number of candidates");
+        vote_reader_close(&reader);
         free(tally);
         return NULL;
     }
+    if (names_read < tally->candidate_count) {
+        tally_error("failed to read candidate names");
+        vote_reader_close(&reader);
+        tally_free(tally);
+        return NULL;
+    }
 
-    if (LOG_LEVEL >= LOG_FILEIO) {
-        // Log message with the typo to match expected output
-        printf("LOG: File '%s' has %d candidtes\n", fname, tally->candidate_count);
+    // Spilled votes go to run files as they are read; only then is
+    // the file streamed rather than mapped, so such tallies are
+    // loaded by one thread and without deduplication
+    int dedup = DEDUP_VOTES && SPILL_DIR == NULL;
+    if (SPILL_DIR != NULL && tally_use_spill(tally, SPILL_DIR) != 0) {
+        vote_reader_close(&reader);
+        tally_free(tally);
+        return NULL;
+    }
+    if (PAIRWISE && tally_use_pairwise(tally) != 0) {
+        vote_reader_close(&reader);
+        tally_free(tally);
+        return NULL;
     }
 
-    // Read candidate names
-    for (int i = 0; i < tally->candidate_count; i++) {
-        if (fscanf(file, "%s", tally->candidate_names[i]) != 1) {
-            printf("ERROR: failed to read candidate names\n");
-            fclose(file);
+    // Large mapped files are split between threads when there is no
+    // per-vote logging or deduplication which need a single pass
+    if (THREAD_COUNT > 1 && reader.mapped && !dedup && !LOG_ENABLED(LOG_FILEIO) &&
+        reader.len - reader.pos >= PARALLEL_LOAD_MIN) {
+        int ret = tally_load_parallel(tally, reader.data + reader.pos, reader.data + reader.len,
+                                      reader.line, fname);
+        vote_reader_close(&reader);
+        if (ret != 0) {
             tally_free(tally);
             return NULL;
         }
-        tally->candidate_status[i] = CAND_ACTIVE;
-        if (LOG_LEVEL >= LOG_FILEIO) {
-            printf("LOG: File '%s' candidate %d is %s\n", fname, i, tally->candidate_names[i]);
-        }
+        return tally;
     }
 
-    // Read votes until the end of the file
+    vote_class_table_t classes;
+    if (dedup && vote_class_table_init(&classes, tally->candidate_count) != 0) {
+        tally_error("memory allocation failed for vote classes");
+        vote_reader_close(&reader);
+        tally_free(tally);
+        return NULL;
+    }
+
+    // Read votes, one per line, until the end of the file
     int vote_id = 1;
-    while (1) {
-        vote_t *vote = vote_make_empty();
-        if (vote == NULL) {
-            printf("ERROR: memory allocation failed for vote\n");
-            fclose(file);
+    int *order = tally->candidate_scratch;
+    while ((line = vote_reader_line(&reader, &line_len)) != NULL) {
+        int count = vote_parse_line(line, line + line_len, order, tally->candidate_count);
+        if (count == 0) {               // blank line
+            continue;
+        }
+        if (count < 0) {
+            tally_error("file '%s' line %ld vote #%04d: invalid candidate in vote, line ignored",
+                        fname, reader.line, vote_id++);
+            continue;
+        }
+        if (count != tally->candidate_count) {
+            tally_error("file '%s' line %ld vote #%04d: expected %d preferences, found %d, line ignored",
+                        fname, reader.line, vote_id++, tally->candidate_count, count);
+            continue;
+        }
+
+        // Repeated rankings only add weight to their existing class
+        int duplicate = dedup ? tally_add_duplicate(tally, &classes, order) : 0;
+        vote_t *vote = NULL;
+        int len = vote_order_len(order, tally->candidate_count);
+        if (duplicate == 0) {
+            // Only complete votes are allocated, from the tally's arena
+            vote = tally_vote_alloc(tally, len);
+        }
+        if (duplicate < 0 || (duplicate == 0 && vote == NULL)) {
+            tally_error("memory allocation failed for vote");
+            if (dedup) {
+                vote_class_table_free(&classes);
+            }
+            vote_reader_close(&reader);
             tally_free(tally);
             return NULL;
         }
-
-        vote->id = vote_id++;
-        int status;
-        for (int i = 0; i < tally->candidate_count; i++) {
-            status = fscanf(file, "%d", &(vote->candidate_order[i]));
-            if (status != 1) {
-                free(vote);  
-                break;
+        if (duplicate) {
+            if (LOG_ENABLED(LOG_FILEIO)) {
+                fprintf(tally_out(), "LOG: File '%s' vote #%04d:<%d> ", fname, vote_id, order[0]);
+                for (int i = 1; i < tally->candidate_count; i++) {
+                    fprintf(tally_out(), "%d ", order[i]);
+                }
+                fprintf(tally_out(), "\n");
             }
+            vote_id++;
+            continue;
         }
 
-        if (status != 1) { // End of file 
-            break;
-        }
+        vote->id = vote_id++;
+        vote_set_ranks(vote, order);
 
         // Set initial preference
         vote->pos = 0;
 
         // Log the vote read with correct format
-        if (LOG_LEVEL >= LOG_FILEIO) {
-            printf("LOG: File '%s' vote #%04d:<%d> ", fname, vote->id, vote->candidate_order[0]);
+        if (LOG_ENABLED(LOG_FILEIO)) {
+            fprintf(tally_out(), "LOG: File '%s' vote #%04d:<%d> ", fname, vote->id, order[0]);
             for (int i = 1; i < tally->candidate_count; i++) {
-                printf("%d ", vote->candidate_order[i]);
+                fprintf(tally_out(), "%d ", order[i]);
             }
-            printf("\n");
+            fprintf(tally_out(), "\n");
         }
 
         // Add vote
         tally_add_vote(tally, vote);
+        if (dedup) {
+            vote_class_insert(&classes, vote, order);
+        }
+    }
+
+    if (dedup) {
+        if (LOG_ENABLED(LOG_FILEIO)) {
+            fprintf(tally_out(), "LOG: File '%s' has %zu distinct rankings\n", fname, classes.count);
+        }
+        vote_class_table_free(&classes);
+    }
+
+    if (reader.error) {
+        tally_error("failed reading file '%s'", fname);
+        vote_reader_close(&reader);
+        tally_free(tally);
+        return NULL;
     }
 
     // Log that the end of file is reached
-    if (LOG_LEVEL >= LOG_FILEIO) {
-        printf("LOG: File '%s' end of file reached\n", fname);
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' end of file reached\n", fname);
     }
 
     // Close
-    fclose(file);
+    vote_reader_close(&reader);
     return tally;
 }
 // PROBLEM 3: Opens the given `fname` and reads its contents to create
@@ -804,20 +2002,24 @@ tally_t *tally_from_file(char *fname){
 //
 // Other examples are present in the "data/" directory.
 //
-// This function heap-allocates a tally_t struct then begins reading
-// information from the file into the fields of that struct starting
-// with the number of candidates and their names.  A loop is then used
-// to iterate reading votes until the End of the File (EOF) is
-// reached.  On determining that there is a vote to read, an empty
-// vote_t is allocated using vote_make_empty() and the order
-// preference of candidates is read into the vote along with
+// This function heap-allocates a tally_t struct via tally_make_empty()
+// then begins reading information from the file into the fields of
+// that struct starting with the number of candidates and their
+// names.  A loop is then used to iterate reading votes until the End
+// of the File (EOF) is reached.  On determining that there is a vote
+// to read, a vote_t sized for the preferences before the first
+// NO_CANDIDATE is allocated from the tally's arena using
+// tally_vote_alloc() (same initial state as vote_make_empty()) and
+// the order preference of candidates is read into the vote along with
 // initializing its pos and id fields. It is then added to the tally
 // via tally_add_vote() before iterating to try to read another vote.
 //
-// This function makes heavy use of fscanf() to read data and checks
-// the return value of fscanf() at times to determine if the end of a
-// file has been reached. On reaching the end of the input, the file
-// is closed and the completed tally is returned
+// The file is read through a vote_reader_t which memory-maps it (or
+// streams it when that is not possible) and hands out one line at a
+// time; preferences are converted by vote_parse_line() rather than
+// fscanf() which avoids its locale handling and per-call locking.
+// Each vote must be on its own line. On reaching the end of the
+// input, the file is closed and the completed tally is returned
 //
 // ERROR CASES: Near the beginning of its operation, this function
 // checks that the specified file is opened successfully. If not, it
@@ -825,14 +2027,39 @@ tally_t *tally_from_file(char *fname){
 // "ERROR: couldn't open file 'XX'"
 // with XX as the filename. NULL is returned in this case.
 //
-// Aside from failure to open a file, this function assumes that the
-// data is formatted correctly and does no other error handling.
+// The data is expected to be formatted as follows.
 // - The first token is NCAND, the number of candidates
 // - The next tokens are NCAND strings which are the candidate names
-// - Each subsequent vote has exactly NCAND integers
-// Bad input data that does not follow the above conventions will
-// cause this function to have unpredictable behavior that is not
-// tested.
+// - Each subsequent line is a vote with exactly NCAND integers
+// A missing or out of range NCAND or too few names prints an ERROR
+// message as above and returns NULL. A vote line with the wrong
+// number of preferences or a token that isn't a candidate index or
+// NO_CANDIDATE is reported with its line number and vote id, as in
+// "ERROR: file 'XX' line 12 vote #0010: expected 4 preferences, found 3, line ignored"
+// "ERROR: file 'XX' line 13 vote #0011: invalid candidate in vote, line ignored"
+// and skipped. Its id is consumed so that vote ids number every vote
+// line, which is what what-if scenarios exclude ballots by. Blank
+// lines are ignored.
+//
+// If DEDUP_VOTES is set, each vote is looked up by its ranking with
+// tally_add_duplicate(): a ballot identical to an earlier one only
+// increments the weight of the earlier vote_t (its id is consumed but
+// no vote is allocated) so the tally holds one vote per distinct
+// ranking and elections move whole classes in single transfers.
+//
+// If THREAD_COUNT > 1 and the file is mapped and at least
+// PARALLEL_LOAD_MIN bytes of votes remain after the header, the votes
+// are parsed by tally_load_parallel() instead, producing the same
+// tally. Deduplication and LOG_FILEIO logging always use one thread.
+//
+// If SPILL_DIR is set the tally keeps its votes in run files there,
+// see tally_use_spill(). The file is then read through a buffer
+// instead of being mapped so memory use doesn't grow with its size,
+// and DEDUP_VOTES and THREAD_COUNT don't apply.
+//
+// If PAIRWISE is set the tally gets pairwise counts before any vote
+// is read (see tally_use_pairwise()) which every loading path fills
+// in as it adds votes.
 //
 // LOGGING: If LOG_LEVEL >= LOG_FILEIO, this function prints the
 // following messages which show the progress of the
@@ -848,5 +2075,29 @@ tally_t *tally_from_file(char *fname){
 // candidate order. If the first preference in a vote is -1, it is
 // immediately placed in the Invalid Vote list
 
+tally_t *tally_load(char *fname){
+    double start = COLLECT_STATS ? tally_stats_now() : 0;
+
+    // Binary ballot files and checkpoints are detected by their header
+    tally_t *tally;
+    if (rcvb_is_binary(fname)) {
+        tally = tally_from_binary(fname);
+    } else if (rcvc_is_checkpoint(fname)) {
+        tally = tally_from_checkpoint(fname);
+    } else {
+        tally = tally_from_file(fname);
+    }
+
+    if (tally != NULL && COLLECT_STATS && tally_use_stats(tally) == 0) {
+        tally->stats->phase_sec[STAT_LOAD] = tally_stats_now() - start;
+    }
+    return tally;
+}
+// Loads `fname` with tally_from_binary() if it is a binary ballot
+// file, tally_from_checkpoint() if it is a checkpoint and
+// tally_from_file() otherwise. If COLLECT_STATS is set the tally
+// gets stats (see tally_use_stats()) with the loading time recorded.
+// Returns NULL if the file can't be loaded.
+
 int main(int argc, char *argv[]); // this function in rcv_main.c
 // PROBLEM 3: main() in rcv_main.c
@@ -0,0 +1,625 @@
+// rcv_live.c: Counting Ranked Choice Voting ballots while they arrive
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// LIVE TALLIES
+//
+// On election night ballots keep arriving while preliminary counts
+// are wanted. A live_tally_t keeps the ranking of every ballot taken
+// in so far as a row in vote matrix layout and never changes a row
+// once written. A snapshot is a tally whose vote_matrix_t borrows
+// those rows and has only its own positions and piles, so taking one
+// costs a pass over the first preferences rather than a copy of the
+// ballots, and its election can't disturb the rows or other
+// snapshots.
+//
+// Producer threads add ballots with live_tally_add() which pushes
+// them onto a lock-free stack with one compare-and-swap; they never
+// wait for a count. The thread taking snapshots is the only consumer:
+// it swaps out the whole stack at once, so popping can't suffer from
+// ABA, and appends the ballots as rows in arrival order. Snapshots
+// never read rows past their own vote_count so appending needs no
+// lock either. When the block of rows is full, or too narrow for a
+// ranking, a bigger copy replaces it and the old one is freed once
+// the last snapshot using it is.
+
+static live_block_t *live_block_make(int capacity, int width){
+    live_block_t *block = calloc(1, sizeof(live_block_t));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->refs = 1;
+    block->capacity = capacity;
+    block->width = width;
+    block->ranks = malloc((size_t) capacity * width * sizeof(rank_t) + 1);
+    block->ids = malloc((size_t) capacity * sizeof(int) + 1);
+    if (block->ranks == NULL || block->ids == NULL) {
+        live_block_release(block);
+        return NULL;
+    }
+    return block;
+}
+// Allocates a block of rows with one reference and no weights.
+// Returns NULL if memory runs out.
+
+void live_block_release(live_block_t *block){
+    if (block != NULL && __atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block->ranks);
+        free(block->ids);
+        free(block->weights);
+        free(block);
+    }
+}
+// Drops one reference to `block`, freeing it with the last. Snapshots
+// may be freed by any thread so the count is changed atomically.
+
+static int live_tally_grow(live_tally_t *live, int len){
+    live_block_t *block = live->block;
+    int capacity = block->capacity;
+    if (live->vote_count == capacity) {
+        capacity = (capacity < VOTE_SLAB_MIN) ? VOTE_SLAB_MIN : 2 * capacity;
+    }
+    int width = (len > block->width) ? len : block->width;
+
+    live_block_t *bigger = live_block_make(capacity, width);
+    if (bigger == NULL) {
+        return -1;
+    }
+    if (block->weights != NULL) {
+        bigger->weights = malloc((size_t) capacity * sizeof(int) + 1);
+        if (bigger->weights == NULL) {
+            live_block_release(bigger);
+            return -1;
+        }
+        memcpy(bigger->weights, block->weights, live->vote_count * sizeof(int));
+    }
+    memcpy(bigger->ids, block->ids, live->vote_count * sizeof(int));
+    for (int row = 0; row < live->vote_count; row++) {
+        for (int i = 0; i < width; i++) {
+            bigger->ranks[(size_t) row * width + i] = (i < block->width) ?
+                block->ranks[(size_t) row * block->width + i] : NO_CANDIDATE;
+        }
+    }
+
+    live->block = bigger;
+    live_block_release(block);
+    return 0;
+}
+// Replaces the block with a copy that has room for another row of
+// `len` preferences: twice the rows if it is full and rows padded
+// with NO_CANDIDATE if `len` is wider. Snapshots keep the old block.
+// Returns 0 on success or -1 if memory runs out leaving it unchanged.
+
+live_tally_t *live_tally_start(tally_t *tally){
+    if (tally->rounds_done != 0) {
+        tally_error("live tallies need ballots at their first preference");
+        return NULL;
+    }
+    if (tally_use_matrix(tally) != 0) {
+        return NULL;
+    }
+
+    live_tally_t *live = calloc(1, sizeof(live_tally_t));
+    live_block_t *block = calloc(1, sizeof(live_block_t));
+    char (*names)[MAX_NAME] = malloc((size_t) tally->candidate_count * MAX_NAME);
+    if (live == NULL || block == NULL || names == NULL) {
+        free(live);
+        free(block);
+        free(names);
+        return NULL;
+    }
+
+    // The matrix rows become the first block
+    vote_matrix_t *matrix = tally->matrix;
+    block->refs = 1;
+    block->capacity = matrix->capacity;
+    block->width = matrix->width;
+    block->ranks = matrix->ranks;
+    block->ids = matrix->ids;
+    block->weights = matrix->weights;
+    matrix->ranks = NULL;
+    matrix->ids = NULL;
+    matrix->weights = NULL;
+
+    live->candidate_count = tally->candidate_count;
+    live->candidate_names = names;
+    memcpy(names, tally->candidate_names, (size_t) tally->candidate_count * MAX_NAME);
+    live->block = block;
+    live->vote_count = matrix->vote_count;
+    live->next_id = 1;
+    for (int row = 0; row < matrix->vote_count; row++) {
+        if (block->ids[row] >= live->next_id) {
+            live->next_id = block->ids[row] + 1;
+        }
+    }
+
+    tally_free(tally);
+    return live;
+}
+// Makes a live tally from a freshly loaded `tally`, whose ballots are
+// all at their first preference, and frees the tally. Its votes'
+// rankings become the first rows, moved rather than copied through a
+// vote matrix (see tally_use_matrix()), and ballots added later get
+// ids after the highest of theirs. Returns NULL if the tally can't be
+// used, after printing an ERROR message, or if memory runs out; the
+// caller then still owns the tally.
+
+int live_tally_add(live_tally_t *live, int *order){
+    int len = vote_order_len(order, live->candidate_count);
+    vote_t *vote = vote_make_empty(len);
+    if (vote == NULL) {
+        return -1;
+    }
+    vote->pos = 0;
+    vote->len = len;
+    vote_set_ranks(vote, order);
+
+    vote->next = __atomic_load_n(&live->queue, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&live->queue, &vote->next, vote, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // vote->next now holds the newer head, try again on top of it
+    }
+    return 0;
+}
+// Adds one ballot with the ranking in `order` (candidate_count entries
+// as vote_parse_line() fills in) to the live tally. Safe to call from
+// any number of threads at once and while snapshots are taken or
+// counted: the ballot is queued without a lock and becomes part of
+// the next snapshot. Returns 0 or -1 if memory runs out.
+
+static int live_tally_take(live_tally_t *live){
+    // Take the whole queue and put it in arrival order after any
+    // ballots left over from last time
+    vote_t *vote = __atomic_exchange_n(&live->queue, NULL, __ATOMIC_ACQUIRE);
+    vote_t *arrived = NULL;
+    while (vote != NULL) {
+        vote_t *next = vote->next;
+        vote->next = arrived;
+        arrived = vote;
+        vote = next;
+    }
+    vote_t **tail = &live->pending;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = arrived;
+
+    while (live->pending != NULL) {
+        vote = live->pending;
+        if ((live->vote_count == live->block->capacity || vote->len > live->block->width) &&
+            live_tally_grow(live, vote->len) != 0) {
+            return -1;
+        }
+
+        live_block_t *block = live->block;
+        int row = live->vote_count;
+        rank_t *ranks = &block->ranks[(size_t) row * block->width];
+        for (int i = 0; i < block->width; i++) {
+            ranks[i] = (i < vote->len) ? VOTE_RANK(vote, i) : NO_CANDIDATE;
+        }
+        block->ids[row] = live->next_id++;
+        if (block->weights != NULL) {
+            block->weights[row] = vote->weight;
+        }
+        live->vote_count++;
+
+        live->pending = vote->next;
+        free(vote);
+    }
+    return 0;
+}
+// Appends every ballot queued by producers as a row. Only the thread
+// taking snapshots calls this. Returns 0 or -1 if memory runs out in
+// which case the ballots not yet appended are kept for next time.
+
+tally_t *live_tally_scenario(live_tally_t *live, scenario_t *scenario){
+    double start = COLLECT_STATS ? tally_stats_now() : 0;
+    tally_t *tally = tally_make_empty();
+    vote_matrix_t *matrix = calloc(1, sizeof(vote_matrix_t));
+    int *counts = malloc((live->candidate_count + 1) * sizeof(int));
+    if (tally == NULL || matrix == NULL || counts == NULL ||
+        tally_set_candidate_count(tally, live->candidate_count) != 0) {
+        tally_error("memory allocation failed for snapshot");
+        tally_free(tally);
+        free(matrix);
+        free(counts);
+        return NULL;
+    }
+    memcpy(tally->candidate_names, live->candidate_names, (size_t) live->candidate_count * MAX_NAME);
+    memset(tally->candidate_status, CAND_ACTIVE, live->candidate_count);
+    for (int i = 0; scenario != NULL && scenario->withdrawn != NULL && i < live->candidate_count; i++) {
+        if (scenario->withdrawn[i]) {
+            tally->candidate_status[i] = CAND_DROPPED;
+        }
+    }
+
+    // Rows are borrowed as they are; positions and piles are the
+    // snapshot's own
+    live_block_t *block = live->block;
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    matrix->block = block;
+    matrix->ranks = block->ranks;
+    matrix->ids = block->ids;
+    matrix->weights = block->weights;
+    matrix->vote_count = live->vote_count;
+    matrix->capacity = live->vote_count;
+    matrix->width = block->width;
+    matrix->pos = calloc((size_t) live->vote_count + 1, sizeof(int));
+    matrix->view = malloc(VOTE_SIZE(block->width, sizeof(cand_t)));
+    matrix->pile_count = live->candidate_count;
+    matrix->piles = calloc(live->candidate_count, sizeof(vote_pile_t));
+    tally->matrix = matrix;
+
+    // Excluded ballots are left off every pile
+    char *skip = NULL;
+    if (scenario != NULL && scenario->excluded_count > 0) {
+        skip = calloc((size_t) live->vote_count + 1, 1);
+        for (int row = 0; skip != NULL && row < live->vote_count; row++) {
+            for (int r = 0; r < scenario->excluded_count; r++) {
+                if (matrix->ids[row] >= scenario->excluded[2 * r] && matrix->ids[row] <= scenario->excluded[2 * r + 1]) {
+                    skip[row] = 1;
+                }
+            }
+        }
+    }
+    if (matrix->pos == NULL || matrix->view == NULL || matrix->piles == NULL ||
+        (scenario != NULL && scenario->excluded_count > 0 && skip == NULL) ||
+        vote_matrix_deal(matrix, tally->candidate_status, skip, counts) != 0) {
+        tally_error("memory allocation failed for snapshot");
+        tally_free(tally);
+        free(counts);
+        free(skip);
+        return NULL;
+    }
+    free(skip);
+    for (int i = 0; i < live->candidate_count; i++) {
+        tally->candidate_vote_counts[i] = counts[i + 1];
+    }
+    tally->invalid_vote_count = counts[0];
+    free(counts);
+    for (int r = 0; r < matrix->exhausted.len; r++) {
+        int row = matrix->exhausted.rows[r];
+        tally->exhausted_vote_count += (matrix->weights == NULL) ? 1 : matrix->weights[row];
+    }
+
+    if (COLLECT_STATS && tally_use_stats(tally) == 0) {
+        tally->stats->phase_sec[STAT_LOAD] = tally_stats_now() - start;
+    }
+    return tally;
+}
+// Returns a new tally of the ballots taken in by `live`, changed by
+// `scenario` if it is not NULL, ready for tally_election() and freed
+// with tally_free(), or NULL after printing an ERROR message if
+// memory runs out. The tally holds its votes in a vote matrix whose
+// rows are shared with the live tally: only positions, piles and
+// statuses are its own. Withdrawn candidates are DROPPED from the
+// start and their ballots begin at their next preference, see
+// vote_matrix_deal(); excluded ballots are in no count. If
+// COLLECT_STATS is set the time taken is its load time.
+//
+// Any number of threads may count scenarios of the same live tally at
+// once as long as no snapshot is being taken, since that can replace
+// its rows.
+
+tally_t *live_tally_snapshot(live_tally_t *live){
+    if (live_tally_take(live) != 0) {
+        tally_error("memory allocation failed for live ballots");
+        return NULL;
+    }
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: Live tally snapshot of %d votes\n", live->vote_count);
+    }
+    return live_tally_scenario(live, NULL);
+}
+// Returns a new tally of every ballot added to `live` so far, or NULL
+// after printing an ERROR message if memory runs out. Producers may
+// keep adding ballots while it is counted, in this thread or another,
+// and ballots added after it was taken are not part of it. Only one
+// thread may take snapshots.
+
+void live_tally_free(live_tally_t *live){
+    if (live == NULL) {
+        return;
+    }
+    vote_t *lists[2] = {live->queue, live->pending};
+    for (int l = 0; l < 2; l++) {
+        vote_t *vote = lists[l];
+        while (vote != NULL) {
+            vote_t *next = vote->next;
+            free(vote);
+            vote = next;
+        }
+    }
+    live_block_release(live->block);
+    free(live->candidate_names);
+    free(live);
+}
+// De-allocates a live tally once no producer is adding to it. Its
+// rows stay alive until every snapshot of it is freed as well.
+
+////////////////////////////////////////////////////////////////////////////////
+// WHAT-IF SCENARIOS
+//
+// A live tally that no producer adds to is an immutable ballot store:
+// auditors' questions such as "what if candidate X withdrew" are each
+// a scenario counted by live_tally_scenario() from the same rows, so
+// the votes file is loaded once however many are asked and scenarios
+// can be counted by several threads at once.
+
+static int scenario_candidate(live_tally_t *live, char *token){
+    char *end;
+    long index = strtol(token, &end, 10);
+    if (*end == '\0' && end != token) {
+        return (index >= 0 && index < live->candidate_count) ? (int) index : NO_CANDIDATE;
+    }
+    for (int i = 0; i < live->candidate_count; i++) {
+        if (strcmp(live->candidate_names[i], token) == 0) {
+            return i;
+        }
+    }
+    return NO_CANDIDATE;
+}
+// Returns the candidate with the index or name `token`, or
+// NO_CANDIDATE if there is none.
+
+static int scenario_range(char *token, int *first, int *last){
+    char *end;
+    long a = strtol(token, &end, 10);
+    long b = a;
+    if (*end == '-') {
+        char *start = end + 1;
+        b = strtol(start, &end, 10);
+        if (end == start) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || end == token || a < 1 || b < a || b > INT32_MAX) {
+        return -1;
+    }
+    *first = (int) a;
+    *last = (int) b;
+    return 0;
+}
+// Reads a ballot id "N" or range of ids "N-M" from `token`. Returns 0
+// or -1 if it isn't one.
+
+int scenario_parse(live_tally_t *live, char *text, scenario_t *scenario){
+    memset(scenario, 0, sizeof(scenario_t));
+    scenario->withdrawn = calloc(live->candidate_count + 1, 1);
+    char *copy = strdup(text);
+    if (copy == NULL || scenario->withdrawn == NULL) {
+        free(copy);
+        scenario_free(scenario);
+        tally_error("memory allocation failed for scenario");
+        return -1;
+    }
+
+    int error = 0;
+    char *save;
+    char *change = strtok_r(copy, " \t", &save);
+    while (!error && change != NULL) {
+        char *arg = strtok_r(NULL, " \t", &save);
+        if (strcmp(change, "none") == 0) {
+            change = arg;
+            continue;
+        }
+        if (arg == NULL) {
+            tally_error("scenario '%s': '%s' needs an argument", text, change);
+            error = 1;
+        } else if (strcmp(change, "withdraw") == 0) {
+            int candidate = scenario_candidate(live, arg);
+            if (candidate == NO_CANDIDATE) {
+                tally_error("scenario '%s': unknown candidate '%s'", text, arg);
+                error = 1;
+            } else {
+                scenario->withdrawn[candidate] = 1;
+            }
+        } else if (strcmp(change, "exclude") == 0) {
+            int first, last;
+            int *excluded = realloc(scenario->excluded, 2 * (scenario->excluded_count + 1) * sizeof(int));
+            if (live->block->weights != NULL) {
+                // A row is a class of ballots known by its first one's id
+                tally_error("scenario '%s': ballots grouped by -dedup can't be excluded", text);
+                error = 1;
+            } else if (scenario_range(arg, &first, &last) != 0) {
+                tally_error("scenario '%s': bad ballot range '%s'", text, arg);
+                error = 1;
+            } else if (excluded == NULL) {
+                tally_error("memory allocation failed for scenario");
+                error = 1;
+            } else {
+                excluded[2 * scenario->excluded_count] = first;
+                excluded[2 * scenario->excluded_count + 1] = last;
+                scenario->excluded_count++;
+            }
+            if (excluded != NULL) {
+                scenario->excluded = excluded;
+            }
+        } else {
+            tally_error("scenario '%s': unknown change '%s'", text, change);
+            error = 1;
+        }
+        change = strtok_r(NULL, " \t", &save);
+    }
+
+    free(copy);
+    if (error) {
+        scenario_free(scenario);
+        return -1;
+    }
+    return 0;
+}
+// Fills in `scenario` from the changes listed in `text`, any number of
+//
+//   withdraw C     candidate C, an index or a name, is not in the election
+//   exclude N-M    ballots with ids N to M (the Nth to Mth vote lines,
+//                  rejected ones included, see tally_from_file()) are
+//                  not counted
+//   exclude N      the ballot with id N is not counted
+//   none           no change
+//
+// separated by spaces, e.g. "withdraw 2 exclude 1-500". Ballots can
+// only be excluded from a live tally without weighted rows: with
+// DEDUP_VOTES a row stands for every ballot with the same ranking but
+// has the id of the first of them only. Returns 0 or -1 after
+// printing an ERROR message if a change can't be read or applied.
+
+void scenario_free(scenario_t *scenario){
+    free(scenario->withdrawn);
+    free(scenario->excluded);
+    memset(scenario, 0, sizeof(scenario_t));
+}
+
+tally_t *live_tally_whatif(live_tally_t *live, char *text){
+    scenario_t scenario;
+    if (scenario_parse(live, text, &scenario) != 0) {
+        return NULL;
+    }
+    tally_t *tally = live_tally_scenario(live, &scenario);
+    scenario_free(&scenario);
+    return tally;
+}
+// Returns a tally of the scenario described by `text` (see
+// scenario_parse()) for tally_election(), or NULL after printing an
+// ERROR message if it can't be read or memory runs out.
+
+////////////////////////////////////////////////////////////////////////////////
+// LIVE MODE
+
+// A file of ballots fed to a live tally by a producer thread
+typedef struct {
+  live_tally_t *live;                   // tally taking the ballots
+  char *fname;                          // file of vote lines
+  int failed;                           // 1 if the file couldn't be read in full
+} live_feed_t;
+
+static void *live_feed(void *arg){
+    live_feed_t *feed = arg;
+    live_tally_t *live = feed->live;
+    vote_reader_t reader;
+    if (vote_reader_open(&reader, feed->fname, 1) != 0) {
+        tally_error("couldn't open file '%s'", feed->fname);
+        feed->failed = 1;
+        return NULL;
+    }
+    int *order = malloc(live->candidate_count * sizeof(int));
+    if (order == NULL) {
+        tally_error("memory allocation failed for vote");
+        vote_reader_close(&reader);
+        feed->failed = 1;
+        return NULL;
+    }
+    if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' opened\n", feed->fname);
+    }
+
+    char *line;
+    size_t line_len;
+    while ((line = vote_reader_line(&reader, &line_len)) != NULL) {
+        int count = vote_parse_line(line, line + line_len, order, live->candidate_count);
+        if (count == 0) {               // blank line
+            continue;
+        }
+        if (count < 0) {
+            tally_error("file '%s' line %ld: invalid candidate in vote, line ignored",
+                        feed->fname, reader.line);
+            continue;
+        }
+        if (count != live->candidate_count) {
+            tally_error("file '%s' line %ld: expected %d preferences, found %d, line ignored",
+                        feed->fname, reader.line, live->candidate_count, count);
+            continue;
+        }
+        if (live_tally_add(live, order) != 0) {
+            tally_error("memory allocation failed for vote");
+            feed->failed = 1;
+            break;
+        }
+    }
+
+    if (reader.error) {
+        tally_error("failed reading file '%s'", feed->fname);
+        feed->failed = 1;
+    } else if (LOG_ENABLED(LOG_FILEIO)) {
+        fprintf(tally_out(), "LOG: File '%s' end of file reached\n", feed->fname);
+    }
+    vote_reader_close(&reader);
+    free(order);
+    return NULL;
+}
+// Body of each producer: adds the ballots of one file to the live
+// tally, reporting bad lines as tally_from_file() does.
+
+int tally_run_live(char *fname, char **feeds, int feed_count){
+    if (feed_count > MAX_THREADS) {
+        tally_error("at most %d ballot files can be fed at once", MAX_THREADS);
+        return -1;
+    }
+    tally_t *tally = tally_load(fname);
+    if (tally == NULL) {
+        return -1;
+    }
+    live_tally_t *live = live_tally_start(tally);
+    if (live == NULL) {
+        tally_free(tally);
+        return -1;
+    }
+
+    // One producer thread per ballot file
+    live_feed_t feed[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    for (int i = 0; i < feed_count; i++) {
+        feed[i].live = live;
+        feed[i].fname = feeds[i];
+        feed[i].failed = 0;
+        started[i] = pthread_create(&threads[i], NULL, live_feed, &feed[i]) == 0;
+    }
+
+    // Count what has arrived straight away and again as each file is
+    // done, the last time with every ballot
+    result_sink_t *sink = result_sink(RESULT_FORMAT);
+    int failures = 0;
+    for (int i = -1; i < feed_count; i++) {
+        if (i >= 0) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                live_feed(&feed[i]);    // couldn't start a thread, do it here
+            }
+            failures += feed[i].failed;
+        }
+
+        sink->contest(i < 0 ? fname : feeds[i]);
+        tally_t *snapshot = live_tally_snapshot(live);
+        if (snapshot == NULL) {
+            fprintf(tally_out(), "Could not take a snapshot. Count skipped\n");
+            failures++;
+            continue;
+        }
+        tally_election(snapshot);
+        tally_free(snapshot);
+    }
+
+    live_tally_free(live);
+    return failures;
+}
+// Runs preliminary counts of the votes file `fname` while the
+// `feed_count` files named in `feeds`, which hold vote lines in the
+// same format without the candidates header, are added to it by one
+// producer thread each. The first count starts at once and another
+// follows as each file in turn is finished, each starting with
+// "=== CONTEST XX ===" naming the file (or the equivalent record for
+// RESULT_JSON and RESULT_CSV) and then printing what rcv_main would.
+// A count covers the ballots that had arrived when it started, so all
+// but the last depend on timing; the last has every ballot and gives
+// the result of the whole election. Counts use the current LOG_LEVEL,
+// DEDUP_VOTES (for `fname` only), RESULT_FORMAT, COLLECT_STATS and
+// BULK_DEFEAT settings.
+//
+// Returns the number of files that couldn't be read in full plus
+// counts that couldn't be run, or -1 if `fname` can't be loaded.
@@ -0,0 +1,159 @@
+// rcv_log.c: Background writing of log output for Ranked Choice Voting
+
+#define _GNU_SOURCE                     // fopencookie()
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// LOG RING
+//
+// With transfers or votes being logged an election prints far more
+// than it computes, and waiting on write() for a slow terminal, pipe
+// or disk holds up the rounds. A log ring is a stdio stream (used as
+// TALLY_OUT) whose buffered blocks are copied into a ring buffer; a
+// background thread writes the ring out to the real file descriptor.
+// There is one producer (the thread printing) and one consumer (the
+// writer thread) so the ring needs no lock: each side owns one of the
+// `head` and `tail` byte counts and publishes it with release/acquire
+// atomics. Everything printed goes through the ring so output stays
+// in order.
+
+struct log_ring {
+  char *data;                           // LOG_RING_SIZE bytes, a power of 2
+  size_t head;                          // bytes ever copied in, written by the producer
+  size_t tail;                          // bytes ever written out, written by the consumer
+  int fd;                               // where the writer thread sends the bytes
+  int stop;                             // set once the producer is done
+  int error;                            // set if writing to fd failed
+  pthread_t thread;                     // the writer thread
+  FILE *stream;                         // stream the producer prints to
+};
+
+static void log_ring_pause(long usec){
+    struct timespec ts = {0, usec * 1000};
+    nanosleep(&ts, NULL);
+}
+
+static ssize_t log_ring_write(void *cookie, const char *buf, size_t size){
+    log_ring_t *ring = cookie;
+    size_t done = 0;
+    while (done < size) {
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t space = LOG_RING_SIZE - (head - tail);
+        if (space == 0) {
+            log_ring_pause(LOG_RING_WAIT_USEC);   // writer is behind
+            continue;
+        }
+
+        // Copy up to the end of the ring, the rest on the next pass
+        size_t at = head & (LOG_RING_SIZE - 1);
+        size_t n = size - done;
+        if (n > space) {
+            n = space;
+        }
+        if (n > LOG_RING_SIZE - at) {
+            n = LOG_RING_SIZE - at;
+        }
+        memcpy(ring->data + at, buf + done, n);
+        __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+        done += n;
+    }
+    return size;
+}
+// Producer side, called by stdio when the stream's buffer fills: adds
+// `size` bytes to the ring, waiting for the writer only if the ring
+// is full.
+
+static void *log_ring_writer(void *arg){
+    log_ring_t *ring = arg;
+    while (1) {
+        int stop = __atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        if (head == tail) {
+            if (stop) {
+                break;
+            }
+            log_ring_pause(LOG_RING_IDLE_USEC);
+            continue;
+        }
+
+        // Write what is there up to the end of the ring
+        size_t at = tail & (LOG_RING_SIZE - 1);
+        size_t n = head - tail;
+        if (n > LOG_RING_SIZE - at) {
+            n = LOG_RING_SIZE - at;
+        }
+        ssize_t written = n;
+        if (!ring->error) {
+            written = write(ring->fd, ring->data + at, n);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ring->error = 1;        // drop the rest so the producer never blocks
+                written = n;
+            }
+        }
+        __atomic_store_n(&ring->tail, tail + written, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+// Consumer side, the body of the writer thread: writes out whatever
+// the producer has added until it is stopped and the ring is empty.
+
+log_ring_t *log_ring_start(FILE *dest){
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->data = malloc(LOG_RING_SIZE);
+    cookie_io_functions_t io = {NULL, log_ring_write, NULL, NULL};
+    ring->stream = (ring->data != NULL) ? fopencookie(ring, "w", io) : NULL;
+    if (ring->stream == NULL) {
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+    setvbuf(ring->stream, NULL, _IOFBF, LOG_RING_CHUNK);
+
+    // Anything already printed must come out first
+    fflush(dest);
+    ring->fd = fileno(dest);
+    if (pthread_create(&ring->thread, NULL, log_ring_writer, ring) != 0) {
+        fclose(ring->stream);
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+    TALLY_OUT = ring->stream;
+    return ring;
+}
+// Starts a writer thread for the stream `dest` and makes the calling
+// thread's output (TALLY_OUT) go through a log ring to it. Nothing
+// else may write to `dest` until log_ring_stop(). Returns the ring,
+// or NULL if it couldn't be started in which case output still goes
+// to tally_out() as before.
+
+int log_ring_stop(log_ring_t *ring){
+    if (ring == NULL) {
+        return 0;
+    }
+    TALLY_OUT = NULL;
+    fclose(ring->stream);               // flushes the last block into the ring
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(ring->thread, NULL);
+    int error = ring->error;
+    free(ring->data);
+    free(ring);
+    return error ? -1 : 0;
+}
+// Waits for everything printed through `ring` to be written, stops
+// its thread and releases it. Output of the calling thread goes to
+// stdout again. Returns 0 or -1 if writing failed.
@@ -1,30 +1,165 @@
 #include "rcv.h"
-#include <stdlib.h> 
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(char *prog) {
+    printf("Usage: %s [-log N] [-threads N] [-dedup] [-matrix] [-spill DIR] [-format F] [-stats] [-bulk] [-seats N] [-pairwise] [-checkpoint FILE] <votes_file>\n", prog);
+    printf("       %s [-log N] convert <votes_file> <binary_file>\n", prog);
+    printf("       %s [-log N] [-threads N] [-dedup] [-matrix] [-spill DIR] [-format F] [-stats] [-bulk] [-seats N] [-pairwise] batch <manifest_file> <output_file>\n", prog);
+    printf("       %s [-log N] [-threads N] [-dedup] [-format F] [-stats] [-bulk] live <votes_file> <ballots_file>...\n", prog);
+    printf("       %s [-log N] [-threads N] [-dedup] [-format F] [-stats] [-bulk] whatif <votes_file> <scenario_file> <output_file>\n", prog);
+    printf("       (-seats N can't be used with -matrix, -spill or -checkpoint)\n");
+    printf("       (whatif scenarios can't exclude ballots with -dedup)\n");
+}
+
+static void exit_error(char *what) {
+    if (RESULT_FORMAT == RESULT_TABLE) {
+        printf("%s. Exiting with error code 1\n", what);
+    } else {
+        tally_error("%s, exiting with error code 1", what);
+    }
+}
+// Says why rcv_main is stopping, as an error record in the JSON and
+// CSV formats.
 
 int main(int argc, char *argv[]) {
-    // Check arguments, do 2 or 4
-    if (argc != 2 && argc != 4) {
-        printf("Usage: %s [-log N] <votes_file>\n", argv[0]);
-        return 1;
+    // Output to files and pipes is written in large blocks rather
+    // than line by line
+    if (!isatty(STDOUT_FILENO)) {
+        setvbuf(stdout, NULL, _IOFBF, RESULT_BUFFER);
     }
 
-    // Check optional log 
-    if (argc == 4) {
-        if (strcmp(argv[1], "-log") == 0) {
-            LOG_LEVEL = atoi(argv[2]); 
+    // Check optional flags which precede the other arguments
+    int use_matrix = 0;
+    char *spill_dir = NULL;
+    char *checkpoint_file = NULL;
+    int pairwise = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-log") == 0 && argi + 1 < argc) {
+            LOG_LEVEL = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-threads") == 0 && argi + 1 < argc) {
+            THREAD_COUNT = atoi(argv[argi + 1]);
+            if (THREAD_COUNT < 1) {
+                THREAD_COUNT = 1;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "-matrix") == 0) {
+            use_matrix = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-spill") == 0 && argi + 1 < argc) {
+            spill_dir = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "-format") == 0 && argi + 1 < argc &&
+                   result_format_parse(argv[argi + 1]) >= 0) {
+            RESULT_FORMAT = result_format_parse(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-dedup") == 0) {
+            DEDUP_VOTES = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-stats") == 0) {
+            COLLECT_STATS = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-bulk") == 0) {
+            BULK_DEFEAT = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-seats") == 0 && argi + 1 < argc) {
+            SEATS = atoi(argv[argi + 1]);
+            if (SEATS < 1) {
+                SEATS = 1;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "-pairwise") == 0) {
+            pairwise = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-checkpoint") == 0 && argi + 1 < argc) {
+            checkpoint_file = argv[argi + 1];
+            argi += 2;
         } else {
-            printf("Usage: %s [-log N] <votes_file>\n", argv[0]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // STV counts need votes in memory lists and aren't checkpointed
+    if (SEATS > 1 && (use_matrix || spill_dir != NULL || checkpoint_file != NULL)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Convert mode: text votes file to binary ballot file
+    if (argc - argi == 3 && strcmp(argv[argi], "convert") == 0) {
+        tally_t *tally = tally_from_file(argv[argi + 1]);
+        if (tally == NULL) {
+            exit_error("Could not load votes file");
             return 1;
         }
+        int ret = tally_write_binary(tally, argv[argi + 2]);
+        tally_free(tally);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // Batch mode: every votes file in a manifest into one output;
+    // contests would overwrite each other's checkpoints
+    if (argc - argi == 3 && strcmp(argv[argi], "batch") == 0 && checkpoint_file == NULL) {
+        SPILL_DIR = spill_dir;
+        PAIRWISE = pairwise;
+        int ret = tally_run_batch(argv[argi + 1], argv[argi + 2], use_matrix);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // Live mode: preliminary counts while ballot files are added;
+    // snapshots always count from a matrix so they can't spill, run
+    // STV, checkpoint or keep pairwise counts
+    if (argc - argi >= 3 && strcmp(argv[argi], "live") == 0 &&
+        spill_dir == NULL && SEATS == 1 && checkpoint_file == NULL && !pairwise) {
+        int ret = tally_run_live(argv[argi + 1], &argv[argi + 2], argc - argi - 2);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // What-if mode: scenarios of one election counted like a batch
+    // from ballots loaded once, with the same limits as live mode
+    if (argc - argi == 4 && strcmp(argv[argi], "whatif") == 0 &&
+        spill_dir == NULL && SEATS == 1 && checkpoint_file == NULL && !pairwise) {
+        int ret = tally_run_whatif(argv[argi + 1], argv[argi + 2], argv[argi + 3]);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // Check arguments, just the file should remain
+    if (argc - argi != 1) {
+        usage(argv[0]);
+        return 1;
     }
 
     // File at last argument
     char *filename = argv[argc - 1];
 
-    // Load tally file
-    tally_t *tally = tally_from_file(filename);
+    // Votes are only spilled to disk for elections, not conversions
+    SPILL_DIR = spill_dir;
+    CHECKPOINT_FILE = checkpoint_file;
+    PAIRWISE = pairwise;
+
+    // With transfers being logged output is written out by a
+    // background thread so the rounds don't wait on it
+    log_ring_t *ring = NULL;
+    if (LOG_ENABLED(LOG_VOTE_TRANSFERS)) {
+        ring = log_ring_start(stdout);
+    }
+
+    // Load tally file, binary ballot files are detected by their header
+    tally_t *tally = tally_load(filename);
     if (tally == NULL) {
-        printf("Could not load votes file. Exiting with error code 1\n");
+        log_ring_stop(ring);
+        exit_error("Could not load votes file");
+        return 1;
+    }
+
+    // Optionally switch to struct-of-arrays vote storage
+    if (use_matrix && tally_use_matrix(tally) != 0) {
+        log_ring_stop(ring);
+        exit_error("Could not build vote matrix");
+        tally_free(tally);
         return 1;
     }
 
@@ -34,5 +169,5 @@ int main(int argc, char *argv[]) {
     // Free tally memory
     tally_free(tally);
 
-    return 0;
+    return log_ring_stop(ring) == 0 ? 0 : 1;
 }
@@ -0,0 +1,734 @@
+// rcv_matrix.c: Struct-of-arrays vote storage for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+// The AVX2 histogram kernel is built on x86 with GCC or Clang unless
+// RCV_NO_SIMD is defined; it is only used if the CPU has AVX2
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(RCV_NO_SIMD)
+#define RANK_HISTOGRAM_AVX2 1
+#define RANK_HISTOGRAM_AVX2_BINS 8
+#include <immintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// VOTE MATRIX
+//
+// A tally whose `matrix` field is set keeps its votes in a vote_matrix_t
+// rather than in linked lists of vote_t: the preferences of all votes
+// form one contiguous row-per-vote matrix, each vote's `pos` lives in
+// a separate array and each candidate's votes are a vector of row
+// numbers. The vector is used as a stack whose last entry is the
+// front of the candidate's pile, so pushing a row is the same as
+// prepending a vote to a list and piles are visited in the same order
+// as the lists would be. The tally_*() functions check for a matrix
+// and call the functions here so elections run the same on either.
+
+static int vote_pile_push(vote_pile_t *pile, int row){
+    if (pile->len == pile->capacity) {
+        int capacity = (pile->capacity == 0) ? 16 : 2 * pile->capacity;
+        int *rows = realloc(pile->rows, capacity * sizeof(int));
+        if (rows == NULL) {
+            return -1;
+        }
+        pile->rows = rows;
+        pile->capacity = capacity;
+    }
+    pile->rows[pile->len++] = row;
+    return 0;
+}
+// Pushes `row` onto the front (top) of the pile, growing it if
+// needed. Returns 0 on success or -1 if memory runs out.
+
+static int vote_matrix_weight(vote_matrix_t *matrix, int row){
+    return (matrix->weights == NULL) ? 1 : matrix->weights[row];
+}
+// Number of ballots the row stands for.
+
+void vote_matrix_free(vote_matrix_t *matrix){
+    if (matrix == NULL) {
+        return;
+    }
+    if (matrix->block != NULL) {
+        live_block_release(matrix->block);
+    } else {
+        free(matrix->ranks);
+        free(matrix->ids);
+        free(matrix->weights);
+    }
+    free(matrix->pos);
+    for (int i = 0; matrix->piles != NULL && i < matrix->pile_count; i++) {
+        free(matrix->piles[i].rows);
+    }
+    free(matrix->piles);
+    free(matrix->invalid.rows);
+    free(matrix->exhausted.rows);
+    free(matrix->view);
+    free(matrix);
+}
+// De-allocates the matrix and all of its arrays; the rows of a live
+// tally snapshot are only released, see live_tally_snapshot().
+
+void vote_matrix_view(vote_matrix_t *matrix, int row, vote_t *vote){
+    vote->id = matrix->ids[row];
+    vote->pos = matrix->pos[row];
+    vote->weight = vote_matrix_weight(matrix, row);
+    vote->next = NULL;
+    vote->rank_size = sizeof(cand_t);
+    rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+    cand_t *order = (cand_t *) vote->candidate_order;
+    int len = 0;
+    while (len < matrix->width && ranks[len] != NO_CANDIDATE) {
+        order[len] = ranks[len];
+        len++;
+    }
+    vote->len = len;
+}
+// Fills in `vote`, which must have room for matrix->width cand_t
+// preferences such as matrix->view, with a copy of the given row so it
+// can be shown with vote_print(). Changes to the copy don't affect
+// the matrix.
+
+int vote_matrix_next_candidate(vote_matrix_t *matrix, int row, char *candidate_status){
+    rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+    int pos = matrix->pos[row];
+    while (pos < matrix->width) {
+        int candidate = ranks[pos];
+        if (candidate == NO_CANDIDATE) {
+            break;
+        }
+        if (candidate_status[candidate] == CAND_ACTIVE) {
+            matrix->pos[row] = pos;
+            return candidate;
+        }
+        pos++;
+    }
+    matrix->pos[row] = pos;
+    return NO_CANDIDATE;
+}
+// Same as vote_next_candidate() for a matrix row: advances pos[row]
+// to the next ACTIVE candidate of the row and returns it, or returns
+// NO_CANDIDATE if the preferences run out.
+
+int vote_matrix_next_active(vote_matrix_t *matrix, int row, uint64_t *active){
+    rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+    int pos = matrix->pos[row];
+    while (pos < matrix->width && ranks[pos] != NO_CANDIDATE && !CAND_SET_HAS(active, ranks[pos])) {
+        pos++;
+    }
+    matrix->pos[row] = pos;
+    return (pos < matrix->width) ? ranks[pos] : NO_CANDIDATE;
+}
+// The same for ACTIVE candidates given as a set of bits, see
+// vote_next_active().
+
+static int vote_matrix_size_piles(vote_matrix_t *matrix, int *first_counts){
+    int failed = 0;
+    for (int i = 0; !failed && i < matrix->pile_count; i++) {
+        matrix->piles[i].capacity = first_counts[i + 1];
+        matrix->piles[i].rows = malloc(first_counts[i + 1] * sizeof(int) + 1);
+        failed = matrix->piles[i].rows == NULL;
+    }
+    matrix->invalid.capacity = first_counts[0];
+    matrix->invalid.rows = malloc(first_counts[0] * sizeof(int) + 1);
+    return (failed || matrix->invalid.rows == NULL) ? -1 : 0;
+}
+// Allocates each candidate's pile with room for exactly the rows
+// counted for it in first_counts[], in the layout of rank_histogram(),
+// and the invalid pile for first_counts[0] rows. Returns 0 on success
+// or -1 if memory runs out; vote_matrix_free() releases what was
+// allocated.
+
+static int vote_matrix_deal_each(vote_matrix_t *matrix, char *candidate_status, char *skip, int *counts){
+    if (counts != NULL) {
+        memset(counts, 0, (matrix->pile_count + 1) * sizeof(int));
+    }
+    for (int row = 0; row < matrix->vote_count; row++) {
+        if (skip != NULL && skip[row]) {
+            continue;
+        }
+        int candidate = vote_matrix_next_candidate(matrix, row, candidate_status);
+        vote_pile_t *pile = &matrix->exhausted;
+        if (candidate != NO_CANDIDATE) {
+            pile = &matrix->piles[candidate];
+        } else if (matrix->pos[row] == 0) {
+            pile = &matrix->invalid;
+        }
+        if (vote_pile_push(pile, row) != 0) {
+            return -1;
+        }
+        if (counts != NULL && pile != &matrix->exhausted) {
+            counts[candidate + 1] += vote_matrix_weight(matrix, row);
+        }
+    }
+    return 0;
+}
+// The general case of vote_matrix_deal(): each row not skipped is
+// moved on to its first ACTIVE preference one at a time.
+
+int vote_matrix_deal(vote_matrix_t *matrix, char *candidate_status, char *skip, int *counts){
+    int all_active = skip == NULL;
+    for (int i = 0; all_active && i < matrix->pile_count; i++) {
+        all_active = candidate_status[i] == CAND_ACTIVE;
+    }
+    if (!all_active) {
+        return vote_matrix_deal_each(matrix, candidate_status, skip, counts);
+    }
+
+    int bins = matrix->pile_count + 1;
+    int *first_counts = calloc(bins, sizeof(int));
+    if (first_counts == NULL) {
+        return -1;
+    }
+
+    // The first column gives the size of every pile
+    rank_histogram(matrix->ranks, matrix->vote_count, matrix->width, NULL, first_counts, bins);
+    int failed = vote_matrix_size_piles(matrix, first_counts) != 0;
+    if (!failed && counts != NULL) {
+        if (matrix->weights == NULL) {
+            memcpy(counts, first_counts, bins * sizeof(int));
+        } else {
+            memset(counts, 0, bins * sizeof(int));
+            rank_histogram(matrix->ranks, matrix->vote_count, matrix->width, matrix->weights, counts, bins);
+        }
+    }
+    free(first_counts);
+    if (failed) {
+        return -1;
+    }
+
+    // Pushing rows in order leaves each pile in list order
+    for (int row = 0; row < matrix->vote_count; row++) {
+        int candidate = (matrix->width > 0) ? matrix->ranks[(size_t) row * matrix->width] : NO_CANDIDATE;
+        vote_pile_push(candidate == NO_CANDIDATE ? &matrix->invalid : &matrix->piles[candidate], row);
+    }
+    return 0;
+}
+// Puts every row of `matrix` on the pile of its first preference, or
+// the invalid pile, as a loader adding the rows in order to lists
+// would; pos[] must be all 0 and the piles empty. If `counts` is not
+// NULL it gets the ballots of each first preference in the layout of
+// rank_histogram(), the invalid ones in counts[0]. Returns 0 on
+// success or -1 if memory runs out.
+//
+// When every candidate in `candidate_status` is ACTIVE and `skip` is
+// NULL, piles are sized exactly from a rank_histogram() of the first
+// column. Otherwise rows with skip[row] set are left off every pile
+// and the rest start at their first ACTIVE preference, as if the
+// other candidates had been dropped before the first round: a row
+// ranking none of the ACTIVE candidates goes on the exhausted pile
+// (and isn't in `counts`) unless it has no first preference at all.
+
+static int vote_matrix_piles_from_lists(tally_t *tally, vote_matrix_t *matrix, int max_id){
+    int *rows = malloc(((size_t) max_id + 1) * sizeof(int));
+    if (rows == NULL) {
+        return -1;
+    }
+    int row = 0;
+    for (vote_slab_t *slab = tally->vote_slabs; slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); vote != NULL; vote = vote_slab_next(slab, vote)) {
+            rows[vote->id] = row++;
+        }
+    }
+
+    int failed = 0;
+    for (int p = 0; !failed && p < tally->candidate_count + 2; p++) {
+        vote_pile_t *pile = (p < tally->candidate_count) ? &matrix->piles[p] :
+                            (p == tally->candidate_count) ? &matrix->invalid : &matrix->exhausted;
+        vote_t *vote = (p < tally->candidate_count) ? tally->candidate_votes[p] :
+                       (p == tally->candidate_count) ? tally->invalid_votes : tally->exhausted_votes;
+        for (; !failed && vote != NULL; vote = vote->next) {
+            failed = vote_pile_push(pile, rows[vote->id]) != 0;
+        }
+
+        // The front of the list goes on top
+        for (int i = 0, j = pile->len - 1; i < j; i++, j--) {
+            int top = pile->rows[j];
+            pile->rows[j] = pile->rows[i];
+            pile->rows[i] = top;
+        }
+    }
+    free(rows);
+    return failed ? -1 : 0;
+}
+// Fills the piles of `matrix`, whose rows are the tally's votes in
+// arena order, from the tally's candidate, invalid and exhausted
+// lists so each is visited in the same order as its list. Vote ids
+// must be distinct and at most `max_id`. Returns 0 on success or -1
+// if memory runs out.
+
+static void tally_drop_lists(tally_t *tally, vote_matrix_t *matrix){
+    vote_slabs_free(tally->vote_slabs);
+    tally->vote_slabs = NULL;
+    tally->vote_slab_last = NULL;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        tally->candidate_votes[i] = NULL;
+    }
+    tally->invalid_votes = NULL;
+    tally->exhausted_votes = NULL;
+    tally->matrix = matrix;
+}
+// Hands the tally's votes over to `matrix`: the lists and arena are
+// no longer needed and counts are unchanged.
+
+int tally_use_matrix(tally_t *tally){
+    if (tally == NULL || tally->matrix != NULL) {
+        return 0;
+    }
+    if (tally->spill != NULL) {
+        tally_error("spilled votes can't be moved to a matrix");
+        return -1;
+    }
+
+    vote_matrix_t *matrix = calloc(1, sizeof(vote_matrix_t));
+    int *first_counts = calloc(tally->candidate_count + 1, sizeof(int));
+    if (matrix == NULL || first_counts == NULL) {
+        free(matrix);
+        free(first_counts);
+        return -1;
+    }
+
+    // Arena slabs hold the votes in load order; every vote is still at
+    // its first preference right after loading, but not in a tally
+    // resumed from a checkpoint. Rows are as wide as the longest
+    // ranking.
+    int vote_count = 0;
+    int weighted = 0;
+    int fresh = tally->rounds_done == 0;
+    int max_id = 0;
+    for (vote_slab_t *slab = tally->vote_slabs; slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); vote != NULL; vote = vote_slab_next(slab, vote)) {
+            fresh &= vote->pos == 0;
+            first_counts[(vote->len == 0) ? 0 : VOTE_RANK(vote, 0) + 1]++;
+            if (vote->len > matrix->width) {
+                matrix->width = vote->len;
+            }
+            if (vote->id > max_id) {
+                max_id = vote->id;
+            }
+            weighted |= vote->weight != 1;
+            vote_count++;
+        }
+    }
+    int unowned = tally->vote_slabs == NULL && tally->invalid_votes != NULL;
+    for (int i = 0; tally->vote_slabs == NULL && i < tally->candidate_count; i++) {
+        unowned |= tally->candidate_votes[i] != NULL;
+    }
+    if (unowned) {
+        tally_error("only loaded tallies can use a matrix");
+        free(first_counts);
+        vote_matrix_free(matrix);
+        return -1;
+    }
+
+    // Size every array exactly for the loaded votes (+1 byte so that
+    // empty arrays are not NULL)
+    matrix->vote_count = vote_count;
+    matrix->capacity = vote_count;
+    matrix->ranks = malloc((size_t) vote_count * matrix->width * sizeof(rank_t) + 1);
+    matrix->pos = malloc(vote_count * sizeof(int) + 1);
+    matrix->ids = malloc(vote_count * sizeof(int) + 1);
+    matrix->weights = weighted ? malloc(vote_count * sizeof(int) + 1) : NULL;
+    matrix->view = malloc(VOTE_SIZE(matrix->width, sizeof(cand_t)));
+    matrix->pile_count = tally->candidate_count;
+    matrix->piles = calloc(tally->candidate_count, sizeof(vote_pile_t));
+    if (matrix->ranks == NULL || matrix->pos == NULL || matrix->ids == NULL ||
+        (weighted && matrix->weights == NULL) || matrix->view == NULL ||
+        matrix->piles == NULL || (fresh && vote_matrix_size_piles(matrix, first_counts) != 0)) {
+        free(first_counts);
+        vote_matrix_free(matrix);
+        return -1;
+    }
+    free(first_counts);
+
+    // Copy the rows in load order; fresh votes go on the pile of their
+    // first preference, which leaves each pile in list order
+    int row = 0;
+    for (vote_slab_t *slab = tally->vote_slabs; slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); vote != NULL; vote = vote_slab_next(slab, vote), row++) {
+            rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+            for (int i = 0; i < matrix->width; i++) {
+                ranks[i] = (i < vote->len) ? VOTE_RANK(vote, i) : NO_CANDIDATE;
+            }
+            matrix->pos[row] = vote->pos;
+            matrix->ids[row] = vote->id;
+            if (weighted) {
+                matrix->weights[row] = vote->weight;
+            }
+            if (fresh) {
+                vote_pile_push((vote->len == 0) ? &matrix->invalid : &matrix->piles[ranks[0]], row);
+            }
+        }
+    }
+
+    // Votes that have moved are put on piles by following the lists
+    if (!fresh && vote_matrix_piles_from_lists(tally, matrix, max_id) != 0) {
+        vote_matrix_free(matrix);
+        return -1;
+    }
+    tally_drop_lists(tally, matrix);
+    return 0;
+}
+// Moves the votes of a loaded tally from its vote arena and lists
+// into a vote_matrix_t. Rows are numbered in arena order and piles are
+// built so that each candidate's votes are visited in the same order
+// as their list, so elections produce identical output. Rows are as
+// wide as the longest ranking with shorter ones padded with
+// NO_CANDIDATE. All arrays are sized exactly, then the arena is
+// freed. Returns 0 on success and -1 on failure in which case the
+// tally is left unchanged. Spilled tallies keep their votes on disk
+// and are refused.
+//
+// Right after tally_from_file() or tally_from_binary() every vote is
+// at its first preference (pos 0) and lists are in reverse load
+// order, so the piles are sized from the first preferences counted
+// while checking the arena and filled as the rows are copied; the
+// loader has already counted the votes of each candidate. A tally from
+// tally_from_checkpoint() has votes part way through their rankings
+// and on the exhausted list; its piles are filled by following the
+// lists, which needs distinct vote ids as the loaders give.
+
+static int vote_matrix_widen(vote_matrix_t *matrix, int width){
+    rank_t *ranks = malloc((size_t) matrix->capacity * width * sizeof(rank_t) + 1);
+    vote_t *view = malloc(VOTE_SIZE(width, sizeof(cand_t)));
+    if (ranks == NULL || view == NULL) {
+        free(ranks);
+        free(view);
+        return -1;
+    }
+    for (int row = 0; row < matrix->vote_count; row++) {
+        for (int i = 0; i < width; i++) {
+            ranks[(size_t) row * width + i] = (i < matrix->width) ?
+                matrix->ranks[(size_t) row * matrix->width + i] : NO_CANDIDATE;
+        }
+    }
+    free(matrix->ranks);
+    free(matrix->view);
+    matrix->ranks = ranks;
+    matrix->view = view;
+    matrix->width = width;
+    return 0;
+}
+// Copies the rows into a wider matrix padding them with NO_CANDIDATE
+// so a longer ranking can be added. Returns 0 on success or -1 if
+// memory runs out leaving the matrix unchanged.
+
+int vote_matrix_add_vote(tally_t *tally, vote_t *vote){
+    vote_matrix_t *matrix = tally->matrix;
+    if (matrix->block != NULL) {
+        return -1;                      // rows belong to a live tally
+    }
+    if (vote->len > matrix->width && vote_matrix_widen(matrix, vote->len) != 0) {
+        return -1;
+    }
+    if (vote->weight != 1 && matrix->weights == NULL) {
+        matrix->weights = malloc(((size_t) matrix->capacity + 1) * sizeof(int));
+        if (matrix->weights == NULL) {
+            return -1;
+        }
+        for (int r = 0; r < matrix->vote_count; r++) {
+            matrix->weights[r] = 1;
+        }
+    }
+    if (matrix->vote_count == matrix->capacity) {
+        // Double the row arrays
+        size_t rows = (matrix->capacity < VOTE_SLAB_MIN) ? VOTE_SLAB_MIN : 2 * (size_t) matrix->capacity;
+        rank_t *ranks = realloc(matrix->ranks, rows * matrix->width * sizeof(rank_t));
+        if (ranks == NULL) {
+            return -1;
+        }
+        matrix->ranks = ranks;
+        int *pos = realloc(matrix->pos, rows * sizeof(int));
+        if (pos == NULL) {
+            return -1;
+        }
+        matrix->pos = pos;
+        int *ids = realloc(matrix->ids, rows * sizeof(int));
+        if (ids == NULL) {
+            return -1;
+        }
+        matrix->ids = ids;
+        if (matrix->weights != NULL) {
+            int *weights = realloc(matrix->weights, rows * sizeof(int));
+            if (weights == NULL) {
+                return -1;
+            }
+            matrix->weights = weights;
+        }
+        matrix->capacity = rows;
+    }
+
+    int row = matrix->vote_count;
+    int candidate = (vote->pos < vote->len) ? VOTE_RANK(vote, vote->pos) : NO_CANDIDATE;
+    vote_pile_t *pile = (candidate == NO_CANDIDATE) ? &matrix->invalid : &matrix->piles[candidate];
+    if (vote_pile_push(pile, row) != 0) {
+        return -1;
+    }
+
+    rank_t *ranks = &matrix->ranks[(size_t) row * matrix->width];
+    for (int i = 0; i < matrix->width; i++) {
+        ranks[i] = (i < vote->len) ? VOTE_RANK(vote, i) : NO_CANDIDATE;
+    }
+    matrix->pos[row] = vote->pos;
+    matrix->ids[row] = vote->id;
+    if (matrix->weights != NULL) {
+        matrix->weights[row] = vote->weight;
+    }
+    matrix->vote_count++;
+    return 0;
+}
+// Appends a copy of `vote` as a new row at the front of its current
+// candidate's pile (or the invalid pile), widening the rows first if
+// its ranking is longer than any so far. Used by tally_add_vote() for
+// tallies with a matrix; the vote_t itself is not kept and may be
+// reused by the caller. Returns 0 on success or -1 if memory runs out
+// or the matrix is a live tally snapshot whose rows are shared.
+
+void vote_matrix_print_votes(tally_t *tally){
+    vote_matrix_t *matrix = tally->matrix;
+    vote_t *view = matrix->view;
+
+    for (int i = 0; i < tally->candidate_count; i++) {
+        fprintf(tally_out(), "VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
+
+        int vote_count = 0;
+        vote_pile_t *pile = &matrix->piles[i];
+        for (int r = pile->len - 1; r >= 0; r--) {
+            vote_matrix_view(matrix, pile->rows[r], view);
+            fprintf(tally_out(), "  ");
+            vote_print(view);
+            fprintf(tally_out(), "\n");
+            vote_count += view->weight;
+        }
+        if (tally->stats != NULL) {
+            tally->stats->nodes_visited += pile->len;
+        }
+
+        fprintf(tally_out(), "%d votes total\n", vote_count);
+    }
+
+    if (tally->invalid_vote_count > 0) {
+        fprintf(tally_out(), "INVALID VOTES\n");
+        for (int r = matrix->invalid.len - 1; r >= 0; r--) {
+            vote_matrix_view(matrix, matrix->invalid.rows[r], view);
+            fprintf(tally_out(), "  ");
+            vote_print(view);
+            fprintf(tally_out(), "\n");
+        }
+        fprintf(tally_out(), "%d votes total\n", tally->invalid_vote_count);
+    }
+
+    if (tally->exhausted_vote_count > 0) {
+        fprintf(tally_out(), "EXHAUSTED VOTES\n");
+        for (int r = matrix->exhausted.len - 1; r >= 0; r--) {
+            vote_matrix_view(matrix, matrix->exhausted.rows[r], view);
+            fprintf(tally_out(), "  ");
+            vote_print(view);
+            fprintf(tally_out(), "\n");
+        }
+        if (tally->stats != NULL) {
+            tally->stats->nodes_visited += matrix->exhausted.len;
+        }
+        fprintf(tally_out(), "%d votes total\n", tally->exhausted_vote_count);
+    }
+}
+// tally_print_votes() for a matrix tally: same output, walking each
+// pile from its front.
+
+static void vote_matrix_transfer_row(tally_t *tally, int candidate_index, int row){
+    vote_matrix_t *matrix = tally->matrix;
+    int weight = vote_matrix_weight(matrix, row);
+    tally->candidate_vote_counts[candidate_index] -= weight;
+
+    matrix->pos[row]++;
+    int next_candidate = (tally->rounds != NULL) ?
+        vote_matrix_next_active(matrix, row, tally->rounds->active) :
+        vote_matrix_next_candidate(matrix, row, tally->candidate_status);
+    if (tally->stats != NULL) {
+        tally_stats_transfer(tally->stats, weight, next_candidate == NO_CANDIDATE);
+    }
+
+    if (next_candidate == NO_CANDIDATE) {
+        vote_pile_push(&matrix->exhausted, row);
+        tally_count_exhausted(tally, weight);
+    } else {
+        vote_pile_push(&matrix->piles[next_candidate], row);
+        tally->candidate_vote_counts[next_candidate] += weight;
+        if (tally->rounds != NULL) {
+            round_index_touch(tally->rounds, next_candidate);
+        }
+    }
+
+    if (LOG_ENABLED(LOG_VOTE_TRANSFERS)) {
+        vote_matrix_view(matrix, row, matrix->view);
+        tally_log_transfer(tally, matrix->view, candidate_index, next_candidate);
+    }
+}
+// Moves one row already taken off the pile of `candidate_index` to
+// its next active candidate, or the exhausted pile, as
+// tally_transfer_first_vote() does for a vote_t, including the
+// logging. Piles only grow into space they have
+// held before or by doubling so pushes do not fail in practice.
+
+void vote_matrix_transfer_first_vote(tally_t *tally, int candidate_index){
+    vote_pile_t *pile = &tally->matrix->piles[candidate_index];
+    if (pile->len == 0) {
+        return;
+    }
+    int row = pile->rows[--pile->len];
+    vote_matrix_transfer_row(tally, candidate_index, row);
+}
+// tally_transfer_first_vote() for a matrix tally: pops the front row
+// of the candidate's pile and moves it on.
+
+void vote_matrix_transfer_all(tally_t *tally, int candidate_index){
+    vote_pile_t *pile = &tally->matrix->piles[candidate_index];
+    vote_pile_t dropped = *pile;
+    pile->rows = NULL;
+    pile->len = 0;
+    pile->capacity = 0;
+
+    for (int r = dropped.len - 1; r >= 0; r--) {
+        vote_matrix_transfer_row(tally, candidate_index, dropped.rows[r]);
+    }
+    free(dropped.rows);
+}
+// Moves every row on the candidate's pile to its next active
+// candidate, front to back, in a single pass over the pile's row
+// vector. Rows with no further active preference go to the exhausted
+// pile as with tally_transfer_first_vote(), leaving the candidate's
+// pile empty.
+
+////////////////////////////////////////////////////////////////////////////////
+// FIRST CHOICE HISTOGRAM
+//
+// Counting the votes at each candidate from a column of the matrix is
+// a histogram of small integers. Incrementing one array in order makes
+// each increment wait on the previous one whenever neighbouring rows
+// name the same candidate, which is most of the time when a few
+// candidates get most first preferences. The kernels below spread the
+// rows over several sub-histograms (one per lane) so consecutive
+// increments are independent, then add the sub-histograms up. With
+// AVX2 and only a few candidates, eight rows are loaded at once (by a
+// gather for wide rows or a plain load when rows are a single
+// preference) and compared with every candidate; above
+// RANK_HISTOGRAM_AVX2_BINS the compares cost more than the increments
+// they replace.
+
+static void rank_histogram_scalar(rank_t *ranks, int rows, int stride, int *weights, int *sub, int bins){
+    int r = 0;
+    for (; r + 4 <= rows; r += 4) {
+        rank_t *at = ranks + (size_t) r * stride;
+        if (weights != NULL) {
+            sub[0 * bins + at[0] + 1] += weights[r];
+            sub[1 * bins + at[stride] + 1] += weights[r + 1];
+            sub[2 * bins + at[2 * stride] + 1] += weights[r + 2];
+            sub[3 * bins + at[3 * stride] + 1] += weights[r + 3];
+        } else {
+            sub[0 * bins + at[0] + 1]++;
+            sub[1 * bins + at[stride] + 1]++;
+            sub[2 * bins + at[2 * stride] + 1]++;
+            sub[3 * bins + at[3 * stride] + 1]++;
+        }
+    }
+    for (; r < rows; r++) {
+        sub[ranks[(size_t) r * stride] + 1] += (weights != NULL) ? weights[r] : 1;
+    }
+}
+// Portable kernel with 4 sub-histograms.
+
+#ifdef RANK_HISTOGRAM_AVX2
+__attribute__((target("avx2")))
+static void rank_histogram_avx2(rank_t *ranks, int rows, int stride, int *weights, int *counts, int bins){
+    __m256i sub[RANK_HISTOGRAM_AVX2_BINS];
+    for (int b = 0; b < bins; b++) {
+        sub[b] = _mm256_setzero_si256();
+    }
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i offsets = _mm256_mullo_epi32(lane, _mm256_set1_epi32(stride * (int) sizeof(rank_t)));
+    __m256i one = _mm256_set1_epi32(1);
+    int r = 0;
+
+    // A gather reads 4 bytes from each row so the last row is left to
+    // the scalar loop in case it ends the array
+    for (; r + 8 < rows; r += 8) {
+        __m256i v;
+        if (stride == 1) {
+            v = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) (ranks + r)));
+        } else {
+            v = _mm256_i32gather_epi32((const int *) (ranks + (size_t) r * stride), offsets, 1);
+            v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);   // the rank_t in the low half
+        }
+        v = _mm256_add_epi32(v, one);
+        if (weights != NULL) {
+            __m256i w = _mm256_loadu_si256((__m256i *) (weights + r));
+            for (int b = 0; b < bins; b++) {
+                __m256i hit = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(b));
+                sub[b] = _mm256_add_epi32(sub[b], _mm256_and_si256(hit, w));
+            }
+        } else {
+            for (int b = 0; b < bins; b++) {
+                __m256i hit = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(b));
+                sub[b] = _mm256_sub_epi32(sub[b], hit);      // hit is -1
+            }
+        }
+    }
+
+    int lanes[8];
+    for (int b = 0; b < bins; b++) {
+        _mm256_storeu_si256((__m256i *) lanes, sub[b]);
+        for (int l = 0; l < 8; l++) {
+            counts[b] += lanes[l];
+        }
+    }
+    for (; r < rows; r++) {
+        counts[ranks[(size_t) r * stride] + 1] += (weights != NULL) ? weights[r] : 1;
+    }
+}
+// AVX2 kernel for at most RANK_HISTOGRAM_AVX2_BINS bins: loads 8 rows
+// at a time and compares them with every bin, each of the 8 lanes
+// keeping its own count for every bin in a register.
+#endif
+
+void rank_histogram(rank_t *ranks, int rows, int stride, int *weights, int *counts, int bins){
+    if (stride == 0) {
+        // No preferences at all: every row is NO_CANDIDATE
+        for (int r = 0; r < rows; r++) {
+            counts[0] += (weights != NULL) ? weights[r] : 1;
+        }
+        return;
+    }
+
+#ifdef RANK_HISTOGRAM_AVX2
+    if (bins <= RANK_HISTOGRAM_AVX2_BINS && __builtin_cpu_supports("avx2")) {
+        rank_histogram_avx2(ranks, rows, stride, weights, counts, bins);
+        return;
+    }
+#endif
+
+    int lanes = 4;
+    int *sub = calloc((size_t) lanes * bins, sizeof(int));
+    if (sub == NULL) {
+        for (int r = 0; r < rows; r++) {
+            counts[ranks[(size_t) r * stride] + 1] += (weights != NULL) ? weights[r] : 1;
+        }
+        return;
+    }
+    rank_histogram_scalar(ranks, rows, stride, weights, sub, bins);
+    for (int l = 0; l < lanes; l++) {
+        for (int b = 0; b < bins; b++) {
+            counts[b] += sub[(size_t) l * bins + b];
+        }
+    }
+    free(sub);
+}
+// Adds to counts[c + 1] the number of the `rows` rows of `ranks`,
+// `stride` entries apart, whose entry is candidate c, and to
+// counts[0] those that are NO_CANDIDATE; `bins` is the candidate count
+// plus 1. A row counts as weights[row] if `weights` is not NULL. For
+// the first preferences of a vote matrix pass its ranks and width.
+// The AVX2 kernel is picked at run time for small `bins` when the CPU
+// supports it, otherwise the portable one; both give the same counts.
+// If memory for the sub-histograms can't be allocated a plain loop is
+// used.
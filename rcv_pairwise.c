@@ -0,0 +1,134 @@
+// rcv_pairwise.c: Head-to-head counts for Ranked Choice Voting elections
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// PAIRWISE COUNTS
+//
+// When PAIRWISE is set the loaders give each tally a pairwise_t and
+// every ballot is added to it as it is added to the tally, so the
+// head-to-head results need no second pass over the rankings. A
+// ballot of length L adds to L rows of the matrix, each row once and
+// only at the columns of the candidates ranked after that row's
+// candidate; rows are contiguous so a ballot touches a handful of
+// cache lines rather than a whole column. Only ballots ranking both
+// candidates are counted in above[]: a ranked candidate beats every
+// unranked one, so the ballots preferring a to b are
+//
+//   ranked[a] - above[b][a]
+//
+// which keeps the work per ballot at L(L-1)/2 increments whatever the
+// number of candidates. tally_load_parallel() gives each chunk's
+// local tally its own matrix and adds them up once the chunks are
+// parsed, so threads never share a counter.
+
+int tally_use_pairwise(tally_t *tally){
+    if (tally->pairwise != NULL) {
+        return 0;
+    }
+    int count = tally->candidate_count;
+    pairwise_t *pairwise = malloc(sizeof(pairwise_t));
+    int *above = calloc((size_t) count * count, sizeof(int));
+    int *ranked = calloc(count, sizeof(int));
+    unsigned *seen = calloc(count, sizeof(unsigned));
+    int *order = malloc(count * sizeof(int));
+    if (pairwise == NULL || above == NULL || ranked == NULL || seen == NULL || order == NULL) {
+        free(pairwise);
+        free(above);
+        free(ranked);
+        free(seen);
+        free(order);
+        tally_error("memory allocation failed for pairwise counts");
+        return -1;
+    }
+    pairwise->candidate_count = count;
+    pairwise->above = above;
+    pairwise->ranked = ranked;
+    pairwise->seen = seen;
+    pairwise->stamp = 0;
+    pairwise->order = order;
+    tally->pairwise = pairwise;
+    return 0;
+}
+// Attaches empty pairwise counts to a tally whose candidate count is
+// set and which has no votes yet; tally_add_vote() then counts every
+// vote added to it. Returns 0 on success or -1 after printing an ERROR
+// message if memory runs out, leaving the tally unchanged.
+
+void pairwise_free(pairwise_t *pairwise){
+    if (pairwise != NULL) {
+        free(pairwise->above);
+        free(pairwise->ranked);
+        free(pairwise->seen);
+        free(pairwise->order);
+        free(pairwise);
+    }
+}
+
+void pairwise_add(pairwise_t *pairwise, vote_t *vote, int weight){
+    unsigned stamp = ++pairwise->stamp;
+    if (stamp == 0) {
+        // The stamps wrapped: forget every earlier ballot
+        memset(pairwise->seen, 0, pairwise->candidate_count * sizeof(unsigned));
+        stamp = pairwise->stamp = 1;
+    }
+
+    // Only the first mention of a candidate counts, as in elections
+    int *order = pairwise->order;
+    int len = 0;
+    for (int i = 0; i < vote->len; i++) {
+        int a = VOTE_RANK(vote, i);
+        if (pairwise->seen[a] != stamp) {
+            pairwise->seen[a] = stamp;
+            order[len++] = a;
+        }
+    }
+
+    for (int i = 0; i < len; i++) {
+        pairwise->ranked[order[i]] += weight;
+        int *row = pairwise->above + (size_t) order[i] * pairwise->candidate_count;
+        for (int k = i + 1; k < len; k++) {
+            row[order[k]] += weight;
+        }
+    }
+}
+// Counts `weight` ballots ranking as `vote` does, whatever its pos.
+// Candidates ranked twice count at their first position only.
+
+void pairwise_merge(pairwise_t *into, pairwise_t *from){
+    size_t cells = (size_t) into->candidate_count * into->candidate_count;
+    for (size_t i = 0; i < cells; i++) {
+        into->above[i] += from->above[i];
+    }
+    for (int a = 0; a < into->candidate_count; a++) {
+        into->ranked[a] += from->ranked[a];
+    }
+}
+// Adds the counts of `from` to `into`; both have the same candidates.
+
+int pairwise_prefer(pairwise_t *pairwise, int a, int b){
+    if (a == b) {
+        return 0;
+    }
+    return pairwise->ranked[a] - pairwise->above[(size_t) b * pairwise->candidate_count + a];
+}
+// Returns the number of ballots ranking candidate `a` above candidate
+// `b`, counting ballots that rank `a` but not `b`; 0 when a == b.
+
+int pairwise_condorcet_winner(pairwise_t *pairwise){
+    for (int a = 0; a < pairwise->candidate_count; a++) {
+        int beats_all = 1;
+        for (int b = 0; beats_all && b < pairwise->candidate_count; b++) {
+            beats_all = a == b || pairwise_prefer(pairwise, a, b) > pairwise_prefer(pairwise, b, a);
+        }
+        if (beats_all) {
+            return a;
+        }
+    }
+    return NO_CANDIDATE;
+}
+// Returns the candidate preferred to every other candidate by more
+// ballots than prefer the other, or NO_CANDIDATE if there is none.
+// There is at most one such candidate.
@@ -0,0 +1,443 @@
+// rcv_parallel.c: Multithreaded loading and vote transfers for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+static void run_parallel(void *items, size_t item_size, int count, void *(*body)(void *)){
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    char *item = items;
+    for (int t = 1; t < count; t++) {
+        started[t] = pthread_create(&threads[t], NULL, body, item + t * item_size) == 0;
+    }
+    body(item);
+    for (int t = 1; t < count; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            body(item + t * item_size);  // couldn't start a thread, do it here
+        }
+    }
+}
+// Runs `body` on each of the `count` items of `item_size` bytes in
+// the `items` array, the first in the calling thread and the rest in
+// new threads, and waits for all of them.
+
+////////////////////////////////////////////////////////////////////////////////
+// PARALLEL LOADING
+
+// A newline aligned piece of a votes file parsed by one thread into a
+// private tally; see tally_load_parallel().
+typedef struct {
+  char *start;                          // first byte of the chunk
+  char *end;                            // one past the last byte
+  tally_t *local;                       // votes and counts for this chunk only
+  vote_t **tails;                       // last vote in each of local's lists
+  vote_t *invalid_tail;                 // last vote in local's invalid list
+  int vote_count;                       // vote lines parsed, local ids are 1..vote_count
+  int id_base;                          // vote lines in all earlier chunks
+  long line_count;                      // lines in the chunk
+  long *bad_lines;                      // chunk relative numbers of ignored lines
+  int *bad_ids;                         // local ids the ignored lines used up
+  int *bad_counts;                      // preferences found on them, -1 for a bad token
+  int bad_count;                        // entries in bad_lines[] / bad_ids[] / bad_counts[]
+  int bad_capacity;                     // allocated entries
+  int failed;                           // 1 if memory ran out
+} load_chunk_t;
+
+static int load_chunk_bad_line(load_chunk_t *chunk, long line, int id, int found){
+    if (chunk->bad_count == chunk->bad_capacity) {
+        int capacity = chunk->bad_capacity == 0 ? 16 : 2 * chunk->bad_capacity;
+        long *lines = realloc(chunk->bad_lines, capacity * sizeof(long));
+        if (lines == NULL) {
+            return -1;
+        }
+        chunk->bad_lines = lines;
+        int *ids = realloc(chunk->bad_ids, capacity * sizeof(int));
+        if (ids == NULL) {
+            return -1;
+        }
+        chunk->bad_ids = ids;
+        int *counts = realloc(chunk->bad_counts, capacity * sizeof(int));
+        if (counts == NULL) {
+            return -1;
+        }
+        chunk->bad_counts = counts;
+        chunk->bad_capacity = capacity;
+    }
+    chunk->bad_lines[chunk->bad_count] = line;
+    chunk->bad_ids[chunk->bad_count] = id;
+    chunk->bad_counts[chunk->bad_count] = found;
+    chunk->bad_count++;
+    return 0;
+}
+// Remembers an ignored line so it can be reported in file order once
+// all chunks are parsed.
+
+static void *load_chunk_parse(void *arg){
+    load_chunk_t *chunk = arg;
+    tally_t *local = chunk->local;
+
+    // The chunk is read like a fully mapped file of its own
+    vote_reader_t reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = -1;
+    reader.data = chunk->start;
+    reader.len = chunk->end - chunk->start;
+    reader.mapped = 1;
+    reader.eof = 1;
+
+    int *order = local->candidate_scratch;
+    char *line;
+    size_t line_len;
+    while ((line = vote_reader_line(&reader, &line_len)) != NULL) {
+        int count = vote_parse_line(line, line + line_len, order, local->candidate_count);
+        if (count == 0) {
+            continue;
+        }
+        if (count != local->candidate_count) {
+            if (load_chunk_bad_line(chunk, reader.line, ++chunk->vote_count, count) != 0) {
+                chunk->failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        int len = vote_order_len(order, local->candidate_count);
+        vote_t *vote = tally_vote_alloc(local, len);
+        if (vote == NULL) {
+            chunk->failed = 1;
+            break;
+        }
+        vote->id = ++chunk->vote_count;
+        vote->pos = 0;
+        vote_set_ranks(vote, order);
+
+        // The first vote prepended to a list stays at its tail
+        int candidate = order[0];
+        if (candidate == NO_CANDIDATE) {
+            if (local->invalid_votes == NULL) {
+                chunk->invalid_tail = vote;
+            }
+        } else if (local->candidate_votes[candidate] == NULL) {
+            chunk->tails[candidate] = vote;
+        }
+        tally_add_vote(local, vote);
+    }
+    chunk->line_count = reader.line;
+    return NULL;
+}
+// Thread body: parses every vote line of one chunk into the chunk's
+// private tally with ids starting at 1. Ignored lines use up an id
+// each, as they do in tally_from_file().
+
+static void *load_chunk_renumber(void *arg){
+    load_chunk_t *chunk = arg;
+    if (chunk->id_base == 0) {
+        return NULL;
+    }
+    for (vote_slab_t *slab = chunk->local->vote_slabs; slab != NULL; slab = slab->next) {
+        for (vote_t *vote = vote_slab_next(slab, NULL); vote != NULL; vote = vote_slab_next(slab, vote)) {
+            vote->id += chunk->id_base;
+        }
+    }
+    return NULL;
+}
+// Thread body: shifts the chunk's local vote ids to their place in
+// the whole file.
+
+int tally_load_parallel(tally_t *tally, char *start, char *end, long first_line, char *fname){
+    int thread_count = THREAD_COUNT;
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+
+    load_chunk_t *chunks = calloc(thread_count, sizeof(load_chunk_t));
+    if (chunks == NULL) {
+        return -1;
+    }
+
+    // Split into roughly equal chunks ending just after a newline
+    char *chunk_start = start;
+    int chunk_count = 0;
+    for (int t = 0; t < thread_count && chunk_start < end; t++) {
+        char *chunk_end = chunk_start + (end - start) / thread_count;
+        if (t == thread_count - 1 || chunk_end >= end) {
+            chunk_end = end;
+        } else {
+            char *newline = memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = (newline == NULL) ? end : newline + 1;
+        }
+
+        load_chunk_t *chunk = &chunks[chunk_count++];
+        chunk->start = chunk_start;
+        chunk->end = chunk_end;
+        chunk->local = tally_make_empty();
+        chunk->tails = calloc(tally->candidate_count, sizeof(vote_t *));
+        if (chunk->local == NULL || chunk->tails == NULL ||
+            tally_set_candidate_count(chunk->local, tally->candidate_count) != 0 ||
+            (tally->pairwise != NULL && tally_use_pairwise(chunk->local) != 0)) {
+            chunk->failed = 1;
+        }
+        chunk_start = chunk_end;
+    }
+
+    int failed = 0;
+    for (int t = 0; t < chunk_count; t++) {
+        failed |= chunks[t].failed;
+    }
+    if (!failed) {
+        run_parallel(chunks, sizeof(load_chunk_t), chunk_count, load_chunk_parse);
+    }
+
+    // Report ignored lines in file order and work out where each
+    // chunk's ids start
+    long line_base = first_line;
+    int id_base = 0;
+    for (int t = 0; t < chunk_count; t++) {
+        load_chunk_t *chunk = &chunks[t];
+        failed |= chunk->failed;
+        for (int i = 0; !failed && i < chunk->bad_count; i++) {
+            if (chunk->bad_counts[i] < 0) {
+                tally_error("file '%s' line %ld vote #%04d: invalid candidate in vote, line ignored",
+                            fname, line_base + chunk->bad_lines[i], id_base + chunk->bad_ids[i]);
+            } else {
+                tally_error("file '%s' line %ld vote #%04d: expected %d preferences, found %d, line ignored",
+                            fname, line_base + chunk->bad_lines[i], id_base + chunk->bad_ids[i],
+                            tally->candidate_count, chunk->bad_counts[i]);
+            }
+        }
+        chunk->id_base = id_base;
+        id_base += chunk->vote_count;
+        line_base += chunk->line_count;
+    }
+    if (!failed) {
+        run_parallel(chunks, sizeof(load_chunk_t), chunk_count, load_chunk_renumber);
+    }
+
+    // Later chunks hold later votes so their lists go in front, the
+    // same order prepending one vote at a time gives
+    for (int t = 0; t < chunk_count; t++) {
+        tally_t *local = chunks[t].local;
+        if (local == NULL) {
+            free(chunks[t].tails);
+            continue;
+        }
+        if (!failed) {
+            for (int c = 0; c < tally->candidate_count; c++) {
+                if (local->candidate_votes[c] != NULL) {
+                    chunks[t].tails[c]->next = tally->candidate_votes[c];
+                    tally->candidate_votes[c] = local->candidate_votes[c];
+                    tally->candidate_vote_counts[c] += local->candidate_vote_counts[c];
+                }
+            }
+            if (local->invalid_votes != NULL) {
+                chunks[t].invalid_tail->next = tally->invalid_votes;
+                tally->invalid_votes = local->invalid_votes;
+                tally->invalid_vote_count += local->invalid_vote_count;
+            }
+            if (tally->pairwise != NULL) {
+                pairwise_merge(tally->pairwise, local->pairwise);
+            }
+        }
+
+        // Hand the chunk's slabs to the tally keeping file order
+        if (local->vote_slabs != NULL) {
+            if (tally->vote_slabs == NULL) {
+                tally->vote_slabs = local->vote_slabs;
+            } else {
+                tally->vote_slab_last->next = local->vote_slabs;
+            }
+            tally->vote_slab_last = local->vote_slab_last;
+        }
+        // The votes now belong to the tally, leave local empty to free it
+        local->vote_slabs = NULL;
+        local->invalid_votes = NULL;
+        for (int c = 0; c < local->candidate_count; c++) {
+            local->candidate_votes[c] = NULL;
+        }
+        tally_free(local);
+        free(chunks[t].tails);
+        free(chunks[t].bad_lines);
+        free(chunks[t].bad_ids);
+        free(chunks[t].bad_counts);
+    }
+    free(chunks);
+
+    if (failed) {
+        tally_error("memory allocation failed for vote");
+        return -1;
+    }
+    return 0;
+}
+// Loads the vote lines between `start` and `end` of a memory-mapped
+// votes file into `tally` using THREAD_COUNT threads (at most
+// MAX_THREADS). `first_line` is the number of lines before `start`
+// (the header) and is used to report ignored lines.
+//
+// The text is split into one chunk per thread with every chunk ending
+// just after a newline. Each thread parses its chunk exactly as
+// tally_from_file() does but into a private tally_t with its own vote
+// arena, candidate lists and counts, numbering its votes from 1. Once
+// all threads finish, the main thread reports ignored lines in file
+// order, the threads offset their vote ids by the number of votes in
+// earlier chunks, and the per-chunk lists are linked into the tally
+// later chunks first. Vote ids, list order and counts are therefore
+// identical to a single-threaded load. The chunk arenas are spliced
+// onto the tally's arena in file order so tally_free() releases them.
+// If the tally has pairwise counts each private tally keeps its own,
+// added to the tally's as the lists are linked.
+//
+// Returns 0 on success or -1 if memory ran out; the tally may then
+// hold some of the votes and should be freed.
+
+////////////////////////////////////////////////////////////////////////////////
+// PARALLEL TRANSFERS
+
+// A contiguous range of a dropped candidate's votes redistributed by
+// one thread into per-candidate buckets; see tally_transfer_parallel().
+typedef struct {
+  vote_t **votes;                       // votes of the range in list order
+  int count;                            // number of votes in the range
+  int from;                             // candidate being dropped
+  char *candidate_status;               // statuses, read-only while transferring
+  uint64_t *active;                     // set of ACTIVE candidates if the tally has a round index, else NULL
+  vote_t **heads;                       // bucket lists built by prepending
+  vote_t **tails;                       // first vote prepended to each bucket
+  int *counts;                          // weight of the votes in each bucket
+} transfer_range_t;
+
+static void *transfer_range(void *arg){
+    transfer_range_t *range = arg;
+    for (int v = 0; v < range->count; v++) {
+        vote_t *vote = range->votes[v];
+        vote->pos++;
+        int next_candidate = (range->active != NULL) ? vote_next_active(vote, range->active) :
+                                                       vote_next_candidate(vote, range->candidate_status);
+        if (next_candidate == NO_CANDIDATE) {
+            next_candidate = range->from;   // the dropped candidate's bucket holds exhausted votes
+        }
+        if (range->heads[next_candidate] == NULL) {
+            range->tails[next_candidate] = vote;
+        }
+        vote->next = range->heads[next_candidate];
+        range->heads[next_candidate] = vote;
+        range->counts[next_candidate] += vote->weight;
+    }
+    return NULL;
+}
+// Thread body: advances each vote in the range to its next active
+// candidate and prepends it to that candidate's bucket.
+
+int tally_transfer_parallel(tally_t *tally, int candidate_index){
+    int vote_count = 0;
+    for (vote_t *vote = tally->candidate_votes[candidate_index]; vote != NULL; vote = vote->next) {
+        vote_count++;
+    }
+
+    int thread_count = THREAD_COUNT;
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+    if (thread_count > vote_count) {
+        thread_count = vote_count;
+    }
+    if (thread_count < 1) {
+        return 0;
+    }
+
+    // Each range has a bucket head, tail and count per candidate
+    int candidate_count = tally->candidate_count;
+    vote_t **votes = malloc(vote_count * sizeof(vote_t *));
+    transfer_range_t *ranges = calloc(thread_count, sizeof(transfer_range_t));
+    vote_t **buckets = calloc((size_t) thread_count * 2 * candidate_count, sizeof(vote_t *));
+    int *counts = calloc((size_t) thread_count * candidate_count, sizeof(int));
+    if (votes == NULL || ranges == NULL || buckets == NULL || counts == NULL) {
+        free(votes);
+        free(ranges);
+        free(buckets);
+        free(counts);
+        return -1;
+    }
+    int v = 0;
+    for (vote_t *vote = tally->candidate_votes[candidate_index]; vote != NULL; vote = vote->next) {
+        votes[v++] = vote;
+    }
+
+    for (int t = 0; t < thread_count; t++) {
+        int first = (long) vote_count * t / thread_count;
+        int last = (long) vote_count * (t + 1) / thread_count;
+        ranges[t].votes = votes + first;
+        ranges[t].count = last - first;
+        ranges[t].from = candidate_index;
+        ranges[t].candidate_status = tally->candidate_status;
+        ranges[t].active = (tally->rounds != NULL) ? tally->rounds->active : NULL;
+        ranges[t].heads = buckets + (size_t) 2 * t * candidate_count;
+        ranges[t].tails = ranges[t].heads + candidate_count;
+        ranges[t].counts = counts + (size_t) t * candidate_count;
+    }
+    run_parallel(ranges, sizeof(transfer_range_t), thread_count, transfer_range);
+
+    // Every vote was visited counting, gathering and transferring
+    if (tally->stats != NULL) {
+        tally->stats->nodes_visited += 3L * vote_count;
+        for (int t = 0; t < thread_count; t++) {
+            for (int c = 0; c < candidate_count; c++) {
+                if (c == candidate_index) {
+                    tally->stats->ballots_exhausted += ranges[t].counts[c];
+                } else {
+                    tally->stats->ballots_transferred += ranges[t].counts[c];
+                }
+            }
+        }
+    }
+
+    // Later ranges were transferred later so their buckets go in front
+    tally->candidate_votes[candidate_index] = NULL;
+    tally->candidate_vote_counts[candidate_index] = 0;
+    for (int t = 0; t < thread_count; t++) {
+        for (int c = 0; c < tally->candidate_count; c++) {
+            if (ranges[t].heads[c] != NULL && c == candidate_index) {
+                ranges[t].tails[c]->next = tally->exhausted_votes;
+                tally->exhausted_votes = ranges[t].heads[c];
+                tally_count_exhausted(tally, ranges[t].counts[c]);
+            } else if (ranges[t].heads[c] != NULL) {
+                ranges[t].tails[c]->next = tally->candidate_votes[c];
+                tally->candidate_votes[c] = ranges[t].heads[c];
+                tally->candidate_vote_counts[c] += ranges[t].counts[c];
+                if (tally->rounds != NULL) {
+                    round_index_touch(tally->rounds, c);
+                }
+            }
+        }
+    }
+
+    free(votes);
+    free(ranges);
+    free(buckets);
+    free(counts);
+    return 0;
+}
+// Transfers every vote of the candidate at `candidate_index` to the
+// voters' next active candidates using up to THREAD_COUNT threads,
+// with the same result as calling tally_transfer_first_vote() until
+// the candidate's list has been processed once.
+//
+// The candidate's list is first gathered into an array and split into
+// one contiguous range per thread. Each thread calls
+// vote_next_candidate() on its votes, or vote_next_active() with the
+// round index's set during tally_election(), and prepends them to
+// thread-local buckets, one per destination candidate, keeping each
+// bucket's tail.
+// Candidate statuses don't change during a single candidate's drop so
+// the threads only read them. The buckets are then linked onto the
+// destination lists in range order, which leaves every list in the
+// order that one-at-a-time transfers produce. Votes with no next
+// candidate are gathered in the dropped candidate's own buckets which
+// are linked onto the exhausted list in the same way, as
+// tally_transfer_first_vote() would put them there.
+//
+// Returns 0 on success or -1 if memory for the work arrays can't be
+// allocated, in which case nothing has been changed.
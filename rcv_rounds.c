@@ -0,0 +1,224 @@
+// rcv_rounds.c: Incremental round bookkeeping for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// ROUND INDEX
+//
+// While tally_election() runs, tally->rounds points to a round_index_t
+// which keeps the facts each round needs up to date as votes move
+// instead of rescanning every candidate:
+// - the total of all candidate counts, which transfers only lower by
+//   exhausting votes (see tally_count_exhausted())
+// - the number of ACTIVE candidates, a set of them as bits for the
+//   transfers to test (see vote_next_active()) and the list of
+//   MINVOTES ones
+// - a binary min-heap of the candidates that are not DROPPED ordered
+//   by vote count (ties broken by index) so the minimum is at the top
+// Transfers only mark their destination as touched; the heap is
+// repaired for touched candidates once per round, so a round costs
+// time proportional to the votes moved plus a heap update per
+// candidate whose count changed. The scanning code in rcv_funcs.c is
+// still used whenever tally->rounds is NULL.
+
+static int round_heap_less(tally_t *tally, int a, int b){
+    int count_a = tally->rounds->heap_key[a];
+    int count_b = tally->rounds->heap_key[b];
+    return count_a < count_b || (count_a == count_b && a < b);
+}
+// Heap order: fewer votes first, lower index first among equals. The
+// heap compares its own copy of the counts rather than the live ones:
+// a round changes many counts before the heap is repaired, and each
+// repair step needs the rest of the heap to be in order.
+
+static void round_heap_swap(round_index_t *rounds, int i, int j){
+    int a = rounds->heap[i], b = rounds->heap[j];
+    rounds->heap[i] = b;
+    rounds->heap[j] = a;
+    rounds->heap_pos[b] = i;
+    rounds->heap_pos[a] = j;
+}
+
+static void round_heap_sift_down(tally_t *tally, int i){
+    round_index_t *rounds = tally->rounds;
+    while (1) {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < rounds->heap_len && round_heap_less(tally, rounds->heap[left], rounds->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < rounds->heap_len && round_heap_less(tally, rounds->heap[right], rounds->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        round_heap_swap(rounds, i, smallest);
+        i = smallest;
+    }
+}
+// Moves the entry at heap position `i` down until neither child has
+// fewer votes.
+
+static void round_heap_fix(tally_t *tally, int i){
+    round_index_t *rounds = tally->rounds;
+    while (i > 0 && round_heap_less(tally, rounds->heap[i], rounds->heap[(i - 1) / 2])) {
+        round_heap_swap(rounds, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    round_heap_sift_down(tally, i);
+}
+// Restores the heap property for the entry at heap position `i`
+// after its candidate's count changed in either direction.
+
+int tally_rounds_begin(tally_t *tally){
+    int count = tally->candidate_count;
+    round_index_t *rounds = calloc(1, sizeof(round_index_t));
+    if (rounds == NULL) {
+        return -1;
+    }
+    rounds->minvote = malloc(count * sizeof(int) + 1);
+    rounds->heap = malloc(count * sizeof(int) + 1);
+    rounds->heap_pos = malloc(count * sizeof(int) + 1);
+    rounds->heap_key = malloc(count * sizeof(int) + 1);
+    rounds->touched = calloc(count + 1, 1);
+    rounds->touched_list = malloc(count * sizeof(int) + 1);
+    rounds->active = calloc(CAND_SET_WORDS(count) + 1, sizeof(uint64_t));
+    if (rounds->minvote == NULL || rounds->heap == NULL || rounds->heap_pos == NULL ||
+        rounds->heap_key == NULL || rounds->touched == NULL || rounds->touched_list == NULL ||
+        rounds->active == NULL) {
+        tally->rounds = rounds;
+        tally_rounds_end(tally);
+        return -1;
+    }
+    tally->rounds = rounds;
+
+    for (int i = 0; i < tally->candidate_count; i++) {
+        rounds->total_votes += tally->candidate_vote_counts[i];
+        rounds->heap_pos[i] = -1;
+        rounds->heap_key[i] = tally->candidate_vote_counts[i];
+        switch (tally->candidate_status[i]) {
+            case CAND_ACTIVE:
+                rounds->active_count++;
+                rounds->active[i >> 6] |= (uint64_t) 1 << (i & 63);
+                break;
+            case CAND_MINVOTES:
+                rounds->minvote[rounds->minvote_len++] = i;
+                break;
+            case CAND_DROPPED:
+                continue;
+            default:
+                rounds->error = 1;
+                continue;
+        }
+        rounds->heap_pos[i] = rounds->heap_len;
+        rounds->heap[rounds->heap_len++] = i;
+    }
+    for (int i = rounds->heap_len / 2 - 1; i >= 0; i--) {
+        round_heap_sift_down(tally, i);
+    }
+    return 0;
+}
+// Builds the round index for `tally`, with arrays sized for its
+// candidates, from their current counts and statuses with one scan
+// and attaches it as tally->rounds. A candidate with an unknown status
+// is remembered so that tally_condition() still reports TALLY_ERROR.
+// Returns 0 on success or -1 if memory can't be allocated, in which
+// case the tally is unchanged and the scanning functions are used.
+
+void tally_rounds_end(tally_t *tally){
+    round_index_t *rounds = tally->rounds;
+    if (rounds != NULL) {
+        free(rounds->minvote);
+        free(rounds->heap);
+        free(rounds->heap_pos);
+        free(rounds->heap_key);
+        free(rounds->touched);
+        free(rounds->touched_list);
+        free(rounds->active);
+        free(rounds);
+    }
+    tally->rounds = NULL;
+}
+// Detaches and frees the round index.
+
+void round_index_touch(round_index_t *rounds, int candidate){
+    if (!rounds->touched[candidate]) {
+        rounds->touched[candidate] = 1;
+        rounds->touched_list[rounds->touched_len++] = candidate;
+    }
+}
+// Called by the transfer functions when `candidate` gains or loses
+// votes; the heap is repaired later by round_index_repair().
+
+void round_index_drop(tally_t *tally, int candidate){
+    round_index_t *rounds = tally->rounds;
+    int i = rounds->heap_pos[candidate];
+    if (i < 0) {
+        return;
+    }
+    round_heap_swap(rounds, i, rounds->heap_len - 1);
+    rounds->heap_len--;
+    rounds->heap_pos[candidate] = -1;
+    if (i < rounds->heap_len) {
+        round_heap_fix(tally, i);
+    }
+}
+// Removes a candidate that has just been DROPPED from the heap.
+
+void round_index_repair(tally_t *tally){
+    round_index_t *rounds = tally->rounds;
+    for (int k = 0; k < rounds->touched_len; k++) {
+        int candidate = rounds->touched_list[k];
+        rounds->touched[candidate] = 0;
+        rounds->heap_key[candidate] = tally->candidate_vote_counts[candidate];
+        if (rounds->heap_pos[candidate] >= 0) {
+            round_heap_fix(tally, rounds->heap_pos[candidate]);
+        }
+    }
+    rounds->touched_len = 0;
+    rounds->minvote_len = 0;
+}
+// Called at the end of tally_drop_minvote_candidates(): updates the
+// heap's copy of the count of every touched candidate and moves it to
+// its place in the heap, and clears the MINVOTES list as all of those
+// candidates have now been dropped.
+
+static void round_heap_collect(tally_t *tally, int i, int min_votes, int *candidates, int *count){
+    round_index_t *rounds = tally->rounds;
+    if (i >= rounds->heap_len || tally->candidate_vote_counts[rounds->heap[i]] != min_votes) {
+        return;
+    }
+    candidates[(*count)++] = rounds->heap[i];
+    round_heap_collect(tally, 2 * i + 1, min_votes, candidates, count);
+    round_heap_collect(tally, 2 * i + 2, min_votes, candidates, count);
+}
+// Gathers the heap entries below position `i` whose count equals the
+// minimum; only subtrees rooted at such entries can hold more.
+
+int round_index_min_candidates(tally_t *tally, int *candidates){
+    round_index_t *rounds = tally->rounds;
+    if (rounds->heap_len == 0) {
+        return 0;
+    }
+    int count = 0;
+    int min_votes = tally->candidate_vote_counts[rounds->heap[0]];
+    round_heap_collect(tally, 0, min_votes, candidates, &count);
+
+    // Callers report candidates in index order; there are few of them
+    for (int i = 1; i < count; i++) {
+        int candidate = candidates[i];
+        int j = i;
+        while (j > 0 && candidates[j - 1] > candidate) {
+            candidates[j] = candidates[j - 1];
+            j--;
+        }
+        candidates[j] = candidate;
+    }
+    return count;
+}
+// Stores the indices of all candidates that are not DROPPED and have
+// the minimum vote count into candidates[] in increasing index order
+// and returns how many there are, 0 if every candidate is DROPPED.
+// Costs time proportional to the number of such candidates.
@@ -0,0 +1,510 @@
+// rcv_sink.c: Election result formats for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// RESULT SINKS
+//
+// tally_election() reports each round and the outcome through a
+// result_sink_t chosen by RESULT_FORMAT rather than printing them
+// itself. The table sink prints the text rcv_main always has; the JSON
+// lines and CSV sinks print one structured record per candidate per
+// round for other programs to read. All of them write to tally_out().
+
+static void table_contest(char *fname){
+    fprintf(tally_out(), "=== CONTEST %s ===\n", fname);
+}
+
+static void table_round_begin(tally_t *tally, int round){
+    (void) tally;
+    fprintf(tally_out(), "=== ROUND %d ===\n", round);
+}
+
+static void table_round_end(tally_t *tally, int round){
+    (void) round;
+    tally_print_table(tally);
+}
+
+static void table_result(tally_t *tally, int round, int condition){
+    (void) round;
+    FILE *out = tally_out();
+    if (condition == TALLY_WINNER) {
+        for (int i = 0; i < tally->candidate_count; i++) {
+            if (tally->candidate_status[i] == CAND_ACTIVE) {
+                fprintf(out, "Winner: %s (candidate %d)\n", tally->candidate_names[i], i);
+                return;
+            }
+        }
+    } else if (condition == TALLY_TIE) {
+        fprintf(out, "Multiway Tie Between:\n");
+        for (int i = 0; i < tally->candidate_count; i++) {
+            if (tally->candidate_status[i] == CAND_MINVOTES) {
+                fprintf(out, "%s (candidate %d)\n", tally->candidate_names[i], i);
+            }
+        }
+    } else if (condition == TALLY_ERROR) {
+        fprintf(out, "Something is rotten in the state of Denmark\n");
+    }
+}
+// The human readable format: the "=== ROUND NN ===" headline, the
+// table of tally_print_table() and the Winner / Multiway Tie messages
+// described for tally_election().
+
+static void table_stv_round(tally_t *tally, int round, long *totals, long quota, long exhausted){
+    (void) round;
+    FILE *out = tally_out();
+    char buf[32];
+    fprintf(out, "NUM      VOTES S NAME\n");
+    for (int i = 0; i < tally->candidate_count; i++) {
+        char status = tally->candidate_status[i];
+        if (status == CAND_DROPPED) {
+            fprintf(out, "%3d          - D %-10s\n", i, tally->candidate_names[i]);
+        } else {
+            stv_format_value(buf, totals[i]);
+            fprintf(out, "%3d %10s %c %-10s\n", i, buf, status, tally->candidate_names[i]);
+        }
+    }
+    stv_format_value(buf, quota);
+    fprintf(out, "Quota: %s\n", buf);
+    if (exhausted > 0) {
+        stv_format_value(buf, exhausted);
+        fprintf(out, "Exhausted: %s\n", buf);
+    }
+}
+
+static void table_stv_result(tally_t *tally, int round, int *elected, int count){
+    (void) round;
+    for (int k = 0; k < count; k++) {
+        fprintf(tally_out(), "Elected: %s (candidate %d)\n", tally->candidate_names[elected[k]], elected[k]);
+    }
+}
+// The table and seat lines shown for tally_stv().
+
+static void table_pairwise(tally_t *tally){
+    FILE *out = tally_out();
+    pairwise_t *pairwise = tally->pairwise;
+    int count = tally->candidate_count;
+
+    // Columns are wide enough for the largest count and index
+    int most = count - 1;
+    for (int a = 0; a < count; a++) {
+        for (int b = 0; b < count; b++) {
+            int prefer = pairwise_prefer(pairwise, a, b);
+            most = (prefer > most) ? prefer : most;
+        }
+    }
+    int width = snprintf(NULL, 0, "%d", most) + 1;
+
+    fprintf(out, "=== PAIRWISE ===\nNUM");
+    for (int b = 0; b < count; b++) {
+        fprintf(out, "%*d", width, b);
+    }
+    fprintf(out, " NAME\n");
+    for (int a = 0; a < count; a++) {
+        fprintf(out, "%3d", a);
+        for (int b = 0; b < count; b++) {
+            if (a == b) {
+                fprintf(out, "%*s", width, "-");
+            } else {
+                fprintf(out, "%*d", width, pairwise_prefer(pairwise, a, b));
+            }
+        }
+        fprintf(out, " %s\n", tally->candidate_names[a]);
+    }
+
+    int winner = pairwise_condorcet_winner(pairwise);
+    if (winner == NO_CANDIDATE) {
+        fprintf(out, "No Condorcet winner\n");
+    } else {
+        fprintf(out, "Condorcet winner: %s (candidate %d)\n", tally->candidate_names[winner], winner);
+    }
+}
+// Pairwise counts as a grid whose row A, column B entry is the number
+// of ballots ranking A above B, then the Condorcet winner if any.
+// Columns are one wider than the largest count:
+//
+// === PAIRWISE ===
+// NUM   0   1   2   3 NAME
+//   0   - 512 488 603 Francis
+//   1 441   - 530 497 Claire
+//   2 465 423   - 511 Heather
+//   3 350 456 442   - Viktor
+// Condorcet winner: Francis (candidate 0)
+//
+// or "No Condorcet winner" when every candidate loses or ties some
+// pairing.
+
+static void table_error(char *message){
+    fprintf(tally_out(), "ERROR: %s\n", message);
+}
+
+static void json_string(FILE *out, char *str){
+    fputc('"', out);
+    for (unsigned char *c = (unsigned char *) str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static char *status_name(char status){
+    switch (status) {
+        case CAND_ACTIVE:
+            return "A";
+        case CAND_MINVOTES:
+            return "M";
+        case CAND_DROPPED:
+            return "D";
+        case CAND_ELECTED:
+            return "E";
+        default:
+            return "?";
+    }
+}
+// The status letters of tally_print_table().
+
+static void json_contest(char *fname){
+    FILE *out = tally_out();
+    fprintf(out, "{\"contest\":");
+    json_string(out, fname);
+    fprintf(out, "}\n");
+}
+
+static void json_round_begin(tally_t *tally, int round){
+    (void) tally;
+    (void) round;
+}
+
+static void json_round_end(tally_t *tally, int round){
+    FILE *out = tally_out();
+    int total_votes = tally_total_votes(tally);
+    fprintf(out, "{\"round\":%d,\"total\":%d,\"invalid\":%d,\"exhausted\":%d,\"exhausted_round\":%d,\"candidates\":[",
+            round, total_votes, tally->invalid_vote_count, tally->exhausted_vote_count,
+            tally->round_exhausted_count);
+    for (int i = 0; i < tally->candidate_count; i++) {
+        fprintf(out, "%s{\"num\":%d,\"name\":", i == 0 ? "" : ",", i);
+        json_string(out, tally->candidate_names[i]);
+        fprintf(out, ",\"status\":\"%s\"", status_name(tally->candidate_status[i]));
+        if (tally->candidate_status[i] != CAND_DROPPED) {
+            float percentage = (total_votes > 0) ? (100.0 * tally->candidate_vote_counts[i] / total_votes) : 0.0;
+            fprintf(out, ",\"count\":%d,\"percent\":%.1f", tally->candidate_vote_counts[i], percentage);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+static void json_result(tally_t *tally, int round, int condition){
+    FILE *out = tally_out();
+    char *names[] = {"", "error", "winner", "tie", "continue"};
+    char status = (condition == TALLY_WINNER) ? CAND_ACTIVE : CAND_MINVOTES;
+    fprintf(out, "{\"result\":\"%s\",\"rounds\":%d,\"candidates\":[", names[condition], round);
+    int first = 1;
+    for (int i = 0; condition != TALLY_ERROR && i < tally->candidate_count; i++) {
+        if (tally->candidate_status[i] == status) {
+            fprintf(out, "%s{\"num\":%d,\"name\":", first ? "" : ",", i);
+            json_string(out, tally->candidate_names[i]);
+            fprintf(out, "}");
+            first = 0;
+        }
+    }
+    fprintf(out, "]}\n");
+}
+
+static void json_stv_round(tally_t *tally, int round, long *totals, long quota, long exhausted){
+    FILE *out = tally_out();
+    char buf[32], buf2[32];
+    stv_format_value(buf, quota);
+    stv_format_value(buf2, exhausted);
+    fprintf(out, "{\"round\":%d,\"quota\":%s,\"exhausted\":%s,\"candidates\":[", round, buf, buf2);
+    for (int i = 0; i < tally->candidate_count; i++) {
+        fprintf(out, "%s{\"num\":%d,\"name\":", i == 0 ? "" : ",", i);
+        json_string(out, tally->candidate_names[i]);
+        fprintf(out, ",\"status\":\"%s\"", status_name(tally->candidate_status[i]));
+        if (tally->candidate_status[i] != CAND_DROPPED) {
+            stv_format_value(buf, totals[i]);
+            fprintf(out, ",\"votes\":%s", buf);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+static void json_stv_result(tally_t *tally, int round, int *elected, int count){
+    FILE *out = tally_out();
+    fprintf(out, "{\"result\":\"elected\",\"rounds\":%d,\"candidates\":[", round);
+    for (int k = 0; k < count; k++) {
+        fprintf(out, "%s{\"num\":%d,\"name\":", k == 0 ? "" : ",", elected[k]);
+        json_string(out, tally->candidate_names[elected[k]]);
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+static void json_pairwise(tally_t *tally){
+    FILE *out = tally_out();
+    fprintf(out, "{\"pairwise\":[");
+    for (int a = 0; a < tally->candidate_count; a++) {
+        fprintf(out, "%s[", a == 0 ? "" : ",");
+        for (int b = 0; b < tally->candidate_count; b++) {
+            fprintf(out, "%s%d", b == 0 ? "" : ",", pairwise_prefer(tally->pairwise, a, b));
+        }
+        fprintf(out, "]");
+    }
+    int winner = pairwise_condorcet_winner(tally->pairwise);
+    if (winner == NO_CANDIDATE) {
+        fprintf(out, "],\"condorcet\":null}\n");
+    } else {
+        fprintf(out, "],\"condorcet\":{\"num\":%d,\"name\":", winner);
+        json_string(out, tally->candidate_names[winner]);
+        fprintf(out, "}}\n");
+    }
+}
+
+static void json_error(char *message){
+    FILE *out = tally_out();
+    fprintf(out, "{\"error\":");
+    json_string(out, message);
+    fprintf(out, "}\n");
+}
+
+static void json_stats(tally_t *tally){
+    tally_stats_print_json(tally->stats);
+}
+// The stats are a JSON line in the table format too so they can be
+// picked out of its text.
+
+// JSON lines: one object per round such as
+//
+// {"round":2,"total":12,"invalid":0,"exhausted":0,"exhausted_round":0,
+//  "candidates":[{"num":0,"name":"Francis","status":"A","count":5,"percent":41.7},
+//  ...,{"num":3,"name":"Viktor","status":"D"}]}
+//
+// with no count or percent for dropped candidates. "total" is the
+// continuing ballots, "exhausted" all exhausted ballots so far and
+// "exhausted_round" those exhausted by the round's drops. Then one object
+// for the outcome such as
+//
+// {"result":"winner","rounds":3,"candidates":[{"num":0,"name":"Francis"}]}
+//
+// where "result" is "winner", "tie" (listing the tied candidates) or
+// "error" (with no candidates). A batch contest starts with
+// {"contest":"votes.txt"}. Errors such as a rejected vote line or a
+// file that can't be read are objects like
+//
+// {"error":"file 'votes.txt' line 12 vote #0010: expected 4 preferences, found 3, line ignored"}
+//
+// STV rounds give the value of each candidate's votes instead:
+//
+// {"round":2,"quota":334.00000,"exhausted":12.16667,"candidates":[{"num":0,
+//  "name":"Francis","status":"E","votes":334.00000},...]}
+//
+// and end with {"result":"elected",...} listing the candidates in the
+// order they were elected.
+//
+// Pairwise counts follow the result as one object whose "pairwise"
+// rows give the ballots ranking each candidate above each other one,
+// 0 against themselves, and "condorcet" the Condorcet winner or null:
+//
+// {"pairwise":[[0,512,488,603],[441,0,530,497],[465,423,0,511],[350,456,442,0]],
+//  "condorcet":{"num":0,"name":"Francis"}}
+
+static void csv_string(FILE *out, char *str){
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        fputs(str, out);
+        return;
+    }
+    fputc('"', out);
+    for (char *c = str; *c != '\0'; c++) {
+        if (*c == '"') {
+            fputc('"', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void csv_contest(char *fname){
+    FILE *out = tally_out();
+    fprintf(out, "contest,,");
+    csv_string(out, fname);
+    fprintf(out, ",,,\n");
+}
+
+static void csv_round_begin(tally_t *tally, int round){
+    (void) tally;
+    if (round == 1) {
+        fprintf(tally_out(), "round,candidate,name,count,percent,status\n");
+    }
+}
+
+static void csv_row(FILE *out, tally_t *tally, char *round, int i, int total_votes, char *status){
+    fprintf(out, "%s,%d,", round, i);
+    csv_string(out, tally->candidate_names[i]);
+    if (tally->candidate_status[i] == CAND_DROPPED) {
+        fprintf(out, ",,,%s\n", status);
+    } else {
+        float percentage = (total_votes > 0) ? (100.0 * tally->candidate_vote_counts[i] / total_votes) : 0.0;
+        fprintf(out, ",%d,%.1f,%s\n", tally->candidate_vote_counts[i], percentage, status);
+    }
+}
+
+static void csv_round_end(tally_t *tally, int round){
+    FILE *out = tally_out();
+    int total_votes = tally_total_votes(tally);
+    char round_str[16];
+    sprintf(round_str, "%d", round);
+    for (int i = 0; i < tally->candidate_count; i++) {
+        csv_row(out, tally, round_str, i, total_votes, status_name(tally->candidate_status[i]));
+    }
+    if (tally->invalid_vote_count > 0) {
+        fprintf(out, "%d,%d,,%d,,I\n", round, NO_CANDIDATE, tally->invalid_vote_count);
+    }
+    if (tally->exhausted_vote_count > 0) {
+        fprintf(out, "%d,%d,,%d,,X\n", round, NO_CANDIDATE, tally->exhausted_vote_count);
+    }
+}
+
+static void csv_result(tally_t *tally, int round, int condition){
+    (void) round;
+    FILE *out = tally_out();
+    int total_votes = tally_total_votes(tally);
+    for (int i = 0; condition != TALLY_ERROR && i < tally->candidate_count; i++) {
+        if (condition == TALLY_WINNER && tally->candidate_status[i] == CAND_ACTIVE) {
+            csv_row(out, tally, "final", i, total_votes, "W");
+        } else if (condition == TALLY_TIE && tally->candidate_status[i] == CAND_MINVOTES) {
+            csv_row(out, tally, "final", i, total_votes, "T");
+        }
+    }
+    if (condition == TALLY_ERROR) {
+        fprintf(out, "final,%d,,,,E\n", NO_CANDIDATE);
+    }
+}
+
+static void csv_stv_round(tally_t *tally, int round, long *totals, long quota, long exhausted){
+    FILE *out = tally_out();
+    char buf[32];
+    for (int i = 0; i < tally->candidate_count; i++) {
+        fprintf(out, "%d,%d,", round, i);
+        csv_string(out, tally->candidate_names[i]);
+        if (tally->candidate_status[i] == CAND_DROPPED) {
+            fprintf(out, ",,,D\n");
+        } else {
+            stv_format_value(buf, totals[i]);
+            fprintf(out, ",%s,,%s\n", buf, status_name(tally->candidate_status[i]));
+        }
+    }
+    stv_format_value(buf, quota);
+    fprintf(out, "%d,%d,,%s,,Q\n", round, NO_CANDIDATE, buf);
+    if (exhausted > 0) {
+        stv_format_value(buf, exhausted);
+        fprintf(out, "%d,%d,,%s,,X\n", round, NO_CANDIDATE, buf);
+    }
+}
+
+static void csv_stv_result(tally_t *tally, int round, int *elected, int count){
+    (void) round;
+    FILE *out = tally_out();
+    for (int k = 0; k < count; k++) {
+        fprintf(out, "final,%d,", elected[k]);
+        csv_string(out, tally->candidate_names[elected[k]]);
+        fprintf(out, ",,,W\n");
+    }
+}
+
+static void csv_pairwise(tally_t *tally){
+    FILE *out = tally_out();
+    for (int a = 0; a < tally->candidate_count; a++) {
+        for (int b = 0; b < tally->candidate_count; b++) {
+            if (a != b) {
+                fprintf(out, "pairwise,%d,%d,%d,,\n", a, b, pairwise_prefer(tally->pairwise, a, b));
+            }
+        }
+    }
+    int winner = pairwise_condorcet_winner(tally->pairwise);
+    fprintf(out, "condorcet,%d,", winner);
+    if (winner != NO_CANDIDATE) {
+        csv_string(out, tally->candidate_names[winner]);
+    }
+    fprintf(out, ",,,%s\n", (winner == NO_CANDIDATE) ? "" : "W");
+}
+
+static void csv_error(char *message){
+    FILE *out = tally_out();
+    fprintf(out, "error,%d,", NO_CANDIDATE);
+    csv_string(out, message);
+    fprintf(out, ",,,E\n");
+}
+
+static void csv_stats(tally_t *tally){
+    tally_stats_print_csv(tally->stats);
+}
+
+// CSV: a header row at the start of each election, then one row per
+// candidate per round as in tally_print_table() with empty count and
+// percent for dropped candidates and a row for candidate -1 with
+// status I holding the invalid vote count if there are any and one
+// with status X holding the exhausted vote count if there are any. The
+// outcome follows as rows whose round is "final" with status W for
+// the winner, T for each tied candidate or a single row with status
+// E for an error. A batch contest starts with a row "contest,,FILE,,,".
+// Error messages are rows "error,-1,MESSAGE,,,E".
+// STV rounds put the value of each candidate's votes in the count
+// column with rows for the quota (status Q) and exhausted value, and
+// end with a "final" row with status W for each elected candidate.
+// Pairwise counts are rows "pairwise,A,B,COUNT,," for every ordered
+// pair of candidates, COUNT ballots ranking A above B with B in the
+// name column, and a row "condorcet,A,NAME,,,W" for the Condorcet
+// winner or "condorcet,-1,,,," if there is none.
+
+static result_sink_t result_sinks[] = {
+    [RESULT_TABLE] = {table_contest, table_round_begin, table_round_end, table_result, json_stats,
+                      table_stv_round, table_stv_result, table_pairwise, table_error},
+    [RESULT_JSON]  = {json_contest, json_round_begin, json_round_end, json_result, json_stats,
+                      json_stv_round, json_stv_result, json_pairwise, json_error},
+    [RESULT_CSV]   = {csv_contest, csv_round_begin, csv_round_end, csv_result, csv_stats,
+                      csv_stv_round, csv_stv_result, csv_pairwise, csv_error},
+};
+
+result_sink_t *result_sink(int format){
+    if (format < RESULT_TABLE || format > RESULT_CSV) {
+        format = RESULT_TABLE;
+    }
+    return &result_sinks[format];
+}
+// Returns the sink for RESULT_TABLE, RESULT_JSON or RESULT_CSV,
+// the table for anything else.
+
+void tally_error(char *format, ...){
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    result_sink(RESULT_FORMAT)->error(message);
+}
+// Prints an error message, given like printf(), through the sink for
+// RESULT_FORMAT so that JSON and CSV output stay machine readable: in
+// the table format it is the line "ERROR: " and the message.
+
+int result_format_parse(char *name){
+    if (strcmp(name, "table") == 0) {
+        return RESULT_TABLE;
+    } else if (strcmp(name, "json") == 0) {
+        return RESULT_JSON;
+    } else if (strcmp(name, "csv") == 0) {
+        return RESULT_CSV;
+    }
+    return -1;
+}
+// Returns the RESULT_FORMAT value named by "table", "json" or "csv"
+// as given on the command line, or -1 for any other name.
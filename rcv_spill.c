@@ -0,0 +1,425 @@
+// rcv_spill.c: External-memory vote storage for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// SPILLED VOTES
+//
+// A tally whose `spill` field is set keeps its votes on disk so that
+// elections can be run on votes files larger than memory. Each
+// candidate's pile is a run file in a private directory holding one
+// record per vote:
+//
+//   int32_t id; uint16_t pos; uint16_t len; uint16_t ranks[len];
+//   uint32_t size                       bytes in the whole record
+//
+// Records are appended as votes are added to a pile, so the end of a
+// run is the front of the pile. The trailing size lets runs be read
+// from the end, which visits a pile in the same order as a list built
+// by prepending. Appends go through a write buffer per run and whole
+// runs are only read when their candidate is dropped, so memory use
+// depends on the number of candidates but not on the number of votes.
+// The tally_*() functions check for a spill and call the functions
+// here so elections run and print the same as with votes in memory.
+
+#define SPILL_RECORD_SIZE(len) (8 + 2 * (size_t) (len) + 4)
+
+static void spill_run_path(vote_spill_t *spill, int run, char *path){
+    snprintf(path, PATH_MAX, "%s/%d.run", spill->dir, run);
+}
+// Name of the file of run `run`; run_count - 1 is the exhausted run.
+
+static void spill_fail(vote_spill_t *spill, char *what, int run){
+    if (!spill->error) {
+        char path[PATH_MAX];
+        spill_run_path(spill, run, path);
+        tally_error("couldn't %s spill file '%s'", what, path);
+    }
+    spill->error = 1;
+}
+// Reports the first I/O failure; tally_condition() then returns
+// TALLY_ERROR so the election stops.
+
+static int spill_flush(vote_spill_t *spill, int run){
+    spill_run_t *r = &spill->runs[run];
+    if (r->len == 0) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    spill_run_path(spill, run, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    size_t done = 0;
+    while (fd >= 0 && done < r->len) {
+        ssize_t n = write(fd, r->buf + done, r->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (done < r->len) {
+        spill_fail(spill, "write", run);
+        return -1;
+    }
+    r->file_len += r->len;
+    r->len = 0;
+    return 0;
+}
+// Appends the buffered records of a run to its file. The file is only
+// open while writing so any number of candidates can be spilled.
+
+static void spill_push(vote_spill_t *spill, int run, vote_t *vote){
+    size_t size = SPILL_RECORD_SIZE(vote->len);
+    spill_run_t *r = &spill->runs[run];
+    if (r->len + size > spill->buffer_size && spill_flush(spill, run) != 0) {
+        return;
+    }
+
+    char *rec = r->buf + r->len;
+    int32_t id = vote->id;
+    uint16_t pos = vote->pos, len = vote->len;
+    uint32_t size32 = size;
+    memcpy(rec, &id, 4);
+    memcpy(rec + 4, &pos, 2);
+    memcpy(rec + 6, &len, 2);
+    memcpy(rec + 8, vote->candidate_order, 2 * (size_t) len);
+    memcpy(rec + size - 4, &size32, 4);
+    r->len += size;
+    r->count++;
+}
+// Appends `vote` to the front of the pile of run `run`.
+
+static void spill_decode(char *rec, vote_t *vote){
+    int32_t id;
+    uint16_t pos, len;
+    memcpy(&id, rec, 4);
+    memcpy(&pos, rec + 4, 2);
+    memcpy(&len, rec + 6, 2);
+    vote->id = id;
+    vote->pos = pos;
+    vote->len = len;
+    vote->rank_size = sizeof(cand_t);
+    vote->weight = 1;
+    vote->next = NULL;
+    memcpy(vote->candidate_order, rec + 8, 2 * (size_t) len);
+}
+// Fills in `vote` from the record at `rec`.
+
+// Position of a walk over a run from its front (end of the run) to its
+// back, see spill_cursor_next().
+typedef struct {
+  int run;                              // run being walked
+  int fd;                               // its file, -1 until needed
+  size_t buf_left;                      // buffered bytes not yet visited
+  size_t file_left;                     // file bytes not yet visited
+  size_t block_len;                     // bytes of the file just before file_left in spill->block
+} spill_cursor_t;
+
+static void spill_cursor_open(vote_spill_t *spill, int run, spill_cursor_t *cursor){
+    cursor->run = run;
+    cursor->fd = -1;
+    cursor->buf_left = spill->runs[run].len;
+    cursor->file_left = spill->runs[run].file_len;
+    cursor->block_len = 0;
+}
+
+static int spill_cursor_next(vote_spill_t *spill, spill_cursor_t *cursor, vote_t *vote){
+    spill_run_t *r = &spill->runs[cursor->run];
+    uint32_t size;
+
+    // The newest records are still in the write buffer
+    if (cursor->buf_left > 0) {
+        memcpy(&size, r->buf + cursor->buf_left - 4, 4);
+        cursor->buf_left -= size;
+        spill_decode(r->buf + cursor->buf_left, vote);
+        return 1;
+    }
+    if (cursor->file_left == 0) {
+        return 0;
+    }
+
+    // Older ones are read from the file a block at a time, backwards
+    for (int refilled = 0; ; refilled = 1) {
+        if (cursor->block_len >= 4) {
+            memcpy(&size, spill->block + cursor->block_len - 4, 4);
+            if (size <= cursor->block_len) {
+                break;
+            }
+        }
+        size_t n = (cursor->file_left < SPILL_BLOCK) ? cursor->file_left : SPILL_BLOCK;
+        if (cursor->fd < 0) {
+            char path[PATH_MAX];
+            spill_run_path(spill, cursor->run, path);
+            cursor->fd = open(path, O_RDONLY);
+        }
+        if (refilled || cursor->fd < 0 ||
+            pread(cursor->fd, spill->block, n, cursor->file_left - n) != (ssize_t) n) {
+            spill_fail(spill, "read", cursor->run);
+            return 0;
+        }
+        cursor->block_len = n;
+    }
+    cursor->block_len -= size;
+    cursor->file_left -= size;
+    spill_decode(spill->block + cursor->block_len, vote);
+    return 1;
+}
+// Copies the next vote of the walk into `vote` and returns 1, or
+// returns 0 once the back of the pile is passed or if the run can't be
+// read. Records are never larger than SPILL_BLOCK so one refill always
+// brings in a whole record.
+
+static void spill_cursor_close(spill_cursor_t *cursor){
+    if (cursor->fd >= 0) {
+        close(cursor->fd);
+    }
+}
+
+int tally_use_spill(tally_t *tally, char *dir){
+    vote_spill_t *spill = calloc(1, sizeof(vote_spill_t));
+    if (spill == NULL) {
+        return -1;
+    }
+
+    // Runs for each candidate, the invalid votes and the exhausted votes
+    spill->run_count = tally->candidate_count + 2;
+    spill->buffer_size = SPILL_MEMORY / spill->run_count;
+    if (spill->buffer_size < SPILL_BUFFER_MIN) {
+        spill->buffer_size = SPILL_BUFFER_MIN;
+    }
+    if (spill->buffer_size > SPILL_BUFFER_MAX) {
+        spill->buffer_size = SPILL_BUFFER_MAX;
+    }
+    if (spill->buffer_size < SPILL_RECORD_SIZE(tally->candidate_count)) {
+        spill->buffer_size = SPILL_RECORD_SIZE(tally->candidate_count);
+    }
+
+    spill->dir = malloc(strlen(dir) + 32);
+    spill->runs = calloc(spill->run_count, sizeof(spill_run_t));
+    spill->block = malloc(SPILL_BLOCK);
+    spill->view = malloc(VOTE_SIZE(tally->candidate_count, sizeof(cand_t)));
+    int failed = spill->dir == NULL || spill->runs == NULL || spill->block == NULL ||
+                 spill->view == NULL;
+    for (int i = 0; !failed && i < spill->run_count; i++) {
+        spill->runs[i].buf = malloc(spill->buffer_size);
+        failed = spill->runs[i].buf == NULL;
+    }
+    if (!failed) {
+        sprintf(spill->dir, "%s/rcv-spill-XXXXXX", dir);
+        if (mkdtemp(spill->dir) == NULL) {
+            tally_error("couldn't create a spill directory in '%s'", dir);
+            failed = 1;
+        }
+    } else {
+        tally_error("memory allocation failed for spill buffers");
+    }
+    if (failed) {
+        if (spill->dir != NULL) {
+            spill->dir[0] = '\0';       // nothing to remove
+        }
+        vote_spill_free(spill);
+        return -1;
+    }
+
+    tally->spill = spill;
+    return 0;
+}
+// Makes `tally`, which has its candidates but no votes yet, keep its
+// votes in run files in a new directory under `dir` rather than in
+// memory. The loaders call this when SPILL_DIR is set. Each run gets
+// a write buffer of SPILL_MEMORY divided between the runs (between
+// SPILL_BUFFER_MIN and SPILL_BUFFER_MAX bytes). Returns 0 on success
+// or -1 after printing an ERROR message.
+
+void vote_spill_free(vote_spill_t *spill){
+    if (spill == NULL) {
+        return;
+    }
+    for (int i = 0; spill->runs != NULL && i < spill->run_count; i++) {
+        if (spill->dir[0] != '\0') {
+            char path[PATH_MAX];
+            spill_run_path(spill, i, path);
+            unlink(path);
+        }
+        free(spill->runs[i].buf);
+    }
+    if (spill->dir != NULL && spill->dir[0] != '\0') {
+        rmdir(spill->dir);
+    }
+    free(spill->dir);
+    free(spill->runs);
+    free(spill->block);
+    free(spill->view);
+    free(spill);
+}
+// Removes the run files and their directory and de-allocates the
+// spill.
+
+vote_t *vote_spill_scratch(vote_spill_t *spill, int len){
+    vote_t *vote = spill->view;
+    vote->id = -1;
+    vote->pos = -1;
+    vote->weight = 1;
+    vote->len = len;
+    vote->rank_size = sizeof(cand_t);
+    vote->next = NULL;
+    return vote;
+}
+// Returns the spill's scratch vote initialized as tally_vote_alloc()
+// does, its preferences cand_t wide as in the run records. Loaders
+// fill it in and pass it to tally_add_vote() which copies it to a
+// run, so it is reused for every vote.
+
+void vote_spill_add_vote(tally_t *tally, vote_t *vote){
+    vote_spill_t *spill = tally->spill;
+    int candidate = (vote->pos < vote->len) ? VOTE_RANK(vote, vote->pos) : NO_CANDIDATE;
+    if (candidate == NO_CANDIDATE) {
+        spill_push(spill, tally->candidate_count, vote);
+        tally->invalid_vote_count++;
+    } else {
+        spill_push(spill, candidate, vote);
+        tally->candidate_vote_counts[candidate]++;
+    }
+}
+// tally_add_vote() for a spilled tally: appends a copy of the vote to
+// the run of its current candidate, or of the invalid votes. Spilled
+// votes always have a weight of 1.
+
+static void spill_print_run(vote_spill_t *spill, int run){
+    spill_cursor_t cursor;
+    spill_cursor_open(spill, run, &cursor);
+    while (spill_cursor_next(spill, &cursor, spill->view)) {
+        fprintf(tally_out(), "  ");
+        vote_print(spill->view);
+        fprintf(tally_out(), "\n");
+    }
+    spill_cursor_close(&cursor);
+}
+
+void vote_spill_print_votes(tally_t *tally){
+    vote_spill_t *spill = tally->spill;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        fprintf(tally_out(), "VOTES FOR CANDIDATE %d: %s\n", i, tally->candidate_names[i]);
+        spill_print_run(spill, i);
+        if (tally->stats != NULL) {
+            tally->stats->nodes_visited += spill->runs[i].count;
+        }
+        fprintf(tally_out(), "%ld votes total\n", spill->runs[i].count);
+    }
+
+    if (tally->invalid_vote_count > 0) {
+        fprintf(tally_out(), "INVALID VOTES\n");
+        spill_print_run(spill, tally->candidate_count);
+        fprintf(tally_out(), "%d votes total\n", tally->invalid_vote_count);
+    }
+
+    if (tally->exhausted_vote_count > 0) {
+        fprintf(tally_out(), "EXHAUSTED VOTES\n");
+        spill_print_run(spill, spill->run_count - 1);
+        if (tally->stats != NULL) {
+            tally->stats->nodes_visited += spill->runs[spill->run_count - 1].count;
+        }
+        fprintf(tally_out(), "%d votes total\n", tally->exhausted_vote_count);
+    }
+}
+// tally_print_votes() for a spilled tally: same output, reading every
+// run from its front. This reads all of the votes so it is only
+// sensible at LOG_SHOWVOTES.
+
+static void spill_transfer(tally_t *tally, int candidate_index, vote_t *vote){
+    vote_spill_t *spill = tally->spill;
+    vote->pos++;
+    int next_candidate = (tally->rounds != NULL) ? vote_next_active(vote, tally->rounds->active) :
+                                                   vote_next_candidate(vote, tally->candidate_status);
+    if (tally->stats != NULL) {
+        tally_stats_transfer(tally->stats, 1, next_candidate == NO_CANDIDATE);
+    }
+
+    if (next_candidate == NO_CANDIDATE) {
+        spill_push(spill, spill->run_count - 1, vote);
+        tally_count_exhausted(tally, 1);
+    } else {
+        spill_push(spill, next_candidate, vote);
+        tally->candidate_vote_counts[next_candidate]++;
+        if (tally->rounds != NULL) {
+            round_index_touch(tally->rounds, next_candidate);
+        }
+    }
+
+    if (LOG_ENABLED(LOG_VOTE_TRANSFERS)) {
+        tally_log_transfer(tally, vote, candidate_index, next_candidate);
+    }
+}
+// Moves one vote taken off the pile of `candidate_index` to its next
+// active candidate, or the exhausted run, as
+// tally_transfer_first_vote() does, including the logging.
+
+void vote_spill_transfer_first_vote(tally_t *tally, int candidate_index){
+    vote_spill_t *spill = tally->spill;
+    spill_run_t *r = &spill->runs[candidate_index];
+    if (r->count == 0) {
+        return;
+    }
+
+    // Take the front record off the buffer or the end of the file
+    spill_cursor_t cursor;
+    spill_cursor_open(spill, candidate_index, &cursor);
+    int found = spill_cursor_next(spill, &cursor, spill->view);
+    spill_cursor_close(&cursor);
+    if (!found) {
+        return;
+    }
+    size_t size = SPILL_RECORD_SIZE(spill->view->len);
+    if (r->len > 0) {
+        r->len -= size;
+    } else {
+        char path[PATH_MAX];
+        spill_run_path(spill, candidate_index, path);
+        if (truncate(path, r->file_len - size) != 0) {
+            spill_fail(spill, "truncate", candidate_index);
+            return;
+        }
+        r->file_len -= size;
+    }
+    r->count--;
+    tally->candidate_vote_counts[candidate_index]--;
+
+    spill_transfer(tally, candidate_index, spill->view);
+}
+// tally_transfer_first_vote() for a spilled tally: pops the front
+// vote of the candidate's run and moves it on.
+
+void vote_spill_transfer_all(tally_t *tally, int candidate_index){
+    vote_spill_t *spill = tally->spill;
+    spill_run_t *r = &spill->runs[candidate_index];
+    tally->candidate_vote_counts[candidate_index] -= r->count;
+
+    spill_cursor_t cursor;
+    spill_cursor_open(spill, candidate_index, &cursor);
+    while (spill_cursor_next(spill, &cursor, spill->view)) {
+        spill_transfer(tally, candidate_index, spill->view);
+    }
+    spill_cursor_close(&cursor);
+
+    // Every vote has moved on so the run is no longer needed
+    char path[PATH_MAX];
+    spill_run_path(spill, candidate_index, path);
+    unlink(path);
+    r->len = 0;
+    r->file_len = 0;
+    r->count = 0;
+}
+// Moves every vote of the candidate's run to its next active
+// candidate or the exhausted run, front to back, reading the run once
+// from its end, then removes the run.
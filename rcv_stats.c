@@ -0,0 +1,146 @@
+// rcv_stats.c: Timing and counters for Ranked Choice Voting elections
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// ELECTION STATS
+//
+// When COLLECT_STATS is set each loaded tally gets a tally_stats_t.
+// tally_election() times its phases with tally_stats_lap() and the
+// transfer and listing code of every vote store counts what it does,
+// both only when tally->stats is not NULL so runs without stats pay a
+// pointer check. The result sink prints them after the election.
+
+double tally_stats_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+// Returns a monotonic wall clock time in seconds.
+
+int tally_use_stats(tally_t *tally){
+    if (tally->stats != NULL) {
+        return 0;
+    }
+    tally_stats_t *stats = calloc(1, sizeof(tally_stats_t));
+    if (stats == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < tally->candidate_count; i++) {
+        stats->ballots_loaded += tally->candidate_vote_counts[i];
+    }
+    stats->ballots_loaded += tally->invalid_vote_count + tally->exhausted_vote_count;
+    tally->stats = stats;
+    return 0;
+}
+// Attaches empty stats to a loaded tally, counting the ballots it
+// holds. Returns 0 on success or -1 if memory runs out in which case
+// the tally is unchanged.
+
+void tally_stats_free(tally_stats_t *stats){
+    if (stats != NULL) {
+        free(stats->round_drop_sec);
+        free(stats);
+    }
+}
+
+void tally_stats_lap(tally_stats_t *stats, int phase, double *mark){
+    if (stats == NULL) {
+        return;
+    }
+    double now = tally_stats_now();
+    double elapsed = now - *mark;
+    *mark = now;
+    stats->phase_sec[phase] += elapsed;
+
+    // Each drop phase starts a round
+    if (phase == STAT_DROP) {
+        if (stats->rounds > stats->round_capacity) {
+            stats->rounds++;            // timing stopped when memory ran out
+            return;
+        }
+        if (stats->rounds == stats->round_capacity) {
+            int capacity = (stats->round_capacity == 0) ? 64 : 2 * stats->round_capacity;
+            double *bigger = realloc(stats->round_drop_sec, capacity * sizeof(double));
+            if (bigger == NULL) {
+                stats->rounds++;        // counted but not timed
+                return;
+            }
+            stats->round_drop_sec = bigger;
+            stats->round_capacity = capacity;
+        }
+        stats->round_drop_sec[stats->rounds++] = elapsed;
+    }
+}
+// Adds the time since `*mark` to `phase` and sets `*mark` to now so
+// consecutive phases can be timed with one clock reading each. Does
+// nothing if `stats` is NULL. If round_drop_sec[] can't grow, later
+// rounds are counted but no longer timed.
+
+void tally_stats_transfer(tally_stats_t *stats, int weight, int exhausted){
+    stats->nodes_visited++;
+    if (exhausted) {
+        stats->ballots_exhausted += weight;
+    } else {
+        stats->ballots_transferred += weight;
+    }
+}
+// Counts one vote of `weight` ballots visited by a transfer which
+// moved it to another candidate or, if `exhausted`, found no active
+// preference left on it.
+
+static char *stat_phase_names[STAT_PHASES] = {"load", "drop", "minvote", "print"};
+
+void tally_stats_print_json(tally_stats_t *stats){
+    FILE *out = tally_out();
+    fprintf(out, "{\"stats\":{");
+    for (int p = 0; p < STAT_PHASES; p++) {
+        fprintf(out, "\"%s_sec\":%.6f,", stat_phase_names[p], stats->phase_sec[p]);
+    }
+    fprintf(out, "\"rounds\":%d,\"round_drop_sec\":[", stats->rounds);
+    int timed = (stats->rounds < stats->round_capacity) ? stats->rounds : stats->round_capacity;
+    for (int r = 0; r < timed; r++) {
+        fprintf(out, "%s%.6f", r == 0 ? "" : ",", stats->round_drop_sec[r]);
+    }
+    fprintf(out, "],\"ballots_loaded\":%ld,\"ballots_transferred\":%ld,"
+            "\"ballots_exhausted\":%ld,\"nodes_visited\":%ld}}\n",
+            stats->ballots_loaded, stats->ballots_transferred,
+            stats->ballots_exhausted, stats->nodes_visited);
+}
+// Prints the stats as one JSON object on a line such as
+//
+// {"stats":{"load_sec":0.051234,"drop_sec":0.010012,"minvote_sec":0.000031,
+//  "print_sec":0.000410,"rounds":3,"round_drop_sec":[0.000001,0.004120,0.005891],
+//  "ballots_loaded":200000,"ballots_transferred":81234,"ballots_exhausted":0,
+//  "nodes_visited":81234}}
+//
+// Times are in seconds: load is reading the votes file, drop is
+// dropping the MINVOTES candidates and transferring their votes (also
+// given per round), minvote is finding the next MINVOTES candidates
+// and the tally condition and print is reporting rounds and listing
+// votes. ballots_transferred and ballots_exhausted count ballots by
+// weight; nodes_visited counts the votes (list nodes, matrix rows or
+// spilled records) that transfers and LOG_SHOWVOTES listings went
+// through.
+
+void tally_stats_print_csv(tally_stats_t *stats){
+    FILE *out = tally_out();
+    for (int p = 0; p < STAT_PHASES; p++) {
+        fprintf(out, "stats,,%s_sec,%.6f,,\n", stat_phase_names[p], stats->phase_sec[p]);
+    }
+    int timed = (stats->rounds < stats->round_capacity) ? stats->rounds : stats->round_capacity;
+    for (int r = 0; r < timed; r++) {
+        fprintf(out, "stats,%d,drop_sec,%.6f,,\n", r + 1, stats->round_drop_sec[r]);
+    }
+    fprintf(out, "stats,,rounds,%d,,\n", stats->rounds);
+    fprintf(out, "stats,,ballots_loaded,%ld,,\n", stats->ballots_loaded);
+    fprintf(out, "stats,,ballots_transferred,%ld,,\n", stats->ballots_transferred);
+    fprintf(out, "stats,,ballots_exhausted,%ld,,\n", stats->ballots_exhausted);
+    fprintf(out, "stats,,nodes_visited,%ld,,\n", stats->nodes_visited);
+}
+// Prints the same stats as CSV rows "stats,ROUND,NAME,VALUE,," in the
+// columns of the RESULT_CSV format, with the round only given for the
+// per-round drop times.
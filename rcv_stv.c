@@ -0,0 +1,303 @@
+// rcv_stv.c: Multi-winner Single Transferable Vote counts
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// SINGLE TRANSFERABLE VOTE
+//
+// With SEATS above 1, tally_election() fills the seats with an STV
+// count instead of finding a single winner. It uses a Droop quota and
+// transfers surpluses the weighted inclusive Gregory way: every vote
+// of an elected candidate moves on, its value scaled down by the
+// candidate's surplus over their total. Values are fixed-point
+// numbers of STV_SCALE units per ballot, truncated after each scaling
+// so counts are exact and the same on every machine.
+//
+// Votes stay on the tally's candidate lists and move with the same
+// vote_next_candidate() as single-winner rounds; elected candidates
+// have status CAND_ELECTED so they are skipped like dropped ones. The
+// value of each vote is kept by vote id rather than in the vote_t, so
+// a vote standing for many identical ballots (DEDUP_VOTES) is scaled
+// once for all of them and single-winner tallies pay nothing for it.
+
+// State of an STV count beside its tally
+typedef struct {
+  int seats;                            // seats to fill
+  long quota;                           // Droop quota as a value
+  long *totals;                         // value of each candidate's votes
+  long exhausted;                       // value of the exhausted votes
+  int *values;                          // value of one ballot of each vote, by vote id
+  int *elected;                         // candidates in the order they were elected
+  int elected_count;                    // entries in elected[]
+  char *surplus_done;                   // 1 once an elected candidate's surplus has moved
+} stv_t;
+
+void stv_format_value(char *buf, long value){
+    sprintf(buf, "%ld.%05ld", value / STV_SCALE, value % STV_SCALE);
+}
+// Writes a value as a decimal number with 5 places, e.g. "12.34567",
+// into `buf` which needs room for 32 characters.
+
+static int stv_init(tally_t *tally, stv_t *stv, int seats){
+    memset(stv, 0, sizeof(stv_t));
+    stv->seats = seats;
+
+    // Values are indexed by vote id which runs up to the ballot count
+    int max_id = 0;
+    long ballots = 0;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        for (vote_t *vote = tally->candidate_votes[i]; vote != NULL; vote = vote->next) {
+            if (vote->id > max_id) {
+                max_id = vote->id;
+            }
+        }
+        ballots += tally->candidate_vote_counts[i];
+    }
+
+    stv->totals = calloc(tally->candidate_count + 1, sizeof(long));
+    stv->values = malloc((max_id + 1) * sizeof(int));
+    stv->elected = malloc((tally->candidate_count + 1) * sizeof(int));
+    stv->surplus_done = calloc(tally->candidate_count + 1, 1);
+    if (stv->totals == NULL || stv->values == NULL || stv->elected == NULL ||
+        stv->surplus_done == NULL) {
+        return -1;
+    }
+    for (int id = 0; id <= max_id; id++) {
+        stv->values[id] = STV_SCALE;
+    }
+    for (int i = 0; i < tally->candidate_count; i++) {
+        stv->totals[i] = (long) tally->candidate_vote_counts[i] * STV_SCALE;
+    }
+
+    // Droop: the fewest whole votes that no more than `seats`
+    // candidates can reach
+    stv->quota = (ballots / (seats + 1) + 1) * STV_SCALE;
+    return 0;
+}
+// Sets up the count for `tally`, every vote starting at a full value
+// of STV_SCALE. Returns 0 on success or -1 if memory runs out.
+
+static void stv_free(stv_t *stv){
+    free(stv->totals);
+    free(stv->values);
+    free(stv->elected);
+    free(stv->surplus_done);
+}
+
+static void stv_transfer_all(tally_t *tally, stv_t *stv, int from, long keep, long total){
+    vote_t *vote = tally->candidate_votes[from];
+    tally->candidate_votes[from] = NULL;
+    tally->candidate_vote_counts[from] = 0;
+
+    while (vote != NULL) {
+        vote_t *next_vote = vote->next;
+
+        // Votes carry on with the part of their value not kept
+        if (keep > 0) {
+            stv->values[vote->id] = (long) stv->values[vote->id] * (total - keep) / total;
+        }
+        long value = (long) vote->weight * stv->values[vote->id];
+
+        vote->pos++;
+        int next_candidate = vote_next_candidate(vote, tally->candidate_status);
+        if (tally->stats != NULL) {
+            tally_stats_transfer(tally->stats, vote->weight, next_candidate == NO_CANDIDATE);
+        }
+        if (next_candidate == NO_CANDIDATE) {
+            vote->next = tally->exhausted_votes;
+            tally->exhausted_votes = vote;
+            tally_count_exhausted(tally, vote->weight);
+            stv->exhausted += value;
+        } else {
+            vote->next = tally->candidate_votes[next_candidate];
+            tally->candidate_votes[next_candidate] = vote;
+            tally->candidate_vote_counts[next_candidate] += vote->weight;
+            stv->totals[next_candidate] += value;
+        }
+
+        if (LOG_ENABLED(LOG_VOTE_TRANSFERS)) {
+            tally_log_transfer(tally, vote, from, next_candidate);
+        }
+        vote = next_vote;
+    }
+    stv->totals[from] = keep;
+}
+// Moves every vote of `from` to its next active candidate or the
+// exhausted votes in one pass over the list. When `keep` is 0 (an
+// eliminated candidate) votes move at their full value; otherwise
+// `from` keeps `keep` of their `total` value and each vote moves on
+// with its value scaled by (total - keep) / total, which is the
+// surplus transfer of an elected candidate keeping a quota.
+
+static int stv_elect(tally_t *tally, stv_t *stv, int candidate){
+    tally->candidate_status[candidate] = CAND_ELECTED;
+    stv->elected[stv->elected_count++] = candidate;
+    if (LOG_ENABLED(LOG_DROP_MINVOTES)) {
+        fprintf(tally_out(), "LOG: Elected Candidate %d: %s\n", candidate, tally->candidate_names[candidate]);
+    }
+    return stv->elected_count == stv->seats;
+}
+// Gives `candidate` a seat. Returns 1 if every seat is now filled.
+
+static int stv_best_active(tally_t *tally, stv_t *stv, long at_least){
+    int best = NO_CANDIDATE;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        if (tally->candidate_status[i] == CAND_ACTIVE && stv->totals[i] >= at_least &&
+            (best == NO_CANDIDATE || stv->totals[i] > stv->totals[best])) {
+            best = i;
+        }
+    }
+    return best;
+}
+// Returns the ACTIVE candidate with the highest value of at least
+// `at_least`, the lowest index among equals, or NO_CANDIDATE.
+
+static int stv_step(tally_t *tally, stv_t *stv){
+    tally->round_exhausted_count = 0;
+
+    // Elect everyone at the quota, highest first
+    int candidate;
+    while ((candidate = stv_best_active(tally, stv, stv->quota)) != NO_CANDIDATE) {
+        if (stv_elect(tally, stv, candidate)) {
+            return 1;
+        }
+    }
+
+    // Once the remaining candidates just fill the seats they all win
+    int active_count = 0;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        active_count += tally->candidate_status[i] == CAND_ACTIVE;
+    }
+    if (active_count + stv->elected_count <= stv->seats) {
+        while ((candidate = stv_best_active(tally, stv, 0)) != NO_CANDIDATE) {
+            stv_elect(tally, stv, candidate);
+        }
+        return 1;
+    }
+
+    // Transfer the largest surplus not yet transferred
+    int surplus_from = NO_CANDIDATE;
+    for (int k = 0; k < stv->elected_count; k++) {
+        int e = stv->elected[k];
+        if (!stv->surplus_done[e] && (surplus_from == NO_CANDIDATE || stv->totals[e] > stv->totals[surplus_from])) {
+            surplus_from = e;
+        }
+    }
+    if (surplus_from != NO_CANDIDATE) {
+        stv->surplus_done[surplus_from] = 1;
+        long total = stv->totals[surplus_from];
+        if (total > stv->quota) {
+            if (LOG_ENABLED(LOG_MINVOTE)) {
+                char buf[32];
+                stv_format_value(buf, total - stv->quota);
+                fprintf(tally_out(), "LOG: Surplus of %s from candidate %d: %s\n",
+                        buf, surplus_from, tally->candidate_names[surplus_from]);
+            }
+            stv_transfer_all(tally, stv, surplus_from, stv->quota, total);
+            return 0;
+        }
+    }
+
+    // Otherwise the lowest candidate is out, the lowest index among equals
+    int lowest = NO_CANDIDATE;
+    for (int i = 0; i < tally->candidate_count; i++) {
+        if (tally->candidate_status[i] == CAND_ACTIVE &&
+            (lowest == NO_CANDIDATE || stv->totals[i] < stv->totals[lowest])) {
+            lowest = i;
+        }
+    }
+    tally->candidate_status[lowest] = CAND_DROPPED;
+    stv_transfer_all(tally, stv, lowest, 0, stv->totals[lowest]);
+    if (LOG_ENABLED(LOG_DROP_MINVOTES)) {
+        fprintf(tally_out(), "LOG: Dropped Candidate %d: %s\n", lowest, tally->candidate_names[lowest]);
+    }
+    return 0;
+}
+// One stage of the count: elects candidates at the quota and, if
+// seats remain, either transfers one surplus or drops the lowest
+// candidate. An elected candidate whose total is exactly the quota has
+// no surplus and keeps their votes. Returns 1 once every seat is
+// filled.
+
+int tally_stv(tally_t *tally, int seats){
+    result_sink_t *sink = result_sink(RESULT_FORMAT);
+    if (tally->matrix != NULL || tally->spill != NULL) {
+        tally_error("STV counts need votes in lists, not a matrix or spill");
+        sink->result(tally, 0, TALLY_ERROR);
+        return -1;
+    }
+    if (tally->rounds_done != 0) {
+        tally_error("STV counts can't resume a single-winner checkpoint");
+        sink->result(tally, 0, TALLY_ERROR);
+        return -1;
+    }
+    stv_t stv;
+    if (stv_init(tally, &stv, seats) != 0) {
+        stv_free(&stv);
+        tally_error("memory allocation failed for STV count");
+        sink->result(tally, 0, TALLY_ERROR);
+        return -1;
+    }
+    tally_stats_t *stats = tally->stats;
+    double mark = (stats != NULL) ? tally_stats_now() : 0;
+
+    int round = 1;
+    while (1) {
+        sink->round_begin(tally, round);
+        sink->stv_round(tally, round, stv.totals, stv.quota, stv.exhausted);
+        if (LOG_ENABLED(LOG_SHOWVOTES)) {
+            tally_print_votes(tally);
+        }
+        tally_stats_lap(stats, STAT_PRINT, &mark);
+
+        int done = stv_step(tally, &stv);
+        tally_stats_lap(stats, STAT_DROP, &mark);
+        if (done) {
+            break;
+        }
+        round++;
+    }
+
+    sink->stv_result(tally, round, stv.elected, stv.elected_count);
+    if (tally->pairwise != NULL) {
+        sink->pairwise(tally);
+    }
+    if (stats != NULL) {
+        tally_stats_lap(stats, STAT_PRINT, &mark);
+        sink->stats(tally);
+    }
+    stv_free(&stv);
+    return 0;
+}
+// Fills `seats` seats from `tally` with a Single Transferable Vote
+// count, reporting each round and then the elected candidates through
+// the RESULT_FORMAT sink. Each round shows the value of every
+// candidate's votes before that round's stage (see stv_step()); the
+// table format prints
+//
+// === ROUND 2 ===
+// NUM      VOTES S NAME
+//   0  334.00000 E Francis
+//   1  290.50000 A Claire
+//   2          - D Heather
+//   3  211.33333 A Viktor
+// Quota: 334.00000
+// Exhausted: 12.16667
+//
+// with status E for elected candidates and the exhausted value only
+// once there is some, then one line per seat in the order they were
+// filled:
+//
+// Elected: Francis (candidate 0)
+// Elected: Claire (candidate 1)
+//
+// A candidate is elected when their value reaches the quota, and the
+// remaining candidates are all elected once they just fill the
+// remaining seats. Ties are broken in favour of the lower candidate
+// index. Pairwise counts, if the tally has them, follow the elected
+// candidates as after a single-winner election. The tally must hold
+// its votes in lists; returns 0 or -1 after printing an ERROR message
+// if it holds them in a matrix or spill, was resumed from a
+// checkpoint or memory runs out.
@@ -0,0 +1,321 @@
+// rcv_test.c: Regression tests for Ranked Choice Voting
+
+#include "rcv.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TEST_PATH 256           // bytes in a scratch file path
+
+////////////////////////////////////////////////////////////////////////////////
+// TEST HELPERS
+//
+// Each test prints PASS or FAIL and its name. Test files are written
+// to a scratch directory which is removed at the end, and messages
+// printed by the code under test are captured through TALLY_OUT so
+// tests can check for the ERROR they expect.
+
+static int failures = 0;
+static char scratch[] = "/tmp/rcv_test.XXXXXX";
+
+static void check(char *name, int ok){
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+    if (!ok) {
+        failures++;
+    }
+}
+
+static void scratch_path(char *path, char *name){
+    snprintf(path, TEST_PATH, "%s/%s", scratch, name);
+}
+// Puts the path of `name` in the scratch directory in `path`.
+
+static int write_file(char *fname, char *data, size_t len){
+    FILE *file = fopen(fname, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    int ok = fwrite(data, 1, len, file) == len;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+static char *read_file(char *fname, size_t *len){
+    FILE *file = fopen(fname, "rb");
+    char *data = NULL;
+    if (file != NULL && fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        data = (size < 0) ? NULL : malloc(size + 1);
+        rewind(file);
+        if (data != NULL && (long) fread(data, 1, size, file) != size) {
+            free(data);
+            data = NULL;
+        }
+        *len = size;
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return data;
+}
+// Returns the contents of `fname` in a malloc()'d buffer, or NULL.
+
+typedef struct {
+  FILE *stream;                 // replaces TALLY_OUT while capturing
+  char *text;                   // everything printed, once stopped
+  size_t len;                   // bytes in text
+} capture_t;
+
+static void capture_start(capture_t *capture){
+    capture->text = NULL;
+    capture->stream = open_memstream(&capture->text, &capture->len);
+    TALLY_OUT = capture->stream;
+}
+
+static char *capture_stop(capture_t *capture){
+    TALLY_OUT = NULL;
+    if (capture->stream != NULL) {
+        fclose(capture->stream);
+    }
+    return (capture->text != NULL) ? capture->text : "";
+}
+// Ends a capture and returns what was printed, which the caller
+// frees with free(capture->text).
+
+////////////////////////////////////////////////////////////////////////////////
+// CHECKPOINTS
+//
+// A checkpoint of a short election is corrupted in one place at a
+// time; tally_from_checkpoint() must refuse every copy with an ERROR
+// rather than resume from it or crash.
+
+static char *ckpt_votes =
+    "4\n"
+    "Francis Claire Heather Viktor\n"
+    "0 1 2 3\n1 0 2 3\n2 1 0 3\n0 2 1 3\n3 2 1 0\n"
+    "1 2 3 0\n0 3 2 1\n2 0 1 3\n1 3 0 2\n0 1 3 2\n";
+
+typedef struct {
+  rcvc_header_t header;         // copy of the file's header
+  char *rank;                   // the first vote's id, weight and len
+  int32_t *fields;              // round, invalid, exhausted, round exhausted
+  char *status;                 // candidate statuses
+  int32_t *counts;              // candidate counts
+  int32_t *order;               // slots of the piles' votes
+} ckpt_view_t;
+
+static void ckpt_view(char *data, ckpt_view_t *view){
+    memcpy(&view->header, data, sizeof(rcvc_header_t));
+    int count = view->header.candidate_count;
+    view->rank = data + sizeof(rcvc_header_t) + (size_t) count * MAX_NAME;
+    char *state = view->rank + view->header.rank_bytes + view->header.state * view->header.state_bytes;
+    view->fields = (int32_t *) state;
+    view->status = state + 4 * sizeof(int32_t);
+    view->counts = (int32_t *) (view->status + ((count + 3) & ~3));
+    view->order = view->counts + count + count + 2;
+}
+// Points `view` at the parts of the checkpoint in `data` that the
+// tests corrupt, following the layout in rcv_checkpoint.c.
+
+static void ckpt_write_int(char *at, int32_t value){
+    memcpy(at, &value, sizeof(value));
+}
+
+static void ckpt_bad_candidate(ckpt_view_t *view){
+    cand_t candidate = view->header.candidate_count;
+    memcpy(view->rank + 3 * sizeof(int32_t), &candidate, sizeof(candidate));
+}
+
+static void ckpt_repeated_slot(ckpt_view_t *view){
+    view->order[1] = view->order[0];
+}
+
+static void ckpt_negative_id(ckpt_view_t *view){
+    ckpt_write_int(view->rank, -1000000);
+}
+
+static void ckpt_repeated_id(ckpt_view_t *view){
+    int32_t id, len;
+    memcpy(&id, view->rank, sizeof(id));
+    memcpy(&len, view->rank + 2 * sizeof(int32_t), sizeof(len));
+    char *second = view->rank + ((3 * sizeof(int32_t) + len * sizeof(cand_t) + 3) & ~(size_t) 3);
+    ckpt_write_int(second, id);
+}
+
+static void ckpt_zero_weight(ckpt_view_t *view){
+    ckpt_write_int(view->rank + sizeof(int32_t), 0);
+}
+
+static void ckpt_bad_status(ckpt_view_t *view){
+    view->status[0] = 'X';
+}
+
+static void ckpt_wrong_count(ckpt_view_t *view){
+    view->counts[0]++;
+}
+
+static void ckpt_wrong_exhausted(ckpt_view_t *view){
+    view->fields[2]++;
+}
+
+static void test_checkpoints(void){
+    char votes[TEST_PATH], ckpt[TEST_PATH], bad[TEST_PATH];
+    scratch_path(votes, "ckpt_votes.txt");
+    scratch_path(ckpt, "ckpt.rcvc");
+    scratch_path(bad, "ckpt_bad.rcvc");
+    if (write_file(votes, ckpt_votes, strlen(ckpt_votes)) != 0) {
+        check("checkpoint written", 0);
+        return;
+    }
+
+    capture_t capture;
+    capture_start(&capture);
+    CHECKPOINT_FILE = ckpt;
+    tally_t *tally = tally_load(votes);
+    if (tally != NULL) {
+        tally_election(tally);
+    }
+    tally_free(tally);
+    CHECKPOINT_FILE = NULL;
+    capture_stop(&capture);
+    free(capture.text);
+
+    size_t len;
+    char *image = read_file(ckpt, &len);
+    check("checkpoint written", image != NULL);
+    if (image == NULL) {
+        unlink(votes);
+        return;
+    }
+
+    capture_start(&capture);
+    tally = tally_from_checkpoint(ckpt);
+    capture_stop(&capture);
+    free(capture.text);
+    check("checkpoint resumes", tally != NULL);
+    tally_free(tally);
+
+    struct {
+      char *name;                           // test name
+      void (*corrupt)(ckpt_view_t *view);   // the change made to the checkpoint
+      char *error;                          // what the ERROR message must say
+    } cases[] = {
+        {"checkpoint with invalid candidate", ckpt_bad_candidate, "invalid candidate"},
+        {"checkpoint with repeated slot", ckpt_repeated_slot, "bad vote piles"},
+        {"checkpoint with negative vote id", ckpt_negative_id, "bad id or weight"},
+        {"checkpoint with repeated vote id", ckpt_repeated_id, "more than once"},
+        {"checkpoint with zero weight", ckpt_zero_weight, "bad id or weight"},
+        {"checkpoint with bad status", ckpt_bad_status, "bad round state"},
+        {"checkpoint with wrong count", ckpt_wrong_count, "bad vote piles"},
+        {"checkpoint with wrong exhausted count", ckpt_wrong_exhausted, "bad vote piles"},
+    };
+    char *copy = malloc(len + 1);
+    for (size_t c = 0; copy != NULL && c < sizeof(cases) / sizeof(cases[0]); c++) {
+        memcpy(copy, image, len);
+        ckpt_view_t view;
+        ckpt_view(copy, &view);
+        cases[c].corrupt(&view);
+        int ok = write_file(bad, copy, len) == 0;
+
+        capture_start(&capture);
+        tally = ok ? tally_from_checkpoint(bad) : NULL;
+        char *text = capture_stop(&capture);
+        check(cases[c].name, ok && tally == NULL && strstr(text, "ERROR") != NULL &&
+                             strstr(text, cases[c].error) != NULL);
+        tally_free(tally);
+        free(capture.text);
+    }
+    free(copy);
+    free(image);
+    unlink(bad);
+    unlink(ckpt);
+    unlink(votes);
+}
+// Each corrupt copy is checked for the ERROR naming what is wrong
+// with it, so a copy refused for some other reason fails the test.
+
+////////////////////////////////////////////////////////////////////////////////
+// WHAT-IF SCENARIOS
+//
+// Ballots are excluded by vote id, and rejected vote lines use up an
+// id, so excluding N always leaves out the Nth vote line of the file.
+
+static char *whatif_votes =
+    "3\n"
+    "Francis Claire Heather\n"
+    "0 1 2\n1 0 2\n\n2 1 0\n0 1\n7 1 0\n1 2 0\n2 0 1\n";
+
+static void test_whatif(void){
+    char votes[TEST_PATH];
+    scratch_path(votes, "whatif_votes.txt");
+    if (write_file(votes, whatif_votes, strlen(whatif_votes)) != 0) {
+        check("whatif votes loaded", 0);
+        return;
+    }
+
+    capture_t capture;
+    capture_start(&capture);
+    tally_t *tally = tally_load(votes);
+    live_tally_t *live = (tally != NULL) ? live_tally_start(tally) : NULL;
+    char *text = capture_stop(&capture);
+    check("whatif votes loaded", live != NULL);
+    check("rejected lines have vote ids", strstr(text, "line 7 vote #0004:") != NULL &&
+                                          strstr(text, "line 8 vote #0005:") != NULL);
+    free(capture.text);
+    if (live == NULL) {
+        tally_free(tally);
+        unlink(votes);
+        return;
+    }
+
+    struct {
+      char *scenario;               // changes to count
+      int counts[3];                // first round count of each candidate
+    } cases[] = {
+        {"none", {1, 2, 2}},
+        {"exclude 4-5", {1, 2, 2}},
+        {"exclude 6", {1, 1, 2}},
+        {"exclude 7", {1, 2, 1}},
+        {"exclude 2-6", {1, 0, 1}},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        capture_start(&capture);
+        tally = live_tally_whatif(live, cases[c].scenario);
+        capture_stop(&capture);
+        free(capture.text);
+        int ok = tally != NULL;
+        for (int i = 0; ok && i < 3; i++) {
+            ok = tally->candidate_vote_counts[i] == cases[c].counts[i];
+        }
+        char name[TEST_PATH];
+        snprintf(name, sizeof(name), "whatif '%s' of a file with rejected lines", cases[c].scenario);
+        check(name, ok);
+        tally_free(tally);
+    }
+    live_tally_free(live);
+    unlink(votes);
+}
+// Vote lines 4 and 5 are rejected, so excluding them changes nothing
+// and excluding 6 and 7 leaves out the ballots on the lines after.
+
+int main(int argc, char *argv[]) {
+    (void) argv;
+    if (argc != 1) {
+        printf("Usage: rcv_test\n");
+        return 1;
+    }
+    if (mkdtemp(scratch) == NULL) {
+        printf("ERROR: couldn't make a scratch directory\n");
+        return 1;
+    }
+
+    test_checkpoints();
+    test_whatif();
+
+    rmdir(scratch);
+    if (failures > 0) {
+        printf("%d tests failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}